@@ -10,6 +10,26 @@ inb(uint16_t port)
     return res;
 }
 
+static inline uint16_t
+inw(uint16_t port)
+{
+    uint16_t res;
+    asm volatile("inw %1, %0"
+                 : "=a" (res)
+                 : "d" (port));
+    return res;
+}
+
+static inline uint32_t
+inl(uint16_t port)
+{
+    uint32_t res;
+    asm volatile("inl %1, %0"
+                 : "=a" (res)
+                 : "d" (port));
+    return res;
+}
+
 static inline void
 insl(uint16_t port, void *addr, uint32_t cnt)
 {
@@ -27,6 +47,22 @@ outb(uint16_t port, uint8_t data)
                  : "a" (data), "d" (port));
 }
 
+static inline void
+outw(uint16_t port, uint16_t data)
+{
+    asm volatile("outw %0, %1"
+                 :
+                 : "a" (data), "d" (port));
+}
+
+static inline void
+outl(uint16_t port, uint32_t data)
+{
+    asm volatile("outl %0, %1"
+                 :
+                 : "a" (data), "d" (port));
+}
+
 static inline void
 stosb(void *addr, uint8_t data, uint32_t cnt)
 {
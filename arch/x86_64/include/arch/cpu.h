@@ -82,6 +82,7 @@ struct context {
     uint64_t rip;
 };
 
+int cpu_id(struct x86_64_cpu*);
 struct thread* cpu_idle_thread(struct x86_64_cpu*);
 void cpu_set_idle_thread(struct x86_64_cpu*, struct thread*);
 void cpu_clear_thread(struct x86_64_cpu*);
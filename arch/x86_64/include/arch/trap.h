@@ -28,6 +28,7 @@
 #define T_IRQ_KBD       (T_IRQ0+1)
 #define T_IRQ_COM1      (T_IRQ0+4)
 #define T_IRQ_IDE       (T_IRQ0+14)
+#define T_IRQ_IDE2      (T_IRQ0+15)
 #define T_IRQ_ERROR     (T_IRQ0+19)
 #define T_IRQ_SPURIOUS  (T_IRQ0+31)
 
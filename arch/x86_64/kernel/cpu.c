@@ -29,6 +29,12 @@ mycpu(void)
     return 0;
 }
 
+int
+cpu_id(struct x86_64_cpu *c)
+{
+    return c - x86_64_cpus;
+}
+
 void
 cpu_clear_thread(struct x86_64_cpu *c)
 {
@@ -7,6 +7,18 @@ readb(port_t port)
     return inb(port);
 }
 
+uint16_t
+readw(port_t port)
+{
+    return inw(port);
+}
+
+uint32_t
+readl(port_t port)
+{
+    return inl(port);
+}
+
 void
 readn(port_t port, void *addr, size_t n)
 {
@@ -19,6 +31,18 @@ writeb(port_t port, uint8_t data)
     outb(port, data);
 }
 
+void
+writew(port_t port, uint16_t data)
+{
+    outw(port, data);
+}
+
+void
+writel(port_t port, uint32_t data)
+{
+    outl(port, data);
+}
+
 void
 writen(port_t port, const void *addr, size_t n)
 {
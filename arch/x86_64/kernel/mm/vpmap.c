@@ -1,6 +1,8 @@
 #include <kernel/vpmap.h>
 #include <kernel/pmem.h>
 #include <kernel/proc.h>
+#include <kernel/thread.h>
+#include <kernel/swap.h>
 #include <kernel/kmalloc.h>
 #include <kernel/console.h>
 #include <kernel/util.h>
@@ -10,6 +12,14 @@
 #include <lib/stddef.h>
 #include <arch/mmu.h>
 #include <arch/asm.h>
+#include <arch/cpu.h>
+
+/*
+ * A swapped out page keeps its swap ID in the address bits of its non-present
+ * page table entry.
+ */
+#define PTE_SWAPID(pte) ((swapid_t) (PTE_ADDR(pte) >> 12))
+#define SWAPID_PTE(swapid) ((pte_t) (swapid) << 12)
 
 /*
  * vpmap allocator
@@ -67,10 +77,9 @@ find_pte(pml4e_t *pml4, vaddr_t vaddr, int alloc)
     // top level walk
     pml4e = &pml4[PML4X(vaddr)];
     if ((*pml4e & PTE_P) == 0) {
-        if (!alloc || pmem_alloc(&paddr) != ERR_OK) {
+        if (!alloc || pmem_alloc_zeroed(&paddr) != ERR_OK) {
             return NULL;
         }
-        memset((void*) KMAP_P2V(paddr), 0, pg_size);
         *pml4e = paddr | PTE_P | PTE_W | PTE_U;
     }
 
@@ -78,10 +87,9 @@ find_pte(pml4e_t *pml4, vaddr_t vaddr, int alloc)
     pdpt = (pdpte_t* )KMAP_P2V(PML4E_ADDR(*pml4e));
     pdpte = &pdpt[PDPTX(vaddr)];
     if ((*pdpte & PTE_P) == 0) {
-        if (!alloc || pmem_alloc(&paddr) != ERR_OK) {
+        if (!alloc || pmem_alloc_zeroed(&paddr) != ERR_OK) {
             return NULL;
         }
-        memset((void*) KMAP_P2V(paddr), 0, pg_size);
         *pdpte = paddr | PTE_P | PTE_W | PTE_U;
     }
 
@@ -89,10 +97,9 @@ find_pte(pml4e_t *pml4, vaddr_t vaddr, int alloc)
     pgdir = (pde_t*) KMAP_P2V(PDPTE_ADDR(*pdpte));
     pde = &pgdir[PDX(vaddr)];
     if ((*pde & PTE_P) == 0) {
-        if (!alloc || pmem_alloc(&paddr) != ERR_OK) {
+        if (!alloc || pmem_alloc_zeroed(&paddr) != ERR_OK) {
             return NULL;
         }
-        memset((void*) KMAP_P2V(paddr), 0, pg_size);
         *pde = paddr | PTE_P | PTE_W | PTE_U;
     }
 
@@ -105,6 +112,8 @@ clear_pte(pte_t *pte, int free_swap) {
     kassert(pte);
     if (*pte & PTE_P) {
         pmem_dec_refcnt(PPN(*pte));
+    } else if (free_swap && PTE_SWAPID(*pte) != SWAPID_NONE) {
+        swap_free(PTE_SWAPID(*pte));
     }
     //*pte = PTE_FLAGS(*pte) & 0xffe;
     *pte = 0;
@@ -273,11 +282,10 @@ vpmap_create(void)
     if ((vpmap = kmem_cache_alloc(vpmap_allocator)) == NULL) {
         return NULL;
     }
-    if (pmem_alloc(&paddr) != ERR_OK) {
+    if (pmem_alloc_zeroed(&paddr) != ERR_OK) {
         return NULL;
     }
     vpmap->pml4 = (pde_t*)KMAP_P2V(paddr);
-    memset(vpmap->pml4, 0, pg_size);
 
     // TODO: initialize with no regions?
     return vpmap;
@@ -347,13 +355,16 @@ vpmap_copy(struct vpmap *srcvpmap, struct vpmap *dstvpmap, vaddr_t srcaddr, vadd
             // Return an error if address already mapped
             return ERR_VPMAP_MAP;
         }
-        err_t err;
-        paddr_t paddr;
-        if ((err = pmem_alloc(&paddr)) != ERR_OK) {
-            return err;
+        if ((*src_pte & PTE_P) == 0) {
+            // a swapped out page, both mappings share its swap slot
+            swap_dup(PTE_SWAPID(*src_pte));
+            *dst_pte = SWAPID_PTE(PTE_SWAPID(*src_pte));
+            continue;
         }
-        memcpy((void*)KMAP_P2V(paddr), (void*)KMAP_P2V(PTE_ADDR(*src_pte)), pg_size);
-        *dst_pte = PPN(paddr) | PTE_P | perm;
+        // share the physical page instead of copying it, both mappings get memperm
+        pmem_inc_refcnt(PTE_ADDR(*src_pte), 1);
+        *src_pte = PPN(*src_pte) | PTE_P | perm;
+        *dst_pte = PPN(*src_pte) | PTE_P | perm;
     }
     return ERR_OK;
 }
@@ -391,10 +402,26 @@ vpmap_lookup_vaddr(struct vpmap *vpmap, vaddr_t vaddr, paddr_t *paddr, swapid_t
             }
             return ERR_OK;
         }
+        if (swapid) {
+            *swapid = PTE_SWAPID(*pte);
+        }
     }
     return ERR_VPMAP_NOTPRESENT;
 }
 
+err_t
+vpmap_put_swapid(struct vpmap *vpmap, vaddr_t vaddr, swapid_t swapid) {
+    kassert(vpmap);
+    pte_t *pte = find_pte(vpmap->pml4, vaddr, 0);
+    if (pte == NULL || (*pte & PTE_P) == 0) {
+        return ERR_VPMAP_NOTPRESENT;
+    }
+    // xchg is a full barrier: the page is unmapped before the caller checks
+    // whether other cpus might still be using the old entry
+    __sync_lock_test_and_set(pte, SWAPID_PTE(swapid));
+    return ERR_OK;
+}
+
 paddr_t
 kmap_v2p(vaddr_t vaddr)
 {
@@ -459,6 +486,35 @@ vpmap_get_accessed(struct vpmap *vpmap, vaddr_t vaddr, int *accessed) {
     return ERR_VPMAP_NOTPRESENT;
 }
 
+void
+vpmap_clear_accessed(struct vpmap *vpmap, vaddr_t vaddr) {
+    pte_t *pte = find_pte(vpmap->pml4, vaddr, 0);
+    if (pte) {
+        // the cpu sets accessed and dirty bits concurrently, don't lose them
+        __sync_fetch_and_and(pte, ~(pte_t) PTE_A);
+    }
+}
+
+int
+vpmap_in_use(struct vpmap *vpmap) {
+    struct thread *t;
+    struct proc *p;
+    int i, self, in_use = 0;
+
+    kassert(vpmap);
+    intr_set_level(INTR_OFF);
+    self = cpu_id(mycpu());
+    // a cpu caches a vpmap's entries in its tlb only while running one of its
+    // threads, switching threads reloads cr3
+    for (i = 0; i < ncpu && !in_use; i++) {
+        if (i != self && (t = x86_64_cpus[i].thread) != NULL && (p = t->proc) != NULL) {
+            in_use = p->as.vpmap == vpmap;
+        }
+    }
+    intr_set_level(INTR_ON);
+    return in_use;
+}
+
 void
 vpmap_flush_tlb() {
     intr_set_level(INTR_OFF);
@@ -9,13 +9,15 @@
 #include <kernel/list.h>
 
 struct bdev;
-struct bdev_request;
 struct bio;
 struct super_block;
 
 // Block size used by the block device interface
 #define BDEV_BLK_SIZE 512
 
+// Maximum number of blocks the elevator merges into a single request
+#define BDEV_MAX_REQ_BLKS 256
+
 /*
  * Initialize the block device subsystem.
  */
@@ -26,25 +28,24 @@ void bdev_init(void);
  */
 struct bdev {
     dev_t dev; // device number
-    struct list request_queue; // request queue for this device
+    struct list request_queue; // request queue for this device, sorted by block
     struct spinlock queue_lock; // spinlock to protect the request queue
+    blk_t next_blk; // block following the last request handed to the driver
     void (*request_handler)(struct bdev*); // request handler function (defined by drivers)
     void *data; // device specific data
     struct memstore *store; // memstore to read memory pages from this device
     struct super_block *sb; // bdev's super block if available
+    blk_t nblks; // number of blocks on the device, 0 if unknown
+    struct list dirty_blks; // dirty blocks queued for the flusher, oldest first
+    size_t ndirty; // number of blocks in dirty_blks
+    struct spinlock dirty_lock; // spinlock to protect dirty_blks
+    struct sleeplock flush_lock; // held while writing out dirty_blks
+    struct list_node flush_node; // list node for the flusher's list of devices
 };
 
 // Root block device (for root file system)
 struct bdev *root_bdev;
 
-/*
- * Block device request.
- */
-struct bdev_request {
-    struct bio *bio; // operation
-    struct list_node node; // list node for request queue
-};
-
 typedef enum {
     BIO_READ,
     BIO_WRITE
@@ -56,7 +57,9 @@ typedef enum {
 } bio_status_t;
 
 /*
- * Block device operation
+ * Block device operation. Queued bios are grouped into requests: a request is
+ * headed by the bio with the lowest block number, and the bios that continue it
+ * on the device in the same direction are merged into its list.
  */
 struct bio {
     struct bdev *bdev; // pointer to block device
@@ -67,6 +70,12 @@ struct bio {
     bio_status_t status;
     struct spinlock lock; // lock to synchronize access to status
     struct condvar cv; // cv to check status
+    struct list_node node; // list node for request queue, or for the merged list of the request's head
+    struct list merged; // bios merged into the request this bio heads, in block order
+    size_t req_size; // number of blocks in the request this bio heads
+    int nr_pending; // driver commands of the request this bio heads still in flight
+    void (*end_io)(struct bio*); // completion callback, NULL to wake up bio_wait
+    void *private; // private data for end_io
 };
 
 /*
@@ -97,12 +106,63 @@ struct bio *bio_alloc(void);
  */
 void bio_free(struct bio *bio);
 
+/*
+ * Submit a block device request, and return without waiting for it. When the
+ * device completes the bio, bio->end_io is called if set: it runs in interrupt
+ * context, must not block, and owns the bio from then on. Otherwise the bio is
+ * marked BIO_COMPLETE and bio_wait returns.
+ *
+ * The bio goes through the device's elevator: it is merged into a queued
+ * request it continues or precedes on the device in the same direction, or
+ * else inserted into the queue in block order. Bios in flight at the same time
+ * must not overlap.
+ */
+void bdev_submit_bio(struct bio *bio);
+
+/*
+ * Submit n bios of the same block device at once. All of them reach the
+ * elevator before the driver is kicked, so neighbouring bios are merged into
+ * large requests.
+ */
+void bdev_submit_bios(struct bio **bios, size_t n);
+
+/*
+ * Wait for a submitted bio without end_io to complete.
+ */
+void bio_wait(struct bio *bio);
+
+/*
+ * Wait for n submitted bios without end_io to complete.
+ */
+void bio_wait_all(struct bio **bios, size_t n);
+
 /*
  * Submit a block device request. This function is synchronous: it returns only
  * when the request is completed by the block device.
  */
 void bdev_make_request(struct bio *bio);
 
+/*
+ * Remove and return the next request to issue from a device's request queue,
+ * or NULL if the queue is empty. Requests are handed out in ascending block
+ * order from the end of the last one, wrapping around to the lowest block
+ * (C-LOOK). Used by drivers.
+ */
+struct bio *bdev_next_request(struct bdev *bdev);
+
+/*
+ * Return the bio following bio in request req, or NULL if bio is the last one.
+ * Together, the bios of a request cover req->req_size blocks from req->blk.
+ */
+struct bio *bdev_request_next_bio(struct bio *req, struct bio *bio);
+
+/*
+ * Complete all bios of a request and wake up their submitters. The request must
+ * not be accessed afterwards. Used by drivers, can be called from interrupt
+ * handlers.
+ */
+void bdev_complete_request(struct bio *req);
+
 /*
  * Header for bdev blocks stored in page cache.
  */
@@ -124,8 +184,15 @@ struct blk_header {
     // - VALID
     // - DIRTY
     state_t state;
-    // Reference counter. This counter is protected by page->lock.
+    // Reference counter. This counter is protected by page->lock. Each
+    // reference also holds a reference on the page.
     unsigned int ref;
+    // List node for bdev->dirty_blks, and whether the block is queued there.
+    // Both are protected by bdev->dirty_lock.
+    Node dirty_node;
+    bool queued;
+    // Timer tick the block was queued for writeback at
+    uint32_t dirty_time;
 };
 
 /*
@@ -177,4 +244,50 @@ void bdev_release_blk_unlocked(struct blk_header *bh);
  */
 err_t bdev_write_blk(struct blk_header *bh);
 
+/*
+ * Write n block buffers of the same block device, submitting them all at once,
+ * and return when all of them are written. Nothing is written if failed to
+ * allocate memory.
+ *
+ * Precondition:
+ * Caller must hold the lock of each block header.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ */
+err_t bdev_write_blks(struct blk_header **bhs, size_t n);
+
+/*
+ * Queue a dirty block to be written back by the flusher thread, and return
+ * immediately. The queue holds a reference on the block until it is written.
+ * The flusher writes blocks in block number order, once they have been queued
+ * for a while or when too many blocks are queued.
+ */
+void bdev_writeback_blk(struct blk_header *bh);
+
+/*
+ * Write all queued dirty blocks of a block device, and return when they are
+ * on the device.
+ */
+void bdev_flush(struct bdev *bdev);
+
+/*
+ * Write those of n blocks of a block device that are queued for the flusher,
+ * and return when they are on the device. Blocks the flusher took before the
+ * caller acquired bdev->flush_lock are on the device already.
+ *
+ * Precondition:
+ * Caller must hold bdev->flush_lock, and none of the blocks' locks.
+ */
+void bdev_flush_blks(struct bdev *bdev, struct blk_header **bhs, size_t n);
+
+/*
+ * Free the block headers of a page that is being evicted from a bdev's page
+ * cache.
+ *
+ * Precondition:
+ * The page is clean, and none of its blocks are referenced.
+ */
+void bdev_release_page(struct page *page);
+
 #endif /* _BDEV_H_ */
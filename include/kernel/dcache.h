@@ -0,0 +1,75 @@
+#ifndef _DCACHE_H_
+#define _DCACHE_H_
+
+/*
+ * Directory Entry Cache.
+ *
+ * Caches the results of directory lookups, so path walks over hot directories
+ * don't go through the file system. An entry maps (super block, directory inode
+ * number, name) to the inode number found, or to 0 for a name known not to
+ * exist. Entries are filled and invalidated with the directory's i_lock held;
+ * every operation that adds or removes a name must invalidate it. The least
+ * recently used entries are dropped once the cache is full.
+ */
+#include <kernel/types.h>
+#include <kernel/fs.h>
+
+// Maximum number of cached entries
+#define DCACHE_MAX_ENTRIES 1024
+// Names this long or longer are not cached. The file system may store them
+// shortened, so a name and its shortened form could map to one entry on disk
+// and to different ones here.
+#define DCACHE_NAME_LEN FNAME_LEN
+
+/* inform compiler that these structs exist */
+struct inode;
+struct super_block;
+
+/*
+ * Initialize the directory entry cache.
+ */
+void dcache_init(void);
+
+/*
+ * Look up name in directory dir.
+ *
+ * Precondition:
+ * Caller must hold dir->i_lock.
+ *
+ * Return:
+ * ERR_OK - Entry found, its inode number is written to inum. 0 means the name
+ *          does not exist.
+ * ERR_NOTEXIST - Nothing is cached for the name.
+ */
+err_t dcache_lookup(struct inode *dir, const char *name, inum_t *inum);
+
+/*
+ * Cache the inode number of name in directory dir, 0 if the name does not
+ * exist. Failing to allocate an entry is not an error, the result is just not
+ * cached.
+ *
+ * Precondition:
+ * Caller must hold dir->i_lock.
+ */
+void dcache_insert(struct inode *dir, const char *name, inum_t inum);
+
+/*
+ * Drop the entry of name in directory dir, if any.
+ *
+ * Precondition:
+ * Caller must hold dir->i_lock.
+ */
+void dcache_remove(struct inode *dir, const char *name);
+
+/*
+ * Drop all entries of directory dir. Called when dir is deleted, before its
+ * inode number can be reused.
+ */
+void dcache_remove_dir(struct inode *dir);
+
+/*
+ * Drop all entries of a super block. Called when the super block goes away.
+ */
+void dcache_remove_sb(struct super_block *sb);
+
+#endif /* _DCACHE_H_ */
@@ -274,7 +274,8 @@ struct inode_operations {
      */
     err_t (*lookup)(struct inode *dir, const char *name, struct inode **inode);
     /*
-     * Fill in memory page with data read from an inode.
+     * Fill in memory page with data read from an inode. The part of the page
+     * beyond the end of file is zero-filled.
      *
      * Precondition:
      * Caller must hold inode->i_lock.
@@ -350,6 +351,11 @@ void fs_free_inode(struct inode *inode);
  */
 err_t fs_get_inode(struct super_block *sb, inum_t inum, struct inode **inode);
 
+/*
+ * Take another reference on an inode the caller already holds a reference to.
+ */
+void fs_reopen_inode(struct inode *inode);
+
 /*
  * Release an inode reference. If the inode has no more references, perform the
  * following actions:
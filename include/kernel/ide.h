@@ -7,6 +7,8 @@
 #include <kernel/synch.h>
 #include <kernel/bdev.h>
 
+struct ide_prd;
+
 /*
  * Error codes
  */
@@ -28,12 +30,32 @@ typedef enum {
 struct ide_dev {
     struct spinlock lock; // lock to protect this descriptor
     ide_status_t status;
-    uint8_t ide_index; // 0 for master, 1 for slave
+    uint8_t ide_index; // 0/1 for primary master/slave, 2/3 for secondary master/slave
+    port_t iobase; // I/O base port of the device's channel
+    port_t ctrlbase; // control port of the device's channel
+    irq_t irq; // IRQ of the device's channel
+    uint8_t mult; // sectors transferred per interrupt, more than 1 if READ/WRITE MULTIPLE are enabled
+    // Request being transferred while IDE_BUSY. A request is split into
+    // commands of at most IDE_MAX_SECTORS sectors, and each command transfers
+    // mult sectors per interrupt.
+    struct bio *req;
+    struct bio *bio; // bio of the request the next sector is transferred to/from
+    size_t bio_ofs; // sectors of bio already transferred
+    size_t req_left; // sectors of the request not issued in a command yet
+    size_t cmd_left; // sectors of the current command not transferred yet
+    // Bus-master DMA state. Commands move data through the PRD table when dma
+    // is set, and through the data register (PIO) otherwise.
+    bool dma;
+    port_t bmbase; // bus master I/O base port of the device's channel
+    struct ide_prd *prdt; // physical region descriptor table, one page
+    struct bio *cmd_bio; // cursor (bio, bio_ofs) at the start of the current
+    size_t cmd_bio_ofs; // command, to reissue it with PIO if DMA fails
 };
 
 /*
  * Allocate a block device descriptor for an IDE device, with device number dev
- * and (master/slave) index ide_index. Return NULL if failed to allocate.
+ * and (channel and master/slave) index ide_index. Return NULL if failed to
+ * allocate.
  */
 struct bdev *ide_alloc(dev_t dev, uint8_t ide_index);
 
@@ -43,7 +65,8 @@ struct bdev *ide_alloc(dev_t dev, uint8_t ide_index);
 void ide_free(struct bdev *bdev);
 
 /*
- * Initialize an IDE device. Return ERR_IDE_INIT_FAIL if failed to initialize.
+ * Initialize an IDE device and record its size in bdev->nblks. Return
+ * ERR_IDE_INIT_FAIL if failed to initialize or no disk is attached.
  */
 err_t ide_init(struct bdev *bdev);
 
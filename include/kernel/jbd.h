@@ -36,6 +36,11 @@ struct journal {
     int next_index;
     // Journal data blocks
     struct blk_header *datablks[JOURNAL_SIZE];
+    // Blocks of the last committed transaction, which is still in the journal
+    // on disk. They are queued for the bdev flusher, and the journal keeps a
+    // reference on each until the next commit reuses the journal.
+    struct blk_header *ckptblks[JOURNAL_SIZE];
+    int nckpt;
 };
 
 struct journal_header {
@@ -11,9 +11,11 @@
  * allocate and free objects.
  *
  * 2. A generic kmalloc function. The caller specifies the size of allocation.
- * The function however may allocate more memory than requested.
+ * The function however may allocate more memory than requested. Allocations
+ * larger than a page are served with contiguous physical pages.
  */
 
+#include <arch/cpu.h>
 #include <kernel/types.h>
 #include <kernel/list.h>
 #include <kernel/synch.h>
@@ -28,18 +30,46 @@ struct slab {
     void *objs;
     // Index of the next free slot
     int free;
+    // Number of allocated objects
+    int n_used;
     // Size of the slab (number of pages)
     size_t n_pages;
 };
 
+/*
+ * Magazine: a stack of up to MAG_SIZE free objects cached by a cpu.
+ */
+#define MAG_SIZE 16
+struct magazine {
+    // Linked list of magazines in the depot
+    Node node;
+    // Number of objects in the magazine
+    int rounds;
+    void *objs[MAG_SIZE];
+};
+
+/*
+ * Per-cpu object cache. Only touched by its own cpu with interrupts off.
+ */
+struct kmem_cpu_cache {
+    struct magazine *loaded;    // magazine objects are allocated from/freed to
+    struct magazine *prev;      // previously loaded magazine, full or empty
+};
+
 /*
  * Object allocator.
  */
 struct kmem_cache {
+    Node node; // Linked-list of all object allocators
     List full; // Linked-list of slabs that are fully allocated
-    List free; // Linked-list of slabs that have free slots
+    List free; // Linked-list of slabs that are partially allocated
+    List empty; // Linked-list of slabs with no allocated objects
+    int n_empty; // Number of slabs in empty
+    List full_mags; // Depot of full magazines
+    List empty_mags; // Depot of empty magazines
     struct spinlock lock;
     size_t obj_size;
+    struct kmem_cpu_cache cpu_caches[MAX_NCPU];
 };
 
 /*
@@ -47,6 +77,11 @@ struct kmem_cache {
  */
 void kmalloc_init(void);
 
+/*
+ * Enable per-cpu magazines. Must be called after cpus are discovered.
+ */
+void kmalloc_mag_init(void);
+
 /*
  * Create an allocator that allocates/frees objects of size ``size``.
  */
@@ -53,6 +53,9 @@ void list_append(List* list, Node* node);
 /* Append node behind the largest smaller node according to comparator func. */
 void list_append_ordered(List *list, Node *node, comparator *compare, void *aux);
 
+/* Insert node in front of node before, which may be the list's end. */
+void list_insert(Node *before, Node *node);
+
 /*
  * Remove the given node from its list. Returns the next node. NOTE: this
  * doesn't prevent one from removing the head node.
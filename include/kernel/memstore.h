@@ -36,6 +36,22 @@ struct memstore {
     struct sleeplock pgcache_lock;
     struct radix_tree_root cached_pages;
 
+    /*
+     * Sequential readahead state, protected by pgcache_lock. The page cache
+     * only reads ahead for stores that implement size, ra_next is tracked for
+     * all stores.
+     */
+    int ra_next;        // page index a sequential reader accesses next
+    int ra_ahead;       // first page index past what was read ahead
+    int ra_window;      // pages per readahead, grows while access is sequential
+
+    /*
+     * Pages of an unevictable store have no backing storage to be written
+     * back to. They stay off the LRU, don't count toward PGCACHE_MAX_PAGES,
+     * and are only dropped when the store goes away.
+     */
+    bool unevictable;
+
     /*
      * Fill a page with data read from this store at the offset position. Each
      * type of memstore implements its own version of the fillpage function.
@@ -46,11 +62,41 @@ struct memstore {
     err_t (*fillpage)(struct memstore*, offset_t, struct page*);
 
     /*
-     * Write a page to this store.
+     * Optional. Fill several pages at once, each with data read from this
+     * store at its page->ofs. Readahead uses it to keep the device busy.
+     * Return the same errors as fillpage.
+     */
+    err_t (*fillpages)(struct memstore*, struct page**, size_t);
+
+    /*
+     * Write a page to this store. The page cache writes dirty pages back with
+     * it before evicting them, possibly while holding another store's
+     * pgcache_lock, so it must not wait on a page cache lock.
      * Function prototype:
      * err_t write(struct memstore *this, paddr_t paddr, offset_t ofs);
      */
     err_t (*write)(struct memstore*, paddr_t, offset_t);
+
+    /*
+     * Optional. Drop private data the store keeps on a cached page, called
+     * when the page is evicted from the page cache. The page is clean and the
+     * cache holds the only reference to it.
+     */
+    void (*releasepage)(struct memstore*, struct page*);
+
+    /*
+     * Optional. Return the size of the store's data in bytes, readahead stops
+     * there. Stores without it are not read ahead.
+     */
+    offset_t (*size)(struct memstore*);
+
+    /*
+     * Optional. Take and drop a reference on the object backing this store.
+     * A memregion mapping the store holds a reference for its lifetime, so
+     * the store can't be freed while pages can still fault in from it.
+     */
+    void (*ref)(struct memstore*);
+    void (*unref)(struct memstore*);
 };
 
 /*
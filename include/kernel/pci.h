@@ -0,0 +1,65 @@
+#ifndef _PCI_H_
+#define _PCI_H_
+
+/*
+ * PCI bus access, through configuration mechanism #1.
+ */
+#include <kernel/types.h>
+
+// Configuration space registers
+#define PCI_CONFIG_ID       0x00 // vendor ID (low half), device ID (high half)
+#define PCI_CONFIG_CMD      0x04 // command (low half), status (high half)
+#define PCI_CONFIG_CLASS    0x08 // revision, programming interface, subclass, class (low to high byte)
+#define PCI_CONFIG_HEADER   0x0C // header type in the third byte
+#define PCI_CONFIG_BAR0     0x10 // base address registers, 4 bytes each
+#define PCI_CONFIG_IRQ      0x3C // interrupt line in the low byte
+// Command register bits
+#define PCI_CMD_IO          0x1 // respond to I/O space accesses
+#define PCI_CMD_BUS_MASTER  0x4 // allow the device to access memory (DMA)
+
+/*
+ * A function of a device on the PCI bus.
+ */
+struct pci_dev {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class;
+    uint8_t subclass;
+    uint8_t prog_if; // programming interface
+    uint8_t irq_line; // ISA IRQ the function's interrupt pin is routed to
+};
+
+/*
+ * Read/write a 4-byte register in a device's configuration space. reg must be
+ * 4-byte aligned.
+ */
+uint32_t pci_read_config(struct pci_dev *dev, uint8_t reg);
+void pci_write_config(struct pci_dev *dev, uint8_t reg, uint32_t val);
+
+/*
+ * Find the first PCI function of the given class and subclass, and fill in
+ * dev. Return ERR_NOTEXIST if there is none.
+ */
+err_t pci_find_class(uint8_t class, uint8_t subclass, struct pci_dev *dev);
+
+/*
+ * Find the index-th (counting from 0) PCI function with the given vendor and
+ * device IDs, and fill in dev. Return ERR_NOTEXIST if there is none.
+ */
+err_t pci_find_device(uint16_t vendor_id, uint16_t device_id, int index, struct pci_dev *dev);
+
+/*
+ * Return the I/O port base of a device's I/O space BAR, or 0 if the BAR is not
+ * in I/O space.
+ */
+port_t pci_io_bar(struct pci_dev *dev, int bar);
+
+/*
+ * Let a device use I/O ports and access memory as a bus master.
+ */
+void pci_enable_bus_master(struct pci_dev *dev);
+
+#endif /* _PCI_H_ */
@@ -3,16 +3,36 @@
 
 /*
  * Page Cache.
+ *
+ * Cached pages of all memstores share a global LRU made of two lists. A page
+ * enters the inactive list when it is read in, and is promoted to the active
+ * list when it is used again: a page read ahead must be used twice, and
+ * repeated lookups of the page looked up last (e.g. the blocks of a bdev page)
+ * count as one use. Reclaim demotes pages from the active list
+ * to keep it no larger than the inactive one, and evicts from the cold end of
+ * the inactive list, writing dirty pages back through memstore->write first.
+ * Pages still in use (mapped, or holding referenced bdev blocks) are never
+ * evicted. Pages of unevictable stores are not on the LRU at all.
  */
 #include <kernel/types.h>
 
+// Maximum number of evictable pages cached across all memstores
+#define PGCACHE_MAX_PAGES 8192
+
 /* inform compiler that these structs exist */
 struct page;
 struct memstore;
 
+/*
+ * Initialize the page cache LRU and start the readahead daemon.
+ */
+void pgcache_init(void);
+
 /*
  * Query a page from the page cache. If the page is not present in the cache,
- * read the page using the memstore, and store the page into the cache.
+ * read the page using the memstore, and store the page into the cache. The
+ * cache keeps one reference on the page; callers that use the page after
+ * releasing store->pgcache_lock must take their own.
  *
  * Precondition:
  * Caller must hold store->pgcache_lock.
@@ -23,11 +43,28 @@ struct memstore;
 struct page *pgcache_get_page(struct memstore *store, offset_t ofs);
 
 /*
- * Remove a cached page from the page cache.
+ * Remove a cached page from the page cache and drop the cache's reference on
+ * it.
  *
  * Precondition:
  * Caller must hold store->pgcache_lock.
  */
 void pgcache_remove_page(struct memstore *memstore, offset_t ofs);
 
+/*
+ * Remove all cached pages of a store from the page cache and drop the cache's
+ * reference on them, without writing them back. Used when a store goes away.
+ *
+ * Precondition:
+ * Caller must hold store->pgcache_lock.
+ */
+void pgcache_remove_pages(struct memstore *store);
+
+/*
+ * Evict up to npages unused pages from the page cache. locked is a store whose
+ * pgcache_lock the caller holds, or NULL; pages of other stores whose lock is
+ * held are skipped. Return the number of pages freed.
+ */
+size_t pgcache_reclaim(struct memstore *locked, size_t npages);
+
 #endif /* _PGCACHE_H_ */
@@ -10,6 +10,8 @@
  * Physical memory allocator.
  */
 
+struct memstore;
+
 /*
  * Each physical page has an associated struct page.
  */
@@ -20,6 +22,14 @@ struct page {
     struct slab *slab;
     // reverse mapping
     struct rmap *rmap;
+    // memstore whose page cache holds the page, NULL if the page isn't cached
+    struct memstore *store;
+    // offset of the page within the memstore caching it
+    offset_t ofs;
+    // page cache LRU list the page is on
+    int lru;
+    // page cache: used since it was read in, a further use promotes it
+    bool referenced;
     // reference count
     int refcnt;
     // size of the block (power of two number of pages)
@@ -31,6 +41,16 @@ struct page {
     List blk_headers;
 };
 
+/*
+ * Memory pressure callback. pmem calls shrink when free memory runs low. It
+ * should free whatever cached memory it can spare without blocking or
+ * allocating, and return the number of pages freed.
+ */
+struct shrinker {
+    Node node;
+    size_t (*shrink)(struct shrinker *shrinker);
+};
+
 /*
  * Translate physical address to struct page.
  */
@@ -51,6 +71,11 @@ void pmem_boot_init(void);
  */
 void pmem_init(void);
 
+/*
+ * Enable the per-cpu page caches. Must be called after cpus are discovered.
+ */
+void pmem_pcp_init(void);
+
 /*
  * Print physical memory status
  */
@@ -76,9 +101,26 @@ void pmem_arch_init(void);
  */
 err_t pmem_alloc(paddr_t *paddr);
 
+/*
+ * Allocate one zero-filled physical page. Store the address of the page in
+ * paddr. Pages are taken from a pool of pre-zeroed pages when available.
+ *
+ * Return:
+ * ERR_OK - Physical page successfully allocated.
+ * ERR_NOMEM - Failed to allocate physical page.
+ */
+err_t pmem_alloc_zeroed(paddr_t *paddr);
+
+/*
+ * Zero a free page into the pre-zeroed page pool if the pool is not full and
+ * free memory is not low. Called by idle threads, must not block.
+ */
+void pmem_zero_idle(void);
+
 /*
  * Allocate n physical pages. Physical pages are guaranteed to be contiguous.
- * Store the address of the first physical page in ``paddr``.
+ * Store the address of the first physical page in ``paddr``. The first page's
+ * struct page records the order of the allocated block.
  *
  * Return:
  * ERR_OK - n physical pages successfully allocated.
@@ -96,6 +138,11 @@ void pmem_free(paddr_t paddr);
  */
 void pmem_nfree(paddr_t paddr, size_t n);
 
+/*
+ * Register a shrinker to be called under memory pressure.
+ */
+void pmem_register_shrinker(struct shrinker *shrinker);
+
 /*
  * Functions that get/set state of a page.
  *
@@ -0,0 +1,37 @@
+#ifndef _RAMDISK_H_
+#define _RAMDISK_H_
+
+/*
+ * RAM disk driver. Blocks live in physical pages allocated up front, and
+ * requests complete by copying, as soon as they are submitted. Useful to
+ * measure the file system and journal without device latency.
+ */
+#include <kernel/synch.h>
+#include <kernel/bdev.h>
+
+/*
+ * RAM disk descriptor
+ */
+struct ramdisk_dev {
+    paddr_t *pages; // physical page of each page-sized run of blocks
+    size_t npages;
+};
+
+/*
+ * Allocate a zero-filled RAM disk of nblks blocks, with device number dev.
+ * Return NULL if failed to allocate.
+ */
+struct bdev *ramdisk_alloc(dev_t dev, blk_t nblks);
+
+/*
+ * Free a RAM disk and its memory.
+ */
+void ramdisk_free(struct bdev *bdev);
+
+/*
+ * Copy the first bdev->nblks blocks of block device src into a RAM disk.
+ * Return ERR_NOMEM if failed to allocate memory.
+ */
+err_t ramdisk_load(struct bdev *bdev, struct bdev *src);
+
+#endif /* _RAMDISK_H_ */
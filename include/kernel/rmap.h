@@ -2,13 +2,17 @@
 #define _RMAP_H_
 
 #include <kernel/list.h>
+#include <kernel/synch.h>
 
 /*
  * Reverse mapping for tracking shared memory regions.
  */
 
+struct memregion;
+
 struct rmap {
-    List regions;
+    struct sleeplock lock;  // protects regions, acquired after a region's as_lock
+    List regions;           // memregions mapping the object owning this rmap
 };
 
 /*
@@ -31,8 +35,21 @@ void rmap_construct(struct rmap *rmap);
  */
 void rmap_destroy(struct rmap *rmap);
 
+/*
+ * Add/remove a memory region to/from a reverse mapping.
+ *
+ * Precondition:
+ * Caller must hold region->as->as_lock.
+ */
+void rmap_add_region(struct rmap *rmap, struct memregion *region);
+void rmap_remove_region(struct rmap *rmap, struct memregion *region);
+
 /*
  * Unmap all memory mappings of a physical page
+ *
+ * Return:
+ * ERR_LOCK_BUSY - Some address space mapping the page was busy, its mapping
+ *                 is left in place.
  */
 err_t rmap_unmap(struct rmap *rmap, paddr_t paddr);
 
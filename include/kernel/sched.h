@@ -4,8 +4,6 @@
 #include <kernel/synch.h>
 #include <kernel/thread.h>
 
-struct spinlock sched_lock;
-
 /* initialize lists used by scheduler */
 void sched_sys_init();
 
@@ -24,5 +22,8 @@ void sched_ready(struct thread*);
 */
 void sched_sched(threadstate_t next_state, void* lock) ;
 
+/* Release the current cpu's run queue lock, called by a newly started thread */
+void sched_release_lock(void);
+
 
 #endif /* _SCHED_H_ */
@@ -2,6 +2,8 @@
 #define _SFS_H_
 
 #include <kernel/types.h>
+#include <kernel/synch.h>
+#include <kernel/list.h>
 
 /*
  * Simple File System
@@ -42,11 +44,54 @@ struct sfs_sb_info {
     blk_t s_journal_start; // Block number of the first journal block
     blk_t s_data_start; // Block number of the first data block
     struct journal *journal;
+    uint16_t *s_bmap_free; // Number of free blocks in each data bitmap block
+    blk_t s_alloc_goal; // Where the next search for a free data block starts
+    List s_rsv_list; // Reservation windows of growing files
+    struct spinlock s_rsv_lock; // Protects s_rsv_list and the windows on it
 };
 
-// Each inode has SFS_NDIRECT direct blocks and SFS_NINDIRECT indirect blocks
-#define SFS_NDIRECT 12 // Max number of direct data blocks
-#define SFS_NINDIRECT 2 // Max number of indirect data blocks
+/*
+ * Reservation window: free data blocks set aside for the next blocks of a
+ * growing file, so that they stay contiguous while other files grow too. Other
+ * files only allocate reserved blocks when nothing else is free. Windows live
+ * in memory only; their blocks stay free in the bitmap until allocated.
+ */
+#define SFS_RSV_BLKS 64 // Blocks allocated plus reserved at a time
+struct sfs_rsv {
+    blk_t r_start; // First reserved block
+    blk_t r_end; // One past the last reserved block, r_start if empty
+    Node r_node; // Node in s_rsv_list, while not empty
+};
+
+/*
+ * SFS maps file blocks to disk blocks with extents. An extent maps e_len file
+ * blocks starting at file block e_lblk to the disk blocks starting at e_start.
+ *
+ * The extents of an inode are kept sorted by e_lblk in a tree rooted in the
+ * inode. A tree node is a header followed by an array of entries. Entries of a
+ * leaf node (depth 0) are extents. Entries of an index node (depth > 0) point
+ * to a child node: e_lblk is the first file block the child covers, e_start is
+ * the disk block holding the child, and e_len is unused. Nodes other than the
+ * root take up a whole block. Small or contiguous files fit all their extents
+ * in the inode.
+ */
+struct sfs_extent_header {
+    uint16_t eh_entries; // Number of valid entries
+    uint16_t eh_max; // Capacity of the node
+    uint16_t eh_depth; // Height of the node, 0 for leaf nodes
+    uint16_t eh_unused;
+};
+
+struct sfs_extent {
+    uint32_t e_lblk; // First file block covered
+    uint32_t e_start; // First disk block (child node block for index nodes)
+    uint32_t e_len; // Number of blocks (unused for index nodes)
+};
+
+// Number of extent tree entries in the inode
+#define SFS_INODE_EXTENTS 4
+// Number of extent tree entries in a tree block
+#define SFS_BLK_EXTENTS ((BDEV_BLK_SIZE - sizeof(struct sfs_extent_header)) / sizeof(struct sfs_extent))
 
 /*
  * On-disk SFS inode structure.
@@ -56,14 +101,20 @@ struct sfs_inode {
     uint8_t i_mode; // File permission
     uint16_t i_nlink; // Number of links to inode
     uint32_t i_size; // Size of file in bytes
-    uint32_t i_addrs[SFS_NDIRECT + SFS_NINDIRECT]; // Data block addresses
+    struct sfs_extent_header i_eh; // Root of the extent tree
+    struct sfs_extent i_extents[SFS_INODE_EXTENTS];
 }; // BDEV_BLK_SIZE need to be a multiple of sizeof(sfs_inode)
 
 /*
  * In-memory SFS inode structure
  */
 struct sfs_inode_info {
-    blk_t i_addrs[SFS_NDIRECT + SFS_NINDIRECT];
+    // Root of the extent tree, the entries must follow the header
+    struct sfs_extent_header i_eh;
+    struct sfs_extent i_extents[SFS_INODE_EXTENTS];
+    // Last extent looked up, e_len is 0 if none
+    struct sfs_extent i_cache;
+    struct sfs_rsv i_rsv; // Reservation window for the next data blocks
 };
 
 /*
@@ -75,4 +126,36 @@ struct sfs_dirent {
     char name[SFS_DIRENT_NAMELEN]; // file/directory name
 }; // BDEV_BLK_SIZE need to be a multiple of sizeof(sfs_dirent)
 
+/*
+ * Hashed directory index. A directory that outgrows one block gets an index
+ * from name hashes to dirent slots (dirent positions in the directory). The
+ * index lives in file blocks past the largest file size, so i_size and
+ * readdir only cover the dirents, and directories without an index are still
+ * searched linearly.
+ *
+ * The index is an extendible hash table: the low dx_depth bits of a hash
+ * select an entry of the bucket table, which holds the number of the bucket
+ * the hash goes to. A full bucket is split in two by one more hash bit,
+ * doubling the table when the bucket already uses all dx_depth bits. Freed
+ * slots are kept on a stack for reuse.
+ */
+#define SFS_DX_MAGIC 0x58444653 // "SFDX"
+struct sfs_dx_header {
+    uint32_t dx_magic; // SFS_DX_MAGIC once the index is complete
+    uint32_t dx_depth; // Number of hash bits selecting a bucket table entry
+    uint32_t dx_nbuckets; // Number of buckets
+    uint32_t dx_nfree; // Number of slots on the free slot stack
+};
+
+struct sfs_dx_entry {
+    uint32_t hash; // Hash of the dirent name
+    uint32_t slot; // Dirent slot
+};
+
+struct sfs_dx_bucket {
+    uint16_t b_count; // Number of valid entries
+    uint16_t b_depth; // Number of hash bits all entries agree on
+    struct sfs_dx_entry b_entries[];
+};
+
 #endif /* _SFS_H_ */
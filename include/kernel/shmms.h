@@ -7,14 +7,52 @@
  * Memstore backed by shared memory.
  */
 
+/* Maximum length of a shared memory segment name, including the terminating 0 */
+#define SHM_NAME_LEN 32
+
+/*
+ * Initialize the shared memory memstore allocator and the named segment table.
+ */
+void shmms_init(void);
+
 /*
- * Allocate a shared memory memstore. TODO: parameters
+ * Allocate a zero-filled shared memory memstore of size bytes. The store is
+ * reference counted through its ref/unref hooks, which memregions mapping it
+ * call, and frees itself with its pages when the last reference is dropped.
  * Return NULL if failed to allocate.
  */
-struct memstore *shmms_alloc(void);
+struct memstore *shmms_alloc(size_t size);
+
+/*
+ * Create a named shared memory segment of size bytes and store it in *store.
+ * The segment is returned with one reference held for the caller, dropped with
+ * store->unref. The name is removed when the last reference is dropped.
+ *
+ * Return:
+ * ERR_OK - Segment created.
+ * ERR_EXIST - A segment with the same name exists.
+ * ERR_NOMEM - Failed to allocate memory.
+ */
+err_t shmms_create(const char *name, size_t size, struct memstore **store);
+
+/*
+ * Find the named shared memory segment called name and take a reference on it
+ * for the caller, dropped with store->unref. Return NULL if no such segment.
+ */
+struct memstore *shmms_lookup(const char *name);
+
+/*
+ * Return true if store is a named shared memory segment.
+ */
+bool shmms_is_segment(struct memstore *store);
+
+/*
+ * Return size in bytes of a shared memory memstore.
+ */
+size_t shmms_size(struct memstore *store);
 
 /*
- * Free a shared memory memstore.
+ * Free a shared memory memstore that was never referenced.
  */
 void shmms_free(struct memstore *store);
 
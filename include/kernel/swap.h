@@ -0,0 +1,59 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space. Cold anonymous pages are written to page-sized slots on a
+ * dedicated block device, through the device's memstore, and their page table
+ * entries are replaced with the slot's swap ID. Slots are reference counted so
+ * address spaces forked from each other can share a swapped out page.
+ */
+#include <kernel/types.h>
+
+struct addrspace;
+
+/*
+ * Initialize swap on the swap block device, and start the swap daemon. Swap
+ * stays disabled if there is no swap device.
+ */
+void swap_init(void);
+
+/*
+ * Allow swap to reclaim pages from an address space. Its pages must not be
+ * accessed through kernel mappings afterwards without holding as->as_lock.
+ */
+void swap_add_as(struct addrspace *as);
+
+/*
+ * Stop reclaiming pages from an address space.
+ *
+ * Precondition:
+ * Caller must hold as->as_lock.
+ */
+void swap_remove_as(struct addrspace *as);
+
+/*
+ * Reclaim up to npages cold anonymous pages to swap. Pages are chosen by a
+ * clock sweeping every address space: a page accessed since the last sweep
+ * gets a second chance, otherwise it is swapped out. Address spaces whose
+ * as_lock is held are skipped. Return the number of pages freed.
+ */
+size_t swap_reclaim(size_t npages);
+
+/*
+ * Read the page stored in swap slot swapid into physical page paddr.
+ *
+ * Return:
+ * ERR_OK - Page successfully read.
+ * ERR_MEMSTORE_NOMEM - Failed to allocate memory.
+ * ERR_MEMSTORE_IO - Failed to read the swap device.
+ */
+err_t swap_in(swapid_t swapid, paddr_t paddr);
+
+/*
+ * Take/drop a reference on a swap slot. The slot is freed when its last
+ * reference is dropped.
+ */
+void swap_dup(swapid_t swapid);
+void swap_free(swapid_t swapid);
+
+#endif /* _SWAP_H_ */
@@ -22,6 +22,7 @@ struct thread {
     tid_t tid;
     threadstate_t state;
     struct proc *proc;
+    int cpu;                    // cpu whose run queue the thread belongs to, -1 if never scheduled
     struct context* sched_ctx;  // thread context used for scheduling
     struct trapframe *tf;       // current trapframe of the thread
     Node node;                  // used to track the thread in ready list or other blocking list 
@@ -8,4 +8,14 @@
  */
 err_t timer_register_trap_handler(void);
 
+/*
+ * Return the number of timer ticks since the timer was started.
+ */
+uint32_t timer_get_ticks(void);
+
+/*
+ * Block the current thread for at least nticks timer ticks.
+ */
+void timer_sleep(uint32_t nticks);
+
 #endif /* _TIMER_H_ */
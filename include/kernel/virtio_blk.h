@@ -0,0 +1,72 @@
+#ifndef _VIRTIO_BLK_H_
+#define _VIRTIO_BLK_H_
+
+/*
+ * virtio-blk disk driver, over the legacy virtio PCI interface. Requests are
+ * split into commands on a single virtqueue, so the device works on many
+ * commands at once instead of one.
+ */
+#include <kernel/synch.h>
+#include <kernel/bdev.h>
+
+/*
+ * Error codes
+ */
+#define ERR_VIRTIO_BLK_INIT_FAIL 1
+
+struct vring_desc;
+struct vring_avail;
+struct vring_used;
+struct virtio_blk_cmd;
+
+/*
+ * virtio-blk device descriptor
+ */
+struct virtio_blk_dev {
+    struct spinlock lock; // lock to protect this descriptor
+    int index; // which virtio-blk device on the PCI bus, counting from 0
+    port_t iobase; // legacy I/O BAR of the device
+    irq_t irq;
+    bool event_idx; // whether the device honors used_event/avail_event
+    size_t max_segs; // maximum number of data descriptors per command
+    // Virtqueue, in physically contiguous pages
+    paddr_t vq_paddr;
+    size_t vq_npages;
+    uint16_t qsize; // number of descriptors
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    volatile struct vring_used *used;
+    uint16_t free_head; // free descriptors, chained through desc[].next
+    uint16_t nfree;
+    uint16_t last_used; // used ring entries consumed so far
+    uint16_t ncmds; // commands in flight
+    // Command headers and status, indexed by head descriptor
+    struct virtio_blk_cmd *cmds;
+    paddr_t cmds_paddr;
+    size_t cmds_npages;
+    // Request being split into commands, NULL once all of it is on the queue
+    struct bio *req;
+    struct bio *bio; // bio of the request the next sector belongs to
+    size_t bio_ofs; // sectors of bio already placed in commands
+    size_t req_left; // sectors of the request not placed in commands yet
+};
+
+/*
+ * Allocate a block device descriptor for the index-th virtio-blk device, with
+ * device number dev. Return NULL if failed to allocate.
+ */
+struct bdev *virtio_blk_alloc(dev_t dev, int index);
+
+/*
+ * Free a virtio-blk block device descriptor.
+ */
+void virtio_blk_free(struct bdev *bdev);
+
+/*
+ * Find and initialize a virtio-blk device, and record its size in
+ * bdev->nblks. Return ERR_VIRTIO_BLK_INIT_FAIL if failed to initialize or there
+ * is no such device.
+ */
+err_t virtio_blk_init(struct bdev *bdev);
+
+#endif /* _VIRTIO_BLK_H_ */
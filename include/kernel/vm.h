@@ -13,13 +13,20 @@
 #include <kernel/synch.h>
 
 #define ADDR_ANYWHERE 0Xfffffff
-#define UHEAP_INIT_PAGES 1000
+#define UHEAP_INIT_PAGES 1000 // address space kept free after the heap
 
 // Error Codes
 #define ERR_VM_BOUND 1 // bound error
 #define ERR_VM_INVALID 2 // operation not allowed
 #define ERR_VM_RESOURCE_UNAVAIL 3 // resource required for an operation is not available
 
+// Protection and flags for syscall mmap
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define MAP_SHARED 0x1
+#define MAP_PRIVATE 0x2
+#define MAP_ANON 0x4
+
 /*
  * Memory permissions
  */
@@ -37,19 +44,29 @@ typedef enum {
 struct memregion {
     struct addrspace *as;
     Node as_node;           // used to connect all memregions within an addrspace
+    Node rmap_node;         // used to connect all memregions mapping the same memstore
+    struct memregion *rt_left, *rt_right, *rt_parent; // links in addrspace's region tree
+    int rt_height;          // height of the subtree rooted at this region
+    size_t gap;             // free space between the previous region and this one
+    size_t max_gap;         // largest gap in the subtree rooted at this region
     vaddr_t start;          // starting addr of memregion
     vaddr_t end;            // ending addr of memregion
     memperm_t perm;
     int shared;             // 1:shared 0:private
+    bool mmapped;           // created by mmap, so munmap may remove it
     struct memstore *store;
     offset_t ofs;           // offset into memstore
 };
 
 struct addrspace {
-    List regions;
+    List regions;           // memregions ordered by address
+    struct memregion *region_tree; // AVL tree of memregions keyed on start address
     struct vpmap *vpmap;
     struct sleeplock as_lock;
     struct memregion *heap; // track heap memregion to ease extension
+    Node swap_node;         // used by swap to track address spaces it reclaims pages from
+    bool swappable;         // whether the address space is on swap's list
+    vaddr_t swap_hand;      // address where swap's clock hand stopped in this address space
 };
 
 // Kernel address space.
@@ -82,7 +99,8 @@ void as_destroy(struct addrspace *as);
 void as_dump(struct addrspace *as, vaddr_t vaddr);
 
 /*
- * Copy src address space's memregions into dst_as.
+ * Copy src address space's memregions into dst_as. Private writable memory is
+ * shared copy-on-write between the two address spaces.
  * Return ERR_OK on success, ERR_NOMEM if fails to allocate memregion in dst.
  */
 err_t as_copy_as(struct addrspace *src_as, struct addrspace *dst_as);
@@ -52,7 +52,8 @@ void vpmap_unmap(struct vpmap *vpmap, vaddr_t vaddr, size_t n, int free_swap);
 void vpmap_destroy(struct vpmap *vpmap);
 
 /*
- * Copy mapping of n pages from src vpmap to dst vpmap.
+ * Copy mapping of n pages from src vpmap to dst vpmap. Physical pages are
+ * shared (their reference count is incremented), not copied.
  * memperm indicates the memory permission for src and dst after the copy.
  * Return ERR_VPMAP_MAP if failed to map pages in dstvpmap
  */
@@ -65,7 +66,8 @@ err_t vpmap_copy(struct vpmap *srcvpmap, struct vpmap *dstvpmap, vaddr_t srcaddr
 err_t vpmap_copy_kernel_mapping(struct vpmap *dstvpmap);
 
 /*
- * Putting x into pte entry of vaddr entry.
+ * Replace the mapping of vaddr with swap ID swapid. The reference count of the
+ * previously mapped physical page is left to the caller.
  * Return ERR_VPMAP_NOTPRESENT if entry not present.
  */
 err_t vpmap_put_swapid(struct vpmap *vpmap, vaddr_t vaddr, swapid_t swapid);
@@ -114,6 +116,17 @@ err_t vpmap_get_dirty(struct vpmap *vpmap, vaddr_t vaddr, int *dirty);
  */
 err_t vpmap_get_accessed(struct vpmap *vpmap, vaddr_t vaddr, int *accessed);
 
+/*
+ * Clear the accessed bit of the page mapped at vaddr.
+ */
+void vpmap_clear_accessed(struct vpmap *vpmap, vaddr_t vaddr);
+
+/*
+ * Check if vpmap is loaded on a processor other than the current one, whose
+ * tlb may still cache its entries.
+ */
+int vpmap_in_use(struct vpmap *vpmap);
+
 /*
  *  Flush tlb
  */
@@ -22,3 +22,8 @@
 #define SYS_pipe    21
 #define SYS_info    22
 #define SYS_halt    23
+#define SYS_mmap    24
+#define SYS_munmap  25
+#define SYS_shmcreate   26
+#define SYS_shmattach   27
+#define SYS_shmdetach   28
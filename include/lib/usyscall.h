@@ -33,6 +33,13 @@ struct dirent {
 #define FS_CREAT       0x100
 #define EMPTY_MODE	   0
 
+// Protection and flags for syscall mmap
+#define PROT_READ      0x1
+#define PROT_WRITE     0x2
+#define MAP_SHARED     0x1
+#define MAP_PRIVATE    0x2
+#define MAP_ANON       0x4
+
 // Virtual Memory
 // need to change this based on the architecture 
 #define KMAP_BASE           0xFFFFFFFF80000000
@@ -265,4 +272,65 @@ void info(struct sys_info *info);
  * Halt the computer
  */
 void halt();
+/*
+ * Map length bytes of memory into the address space. With MAP_ANON the memory
+ * is zero-filled, otherwise it maps the file open at fd starting at offset.
+ * Exactly one of MAP_SHARED and MAP_PRIVATE must be given: changes to a shared
+ * mapping are seen by every process mapping the same memory, changes to a
+ * private mapping are only seen by the caller. If addr is not NULL, the memory
+ * is mapped at addr.
+ *
+ * Return:
+ * On success, address of the mapped memory.
+ * ERR_INVAL - length is 0, flags are invalid, or addr/offset is not page aligned.
+ * ERR_INVAL - The mapping does not fit below the user stack.
+ * ERR_INVAL - fd isn't a valid open file descriptor, or it was not opened
+ *             for reading.
+ * ERR_INVAL - A file is mapped shared and writable, which is not supported.
+ * ERR_FTYPE - fd does not point to a regular file.
+ * ERR_NOMEM - Failed to allocate memory, or the address range is in use.
+ */
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, size_t offset);
+/*
+ * Unmap memory mapped by mmap. addr and length must match a whole mapping.
+ *
+ * Return:
+ * ERR_OK - Memory successfully unmapped.
+ * ERR_INVAL - addr and length do not match a mapping created by mmap.
+ */
+int munmap(void *addr, size_t length);
+/*
+ * Create a zero-filled shared memory segment of size bytes called name and
+ * map it into the address space. Other processes can map the same memory with
+ * shmattach. The segment is destroyed, and its name freed, once no process
+ * has it mapped anymore.
+ *
+ * Return:
+ * On success, address of the mapped segment.
+ * ERR_FAULT - Address of name is invalid.
+ * ERR_INVAL - name is empty or longer than 31 characters, or size is 0 or too
+ *             large to map.
+ * ERR_EXIST - A segment called name already exists.
+ * ERR_NOMEM - Failed to allocate memory.
+ */
+void *shmcreate(const char *name, size_t size);
+/*
+ * Map the shared memory segment called name into the address space.
+ *
+ * Return:
+ * On success, address of the mapped segment.
+ * ERR_FAULT - Address of name is invalid.
+ * ERR_INVAL - name is empty or longer than 31 characters.
+ * ERR_NOTEXIST - No segment called name exists.
+ * ERR_NOMEM - Failed to allocate memory.
+ */
+void *shmattach(const char *name);
+/*
+ * Unmap the shared memory segment mapped at addr.
+ *
+ * Return:
+ * ERR_OK - Segment successfully unmapped.
+ * ERR_INVAL - addr is not the address of a mapped segment.
+ */
+int shmdetach(void *addr);
 #endif /* _USYSCALL_H_ */
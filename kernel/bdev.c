@@ -7,9 +7,12 @@
 #include <kernel/bdevms.h>
 #include <kernel/console.h>
 #include <kernel/thread.h>
+#include <kernel/timer.h>
 #include <lib/errcode.h>
 #include <lib/bits.h>
 #include <kernel/ide.h>
+#include <kernel/virtio_blk.h>
+#include <kernel/ramdisk.h>
 
 static struct kmem_cache *bdev_allocator = NULL;
 static struct kmem_cache *bio_allocator = NULL;
@@ -17,6 +20,7 @@ static struct kmem_cache *bio_allocator = NULL;
 // Root block device
 #define ROOT_DEV_NUM 0
 #define ROOT_IDE_INDEX 1
+#define ROOT_VIRTIO_INDEX 0
 
 // Return the number of blocks in a page
 #define N_BLKS_PER_PAGE (pg_size / BDEV_BLK_SIZE)
@@ -28,6 +32,22 @@ static struct kmem_cache *bio_allocator = NULL;
 // Block header allocator
 static struct kmem_cache *blk_header_allocator = NULL;
 
+/*
+ * Flusher thread. It wakes up every FLUSH_POLL ticks and writes out blocks
+ * that have been queued for FLUSH_AGE ticks, or all queued blocks of a device
+ * once they make up more than DIRTY_RATIO percent of the page cache. Blocks
+ * are written FLUSH_BATCH at a time, sorted by block number.
+ */
+#define FLUSH_POLL 10
+#define FLUSH_AGE 100
+#define DIRTY_RATIO 10
+#define DIRTY_LIMIT (PGCACHE_MAX_PAGES * N_BLKS_PER_PAGE * DIRTY_RATIO / 100)
+#define FLUSH_BATCH 64
+
+// Devices the flusher writes back
+static List flush_bdevs;
+static struct spinlock flush_bdevs_lock;
+
 // Block header state bits
 #define BLK_HEADER_VALID 0
 #define BLK_HEADER_DIRTY 1
@@ -52,15 +72,71 @@ static err_t init_blk_headers(struct page *page, struct bdev *bdev, blk_t first_
  */
 static int blocks_zero_ref(struct page *page);
 
+/*
+ * Check if all blocks in a page are clean.
+ *
+ * Precondition:
+ * Caller must hold page->lock.
+ */
+static int blocks_clean(struct page *page);
+
 /*
  * Free all block headers in a page if the page is clean. If the page is dirty,
- * a kernel thread will write the page to bdev and free the headers.
+ * the page cache writes the page to bdev before evicting it, and frees the
+ * headers through bdev_release_page.
  *
  * Precondition:
  * Caller must hold page->lock.
  */
 static void free_blk_headers(struct page *page);
 
+/*
+ * Sort block headers by block number.
+ */
+static void sort_blks(struct blk_header **bhs, size_t n);
+
+/*
+ * Write n blocks taken off their device's dirty queue in block number order,
+ * and drop the queue's references. Blocks that aren't in use are submitted as
+ * one batch, the others are written one at a time once their lock is free.
+ * Blocks that fail to be written are queued again. n is at most FLUSH_BATCH.
+ *
+ * Precondition:
+ * Caller must hold bdev->flush_lock.
+ */
+static void write_queued_blks(struct blk_header **bhs, size_t n);
+
+/*
+ * Take up to FLUSH_BATCH blocks from the front of a device's dirty queue (only
+ * those older than FLUSH_AGE unless all is set or the queue is over
+ * DIRTY_LIMIT), and write them. Return the number of blocks taken.
+ *
+ * Precondition:
+ * Caller must hold bdev->flush_lock.
+ */
+static size_t flush_blks(struct bdev *bdev, int all);
+
+/*
+ * Flusher thread function.
+ */
+static int flusher(void *aux);
+
+/*
+ * Add a bio to its device's request queue, merging it into a queued request of
+ * the same direction that it continues or precedes, up to BDEV_MAX_REQ_BLKS
+ * blocks. Otherwise the bio heads a new request, inserted in block order.
+ *
+ * Precondition:
+ * Caller must hold bdev->queue_lock.
+ */
+static void elv_add_bio(struct bdev *bdev, struct bio *bio);
+
+/*
+ * Complete a bio: call its end_io, or wake up the thread waiting for it. The
+ * bio must not be accessed afterwards.
+ */
+static void end_bio(struct bio *bio);
+
 static err_t
 init_blk_headers(struct page *page, struct bdev *bdev, blk_t first_blk)
 {
@@ -81,6 +157,7 @@ init_blk_headers(struct page *page, struct bdev *bdev, blk_t first_blk)
             bdev_set_blk_valid(bh, True);
             bdev_set_blk_dirty(bh, False);
             bh->ref = 0;
+            bh->queued = False;
         }
     }
     return ERR_OK;
@@ -103,6 +180,23 @@ blocks_zero_ref(struct page *page)
     return True;
 }
 
+static int
+blocks_clean(struct page *page)
+{
+    Node *n;
+    struct blk_header *bh;
+
+    for (n = list_begin(&page->blk_headers);
+         n != list_end(&page->blk_headers);
+         n = list_next(n)) {
+        bh = list_entry(n, struct blk_header, node);
+        if (bdev_is_blk_dirty(bh)) {
+            return False;
+        }
+    }
+    return True;
+}
+
 static void
 free_blk_headers(struct page *page)
 {
@@ -123,9 +217,184 @@ free_blk_headers(struct page *page)
     }
 }
 
+static void
+sort_blks(struct blk_header **bhs, size_t n)
+{
+    struct blk_header *bh;
+    size_t i, j;
+
+    // batches are small, insertion sort will do
+    for (i = 1; i < n; i++) {
+        bh = bhs[i];
+        for (j = i; j > 0 && bhs[j - 1]->blk > bh->blk; j--) {
+            bhs[j] = bhs[j - 1];
+        }
+        bhs[j] = bh;
+    }
+}
+
+static void
+write_queued_blks(struct blk_header **bhs, size_t n)
+{
+    struct blk_header *batch[FLUSH_BATCH], *bh;
+    size_t nbatch, i;
+
+    kassert(n <= FLUSH_BATCH);
+    sort_blks(bhs, n);
+    // Lock what we can without waiting: holding several block locks while
+    // waiting for another could deadlock with a thread doing the same
+    nbatch = 0;
+    for (i = 0; i < n; i++) {
+        bh = bhs[i];
+        if (sleeplock_try_acquire(&bh->lock) != ERR_OK) {
+            continue;
+        }
+        // the block may have been written synchronously since it was queued
+        if (bdev_is_blk_dirty(bh)) {
+            batch[nbatch++] = bh;
+        } else {
+            bdev_release_blk(bh);
+        }
+        bhs[i] = NULL;
+    }
+    if (bdev_write_blks(batch, nbatch) != ERR_OK) {
+        // out of memory, try again later
+        for (i = 0; i < nbatch; i++) {
+            bdev_writeback_blk(batch[i]);
+        }
+    }
+    for (i = 0; i < nbatch; i++) {
+        // drop the queue's reference
+        bdev_release_blk(batch[i]);
+    }
+
+    for (i = 0; i < n; i++) {
+        if ((bh = bhs[i]) == NULL) {
+            continue;
+        }
+        sleeplock_acquire(&bh->lock);
+        if (bdev_is_blk_dirty(bh) && bdev_write_blk(bh) != ERR_OK) {
+            bdev_writeback_blk(bh);
+        }
+        bdev_release_blk(bh);
+    }
+}
+
+static size_t
+flush_blks(struct bdev *bdev, int all)
+{
+    struct blk_header *bhs[FLUSH_BATCH], *bh;
+    uint32_t now;
+    size_t n;
+
+    now = timer_get_ticks();
+    n = 0;
+    spinlock_acquire(&bdev->dirty_lock);
+    all = all || bdev->ndirty > DIRTY_LIMIT;
+    while (n < FLUSH_BATCH && !list_empty(&bdev->dirty_blks)) {
+        bh = list_entry(list_begin(&bdev->dirty_blks), struct blk_header, dirty_node);
+        // the queue is in age order, the remaining blocks are younger
+        if (!all && now - bh->dirty_time < FLUSH_AGE) {
+            break;
+        }
+        list_remove(&bh->dirty_node);
+        bh->queued = False;
+        bdev->ndirty--;
+        bhs[n++] = bh;
+    }
+    spinlock_release(&bdev->dirty_lock);
+
+    write_queued_blks(bhs, n);
+    return n;
+}
+
+static int
+flusher(void *aux)
+{
+    struct bdev *bdev;
+    Node *n;
+
+    while (True) {
+        timer_sleep(FLUSH_POLL);
+        spinlock_acquire(&flush_bdevs_lock);
+        for (n = list_begin(&flush_bdevs); n != list_end(&flush_bdevs); n = list_next(n)) {
+            bdev = list_entry(n, struct bdev, flush_node);
+            // bdev_free takes the flush lock before removing a device, so a
+            // device stays on the list while we hold its flush lock
+            if (sleeplock_try_acquire(&bdev->flush_lock) != ERR_OK) {
+                continue;
+            }
+            spinlock_release(&flush_bdevs_lock);
+            while (flush_blks(bdev, False) == FLUSH_BATCH) {
+                ;
+            }
+            spinlock_acquire(&flush_bdevs_lock);
+            sleeplock_release(&bdev->flush_lock);
+        }
+        spinlock_release(&flush_bdevs_lock);
+    }
+    return 0;
+}
+
+static void
+elv_add_bio(struct bdev *bdev, struct bio *bio)
+{
+    struct bio *req;
+    Node *n, *pos;
+
+    list_init(&bio->merged);
+    bio->req_size = bio->size;
+    pos = list_end(&bdev->request_queue);
+    for (n = list_begin(&bdev->request_queue); n != list_end(&bdev->request_queue); n = list_next(n)) {
+        req = list_entry(n, struct bio, node);
+        if (req->op == bio->op && req->req_size + bio->size <= BDEV_MAX_REQ_BLKS) {
+            if (req->blk + req->req_size == bio->blk) {
+                // back merge
+                list_append(&req->merged, &bio->node);
+                req->req_size += bio->size;
+                return;
+            }
+            if (bio->blk + bio->size == req->blk) {
+                // front merge, the bio takes over the request
+                list_insert(n, &bio->node);
+                list_remove(n);
+                list_append(&bio->merged, n);
+                while (!list_empty(&req->merged)) {
+                    n = list_begin(&req->merged);
+                    list_remove(n);
+                    list_append(&bio->merged, n);
+                }
+                bio->req_size += req->req_size;
+                return;
+            }
+        }
+        if (pos == list_end(&bdev->request_queue) && req->blk > bio->blk) {
+            pos = n;
+        }
+    }
+    list_insert(pos, &bio->node);
+}
+
+static void
+end_bio(struct bio *bio)
+{
+    if (bio->end_io) {
+        bio->end_io(bio);
+        return;
+    }
+    spinlock_acquire(&bio->lock);
+    bio->status = BIO_COMPLETE;
+    condvar_signal(&bio->cv);
+    spinlock_release(&bio->lock);
+}
+
 void
 bdev_init(void)
 {
+    struct thread *t;
+
+    list_init(&flush_bdevs);
+    spinlock_init(&flush_bdevs_lock);
     // Create object allocators
     if ((bdev_allocator = kmem_cache_create(sizeof(struct bdev))) == NULL) {
         panic("Failed to create bdev_allocator");
@@ -136,13 +405,39 @@ bdev_init(void)
     if ((blk_header_allocator = kmem_cache_create(sizeof(struct blk_header))) == NULL) {
         panic("Failed to create blk_header_allocator");
     }
-    // Initialize root block device: currently using IDE
-    if ((root_bdev = ide_alloc(ROOT_DEV_NUM, ROOT_IDE_INDEX)) == NULL) {
-        panic("Failed to allocate root block device");
+    // Initialize root block device: the first virtio-blk disk if there is
+    // one, IDE otherwise
+    if ((root_bdev = virtio_blk_alloc(ROOT_DEV_NUM, ROOT_VIRTIO_INDEX)) != NULL &&
+        virtio_blk_init(root_bdev) != ERR_OK) {
+        virtio_blk_free(root_bdev);
+        root_bdev = NULL;
     }
-    if (ide_init(root_bdev) != ERR_OK) {
-        panic("Failed to initialized root block device");
+    if (root_bdev == NULL) {
+        if ((root_bdev = ide_alloc(ROOT_DEV_NUM, ROOT_IDE_INDEX)) == NULL) {
+            panic("Failed to allocate root block device");
+        }
+        if (ide_init(root_bdev) != ERR_OK) {
+            panic("Failed to initialized root block device");
+        }
     }
+#if RAMDISK_ROOT
+    // Run the root file system from a RAM disk copy of the root disk, sized
+    // to match it. Changes are not written back.
+    {
+        struct bdev *ram_bdev;
+
+        if ((ram_bdev = ramdisk_alloc(ROOT_DEV_NUM, root_bdev->nblks)) == NULL ||
+            ramdisk_load(ram_bdev, root_bdev) != ERR_OK) {
+            panic("Failed to set up root RAM disk");
+        }
+        root_bdev = ram_bdev;
+        kprintf("Root file system on a %d block RAM disk\n", ram_bdev->nblks);
+    }
+#endif
+    if ((t = thread_create("bdev flusher", NULL, DEFAULT_PRI)) == NULL) {
+        panic("Failed to create bdev flusher");
+    }
+    thread_start_context(t, flusher, NULL);
 }
 
 struct bdev*
@@ -154,12 +449,21 @@ bdev_alloc(dev_t dev)
         bdev->dev = dev;
         list_init(&bdev->request_queue);
         spinlock_init(&bdev->queue_lock);
+        bdev->next_blk = 0;
         bdev->request_handler = NULL;
         bdev->data = NULL;
+        bdev->nblks = 0;
+        list_init(&bdev->dirty_blks);
+        bdev->ndirty = 0;
+        spinlock_init(&bdev->dirty_lock);
+        sleeplock_init(&bdev->flush_lock);
         if ((bdev->store = bdevms_alloc(bdev)) == NULL) {
             kmem_cache_free(bdev_allocator, bdev);
-            bdev = NULL;
+            return NULL;
         }
+        spinlock_acquire(&flush_bdevs_lock);
+        list_append(&flush_bdevs, &bdev->flush_node);
+        spinlock_release(&flush_bdevs_lock);
     }
     return bdev;
 }
@@ -168,6 +472,12 @@ void
 bdev_free(struct bdev *bdev)
 {
     // XXX handle remaining requests in the queue?
+    sleeplock_acquire(&bdev->flush_lock);
+    kassert(list_empty(&bdev->dirty_blks));
+    spinlock_acquire(&flush_bdevs_lock);
+    list_remove(&bdev->flush_node);
+    spinlock_release(&flush_bdevs_lock);
+    sleeplock_release(&bdev->flush_lock);
     bdevms_free(bdev->store);
     kmem_cache_free(bdev_allocator, bdev);
 }
@@ -183,6 +493,8 @@ bio_alloc(void)
         bio->size = 0;
         bio->buffer = NULL;
         bio->status = BIO_PENDING;
+        bio->end_io = NULL;
+        bio->private = NULL;
         spinlock_init(&bio->lock);
         condvar_init(&bio->cv);
     }
@@ -196,19 +508,37 @@ bio_free(struct bio *bio)
 }
 
 void
-bdev_make_request(struct bio *bio)
+bdev_submit_bio(struct bio *bio)
 {
-    struct bdev_request request;
+    bdev_submit_bios(&bio, 1);
+}
 
-    // Add request to block device's request queue
-    bio->status = BIO_PENDING;
-    request.bio = bio;
-    spinlock_acquire(&bio->bdev->queue_lock);
-    list_append(&bio->bdev->request_queue, &request.node);
-    spinlock_release(&bio->bdev->queue_lock);
-    // Call the device driver to handle the request
-    bio->bdev->request_handler(bio->bdev);
-    // Wait for block operation to complete
+void
+bdev_submit_bios(struct bio **bios, size_t n)
+{
+    struct bdev *bdev;
+    size_t i;
+
+    if (n == 0) {
+        return;
+    }
+    bdev = bios[0]->bdev;
+    // Add requests to block device's request queue
+    spinlock_acquire(&bdev->queue_lock);
+    for (i = 0; i < n; i++) {
+        kassert(bios[i]->bdev == bdev);
+        bios[i]->status = BIO_PENDING;
+        elv_add_bio(bdev, bios[i]);
+    }
+    spinlock_release(&bdev->queue_lock);
+    // Call the device driver to handle the requests
+    bdev->request_handler(bdev);
+}
+
+void
+bio_wait(struct bio *bio)
+{
+    kassert(bio->end_io == NULL);
     spinlock_acquire(&bio->lock);
     while (bio->status != BIO_COMPLETE) {
         condvar_wait(&bio->cv, &bio->lock);
@@ -216,6 +546,77 @@ bdev_make_request(struct bio *bio)
     spinlock_release(&bio->lock);
 }
 
+void
+bio_wait_all(struct bio **bios, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        bio_wait(bios[i]);
+    }
+}
+
+void
+bdev_make_request(struct bio *bio)
+{
+    bdev_submit_bio(bio);
+    // Wait for block operation to complete
+    bio_wait(bio);
+}
+
+struct bio*
+bdev_next_request(struct bdev *bdev)
+{
+    struct bio *req;
+    Node *n;
+
+    kassert(bdev);
+    spinlock_acquire(&bdev->queue_lock);
+    if (list_empty(&bdev->request_queue)) {
+        spinlock_release(&bdev->queue_lock);
+        return NULL;
+    }
+    // first request at or after the head position, or wrap around
+    for (n = list_begin(&bdev->request_queue); n != list_end(&bdev->request_queue); n = list_next(n)) {
+        if (list_entry(n, struct bio, node)->blk >= bdev->next_blk) {
+            break;
+        }
+    }
+    if (n == list_end(&bdev->request_queue)) {
+        n = list_begin(&bdev->request_queue);
+    }
+    list_remove(n);
+    req = list_entry(n, struct bio, node);
+    bdev->next_blk = req->blk + req->req_size;
+    spinlock_release(&bdev->queue_lock);
+    return req;
+}
+
+struct bio*
+bdev_request_next_bio(struct bio *req, struct bio *bio)
+{
+    Node *n;
+
+    n = bio == req ? list_begin(&req->merged) : list_next(&bio->node);
+    return n == list_end(&req->merged) ? NULL : list_entry(n, struct bio, node);
+}
+
+void
+bdev_complete_request(struct bio *req)
+{
+    struct bio *bio;
+    Node *n;
+
+    // the head goes last, it holds the list of merged bios
+    while (!list_empty(&req->merged)) {
+        n = list_begin(&req->merged);
+        list_remove(n);
+        bio = list_entry(n, struct bio, node);
+        end_bio(bio);
+    }
+    end_bio(req);
+}
+
 int
 bdev_is_blk_valid(struct blk_header *bh) {
     return get_state_bit(bh->state, BLK_HEADER_VALID);
@@ -266,12 +667,15 @@ bdev_get_blk_unlocked(struct bdev *bdev, blk_t blk)
         sleeplock_release(&bdev->store->pgcache_lock);
         return NULL;
     }
+    // Each block reference holds a reference on the page, so the page cache
+    // can't evict the page while its blocks are in use
+    pmem_inc_refcnt(page_to_paddr(page), 1);
     sleeplock_release(&bdev->store->pgcache_lock);
 
     sleeplock_acquire(&page->lock);
     if (init_blk_headers(page, bdev, FIRST_BLK_IN_PAGE(blk)) != ERR_OK) {
         sleeplock_release(&page->lock);
-        // XXX dec reference count on the page
+        pmem_dec_refcnt(page_to_paddr(page));
         return NULL;
     }
 
@@ -309,29 +713,136 @@ bdev_release_blk_unlocked(struct blk_header *bh)
         free_blk_headers(page);
     }
     sleeplock_release(&page->lock);
-    // XXX dec reference count on the page
+    pmem_dec_refcnt(page_to_paddr(page));
+}
+
+void
+bdev_release_page(struct page *page)
+{
+    Node *curr, *next;
+    struct blk_header *bh;
+
+    sleeplock_acquire(&page->lock);
+    kassert(!pmem_is_page_dirty(page));
+    for (curr = list_begin(&page->blk_headers); !list_empty(&page->blk_headers); curr = next) {
+        bh = list_entry(curr, struct blk_header, node);
+        kassert(bh->ref == 0);
+        next = list_remove(curr);
+        kmem_cache_free(blk_header_allocator, bh);
+    }
+    sleeplock_release(&page->lock);
 }
 
 err_t
 bdev_write_blk(struct blk_header *bh)
 {
-    struct bio *bio;
+    return bdev_write_blks(&bh, 1);
+}
 
-    kassert(bdev_is_blk_valid(bh));
+err_t
+bdev_write_blks(struct blk_header **bhs, size_t n)
+{
+    struct bio **bios;
+    struct blk_header *bh;
+    size_t i;
 
-    if ((bio = bio_alloc()) == NULL) {
+    if (n == 0) {
+        return ERR_OK;
+    }
+    if ((bios = kmalloc(n * sizeof(struct bio*))) == NULL) {
         return ERR_NOMEM;
     }
+    for (i = 0; i < n; i++) {
+        bh = bhs[i];
+        kassert(bdev_is_blk_valid(bh));
+        if ((bios[i] = bio_alloc()) == NULL) {
+            while (i > 0) {
+                bio_free(bios[--i]);
+            }
+            kfree(bios);
+            return ERR_NOMEM;
+        }
+        bios[i]->bdev = bh->bdev;
+        bios[i]->blk = bh->blk;
+        bios[i]->size = 1;
+        bios[i]->buffer = bh->data;
+        bios[i]->op = BIO_WRITE;
+    }
+    bdev_submit_bios(bios, n);
+    bio_wait_all(bios, n);
+
+    for (i = 0; i < n; i++) {
+        bh = bhs[i];
+        bio_free(bios[i]);
+        // Now the block buffer is clean, and so is the page once all of its
+        // blocks are
+        bdev_set_blk_dirty(bh, False);
+        sleeplock_acquire(&bh->page->lock);
+        if (blocks_clean(bh->page)) {
+            pmem_set_page_dirty(bh->page, False);
+        }
+        sleeplock_release(&bh->page->lock);
+    }
+    kfree(bios);
+    return ERR_OK;
+}
 
-    bio->bdev = bh->bdev;
-    bio->blk = bh->blk;
-    bio->size = 1;
-    bio->buffer = bh->data;
-    bio->op = BIO_WRITE;
-    bdev_make_request(bio);
-    bio_free(bio);
-    // Now the block buffer is clean
-    bdev_set_blk_dirty(bh, False);
+void
+bdev_writeback_blk(struct blk_header *bh)
+{
+    struct bdev *bdev = bh->bdev;
+
+    // the queue's reference
+    sleeplock_acquire(&bh->page->lock);
+    bh->ref++;
+    sleeplock_release(&bh->page->lock);
+    pmem_inc_refcnt(page_to_paddr(bh->page), 1);
+
+    spinlock_acquire(&bdev->dirty_lock);
+    if (bh->queued) {
+        spinlock_release(&bdev->dirty_lock);
+        bdev_release_blk_unlocked(bh);
+        return;
+    }
+    list_append(&bdev->dirty_blks, &bh->dirty_node);
+    bh->queued = True;
+    bh->dirty_time = timer_get_ticks();
+    bdev->ndirty++;
+    spinlock_release(&bdev->dirty_lock);
+}
 
-    return ERR_OK;
+void
+bdev_flush(struct bdev *bdev)
+{
+    sleeplock_acquire(&bdev->flush_lock);
+    while (flush_blks(bdev, True) > 0) {
+        ;
+    }
+    sleeplock_release(&bdev->flush_lock);
+}
+
+void
+bdev_flush_blks(struct bdev *bdev, struct blk_header **bhs, size_t n)
+{
+    struct blk_header *taken[FLUSH_BATCH];
+    size_t ntaken, i;
+
+    kassert(bdev->flush_lock.holder == thread_current());
+    // Blocks that fail to be written are queued again, so go over the list
+    // until none of them is queued
+    do {
+        ntaken = 0;
+        spinlock_acquire(&bdev->dirty_lock);
+        for (i = 0; i < n && ntaken < FLUSH_BATCH; i++) {
+            kassert(bhs[i]->bdev == bdev);
+            if (bhs[i]->queued) {
+                list_remove(&bhs[i]->dirty_node);
+                bhs[i]->queued = False;
+                bdev->ndirty--;
+                taken[ntaken++] = bhs[i];
+            }
+        }
+        spinlock_release(&bdev->dirty_lock);
+        write_queued_blks(taken, ntaken);
+    } while (ntaken > 0);
 }
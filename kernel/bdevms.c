@@ -16,11 +16,26 @@ static struct kmem_cache *bdevms_allocator = NULL;
  */
 static err_t fillpage(struct memstore *store, offset_t ofs, struct page *page);
 
+/*
+ * Bdev memstore fillpages function, submits the reads of all pages at once.
+ */
+static err_t fillpages(struct memstore *store, struct page **pages, size_t npages);
+
 /*
  * Bdev memstore write function.
  */
 static err_t write(struct memstore *store, paddr_t paddr, offset_t ofs);
 
+/*
+ * Bdev memstore releasepage function, frees the page's block headers.
+ */
+static void releasepage(struct memstore *store, struct page *page);
+
+/*
+ * Bdev memstore size function, the size of the device.
+ */
+static offset_t size(struct memstore *store);
+
 static err_t
 fillpage(struct memstore *store, offset_t ofs, struct page *page)
 {
@@ -45,13 +60,77 @@ fillpage(struct memstore *store, offset_t ofs, struct page *page)
     return ERR_OK;
 }
 
+static err_t
+fillpages(struct memstore *store, struct page **pages, size_t npages)
+{
+    struct bdevms_info *info;
+    struct bio **bios;
+    size_t i;
+
+    kassert(store);
+    kassert(store->info);
+    info = (struct bdevms_info*)store->info;
+    if ((bios = kmalloc(npages * sizeof(struct bio*))) == NULL) {
+        return ERR_MEMSTORE_NOMEM;
+    }
+    for (i = 0; i < npages; i++) {
+        if ((bios[i] = bio_alloc()) == NULL) {
+            while (i > 0) {
+                bio_free(bios[--i]);
+            }
+            kfree(bios);
+            return ERR_MEMSTORE_NOMEM;
+        }
+        bios[i]->bdev = info->bdev;
+        bios[i]->blk = pg_round_down(pages[i]->ofs) / BDEV_BLK_SIZE;
+        bios[i]->size = pg_size / BDEV_BLK_SIZE;
+        bios[i]->buffer = (void*)kmap_p2v(page_to_paddr(pages[i]));
+        bios[i]->op = BIO_READ;
+    }
+    bdev_submit_bios(bios, npages);
+    bio_wait_all(bios, npages);
+    for (i = 0; i < npages; i++) {
+        bio_free(bios[i]);
+    }
+    kfree(bios);
+    return ERR_OK;
+}
+
 static err_t
 write(struct memstore *store, paddr_t paddr, offset_t ofs)
 {
-    // TODO
+    struct bdevms_info *info;
+    struct bio *bio;
+
+    kassert(store);
+    kassert(store->info);
+    info = (struct bdevms_info*)store->info;
+    if ((bio = bio_alloc()) == NULL) {
+        return ERR_MEMSTORE_NOMEM;
+    }
+    bio->bdev = info->bdev;
+    bio->blk = pg_round_down(ofs) / BDEV_BLK_SIZE;
+    bio->size = pg_size / BDEV_BLK_SIZE;
+    bio->buffer = (void*)kmap_p2v(pg_round_down(paddr));
+    bio->op = BIO_WRITE;
+    bdev_make_request(bio);
+    bio_free(bio);
     return ERR_OK;
 }
 
+static void
+releasepage(struct memstore *store, struct page *page)
+{
+    bdev_release_page(page);
+}
+
+static offset_t
+size(struct memstore *store)
+{
+    kassert(store && store->info);
+    return (offset_t) ((struct bdevms_info*)store->info)->bdev->nblks * BDEV_BLK_SIZE;
+}
+
 struct memstore*
 bdevms_alloc(struct bdev *bdev)
 {
@@ -68,7 +147,10 @@ bdevms_alloc(struct bdev *bdev)
         if ((store->info = kmem_cache_alloc(bdevms_allocator)) != NULL) {
             info = (struct bdevms_info*)store->info;
             store->fillpage = fillpage;
+            store->fillpages = fillpages;
             store->write = write;
+            store->releasepage = releasepage;
+            store->size = size;
             info->bdev = bdev;
         } else {
             memstore_free(store);
@@ -178,7 +178,10 @@ console_read(char* buf, int size)
             }
             break;
         }
+        // storing to user memory may fault, and page faults can sleep
+        spinlock_release(console_lock);
         *buf++ = c;
+        spinlock_acquire(console_lock);
         --n;
         if(c == '\n') {
             break;
@@ -2,40 +2,94 @@
 #include <kernel/io.h>
 #include <kernel/console.h>
 #include <kernel/trap.h>
+#include <kernel/pci.h>
+#include <kernel/pmem.h>
+#include <kernel/vm.h>
+#include <kernel/vpmap.h>
 #include <lib/errcode.h>
+#include <lib/stddef.h>
 #include <kernel/ide.h>
 // T_IRQ_IDE is defined in arch-specific trap header
 #include <arch/trap.h>
 
 #define IDE_SECTOR_SIZE     512 // sector size
-// IDE registers
-#define IDE_REG_DATA        0x01F0 // data register
-#define IDE_REG_COUNT       0x01F2 // sector count register
-#define IDE_REG_SECTOR      0x01F3 // sector number register
-#define IDE_REG_CYL_L       0x01F4 // cylinder low register
-#define IDE_REG_CYL_H       0x01F5 // cylinder high register
-#define IDE_REG_DRIVE       0x01F6 // drive selection register
-#define IDE_REG_STATUS_CMD  0x01F7 // status and command register
-#define IDE_REG_CTRL        0x03F6 // control register
+#define IDE_SECTORS_PER_BLK (BDEV_BLK_SIZE / IDE_SECTOR_SIZE)
+// Maximum number of sectors of an LBA28 command (a count of 0 means 256)
+#define IDE_MAX_SECTORS     256
+// IDE channel base ports
+#define IDE_PRIMARY_IO      0x01F0
+#define IDE_PRIMARY_CTRL    0x03F6
+#define IDE_SECONDARY_IO    0x0170
+#define IDE_SECONDARY_CTRL  0x0376
+// IDE registers, as offsets from the channel's I/O base port
+#define IDE_REG_DATA        0x0 // data register
+#define IDE_REG_COUNT       0x2 // sector count register
+#define IDE_REG_SECTOR      0x3 // sector number register
+#define IDE_REG_CYL_L       0x4 // cylinder low register
+#define IDE_REG_CYL_H       0x5 // cylinder high register
+#define IDE_REG_DRIVE       0x6 // drive selection register
+#define IDE_REG_STATUS_CMD  0x7 // status and command register
+// IDE control register values
+#define IDE_CTRL_NIEN       0x02 // disable device interrupts
 // IDE status masks
 #define IDE_STATUS_BSY      0x80
 #define IDE_STATUS_DRDY     0x40
 #define IDE_STATUS_DF       0x20
+#define IDE_STATUS_DRQ      0x08
 #define IDE_STATUS_ERR      0x01
 // IDE commands
 #define IDE_CMD_READ        0x20
 #define IDE_CMD_WRITE       0x30
 #define IDE_CMD_RDMUL       0xC4
 #define IDE_CMD_WRMUL       0xC5
+#define IDE_CMD_SETMUL      0xC6
+#define IDE_CMD_READ_DMA    0xC8
+#define IDE_CMD_WRITE_DMA   0xCA
+#define IDE_CMD_IDENTIFY    0xEC
+// IDENTIFY data word holding the maximum sectors per READ/WRITE MULTIPLE
+// interrupt in its low byte
+#define IDE_IDENT_MAX_MULT  47
+// IDENTIFY data word holding the capabilities, and the DMA capability bit
+#define IDE_IDENT_CAPS      49
+#define IDE_CAPS_DMA        0x0100
+// IDENTIFY data word holding the number of LBA28 addressable sectors
+#define IDE_IDENT_LBA28     60
 
-static struct kmem_cache *ide_allocator = NULL;
+// PCI class of IDE controllers, and the programming interface bit of
+// controllers that support bus mastering
+#define IDE_PCI_CLASS       0x01
+#define IDE_PCI_SUBCLASS    0x01
+#define IDE_PCI_BUS_MASTER  0x80
+// BAR holding the bus master I/O base, the secondary channel's registers
+// follow the primary's
+#define IDE_PCI_BMBAR       4
+#define IDE_BM_SECONDARY    0x8
+// Bus master registers, as offsets from the channel's bus master base port
+#define IDE_BM_CMD          0x0
+#define IDE_BM_STATUS       0x2
+#define IDE_BM_PRDT         0x4
+// Bus master command bits
+#define IDE_BM_CMD_START    0x01
+#define IDE_BM_CMD_READ     0x08 // transfer from the disk to memory
+// Bus master status bits, ERR and IRQ are cleared by writing ones
+#define IDE_BM_STATUS_ACTIVE 0x01
+#define IDE_BM_STATUS_ERR   0x02
+#define IDE_BM_STATUS_IRQ   0x04
+// Last entry flag of a PRD table
+#define IDE_PRD_EOT         0x8000
+// A physical region must not cross a 64KB boundary
+#define IDE_PRD_BOUNDARY    0x10000
 
 /*
- * Retrieve the first operation in the device's request queue. Set pop to True
- * to also remove the first request in the queue. Return NULL if request queue
- * is empty.
+ * Physical region descriptor, a physically contiguous part of a DMA transfer.
  */
-static struct bio *bdev_front_bio(struct bdev *bdev, int pop);
+struct ide_prd {
+    uint32_t addr; // physical address
+    uint16_t size; // size in bytes, 0 means 64KB
+    uint16_t flags;
+} __attribute__((packed));
+
+static struct kmem_cache *ide_allocator = NULL;
 
 /*
  * IDE request handling function
@@ -55,53 +109,72 @@ static void ide_trap_handler(irq_t irq, void *dev, void *regs);
 static err_t ide_wait(struct bdev *bdev);
 
 /*
- * Issue a command to the IDE controller. Must hold the ide descriptor lock when
+ * Take the next request from the device's request queue and issue its first
+ * command, or mark the device idle if the queue is empty. Must hold the ide
+ * descriptor lock when calling this function.
+ */
+static void ide_start_request(struct bdev *bdev);
+
+/*
+ * Issue a command to the IDE controller for the next (up to IDE_MAX_SECTORS)
+ * sectors of the active request. Must hold the ide descriptor lock when
  * calling this function.
  */
-static void ide_issue_cmd(struct bdev *bdev, struct bio *bio);
+static void ide_issue_cmd(struct bdev *bdev);
 
-static struct bio*
-bdev_front_bio(struct bdev *bdev, int pop)
-{
-    struct bio *bio;
-    struct bdev_request *request;
-    Node *node;
-    bio = NULL;
+/*
+ * Return the buffer of the next sector of the active request, and advance the
+ * cursor by up to n sectors that are contiguous in the bio's buffer. Set
+ * *nsectors to the number of sectors advanced by.
+ */
+static void *ide_advance(struct ide_dev *ide, size_t n, size_t *nsectors);
 
-    kassert(bdev);
-    spinlock_acquire(&bdev->queue_lock);
-    if (!list_empty(&bdev->request_queue)) {
-        node = list_begin(&bdev->request_queue);
-        request = list_entry(node, struct bdev_request, node);
-        bio = request->bio;
-        if (pop) {
-            list_remove(node);
-        }
-    }
-    spinlock_release(&bdev->queue_lock);
-    return bio;
-}
+/*
+ * Transfer the next block of (up to ide->mult) sectors of the current command
+ * through the data register, walking the bios of the active request. Must hold
+ * the ide descriptor lock when calling this function.
+ */
+static void ide_transfer(struct bdev *bdev);
+
+/*
+ * Fill the PRD table with the physical regions of the next n sectors of the
+ * active request, advancing the cursor past them.
+ */
+static void ide_build_prdt(struct ide_dev *ide, size_t n);
+
+/*
+ * Finish a DMA command once the disk interrupts. Return ERR_IDE_DISK_ERR if the
+ * transfer failed.
+ */
+static err_t ide_dma_end(struct bdev *bdev);
+
+/*
+ * Set up bus-master DMA if the disk and its PCI controller support it. The
+ * device keeps using PIO otherwise.
+ */
+static void ide_dma_init(struct bdev *bdev, uint16_t caps);
+
+/*
+ * Check that a disk is attached and record its size in bdev->nblks, then enable
+ * the largest READ/WRITE MULTIPLE transfers the disk supports. Set *caps to the
+ * disk's capabilities word. Return ERR_IDE_INIT_FAIL if there is no disk.
+ */
+static err_t ide_identify(struct bdev *bdev, uint16_t *caps);
 
 static void
 ide_request_handler(struct bdev *bdev)
 {
     struct ide_dev *ide;
-    struct bio *bio;
 
     kassert(bdev);
     kassert(bdev->data);
     ide = (struct ide_dev*)bdev->data;
 
     spinlock_acquire(&ide->lock);
-    // Only issue command if there is no ongoing commands
+    // Only issue command if there is no ongoing commands, otherwise the
+    // interrupt handler picks the request up once the device is done
     if (ide->status == IDE_IDLE) {
-        // Issue the first request in the request queue. Do not remove the
-        // request here -- interrupt handler requires access to the bio, and the
-        // interrupt handler will remove the request
-        if ((bio = bdev_front_bio(bdev, False)) != NULL) {
-            kassert(bio->status == BIO_PENDING);
-            ide_issue_cmd(bdev, bio);
-        }
+        ide_start_request(bdev);
     }
     spinlock_release(&ide->lock);
 }
@@ -111,37 +184,47 @@ ide_trap_handler(irq_t irq, void *dev, void *regs)
 {
     struct bdev *bdev;
     struct ide_dev *ide;
-    struct bio *bio;
     kassert(dev);
 
     bdev = (struct bdev*)dev;
     ide = (struct ide_dev*)bdev->data;
-    bio = NULL;
 
     spinlock_acquire(&ide->lock);
     // Nothing to do if no command was previously issued
-    if (ide->status == IDE_BUSY) {
-        // First request in the queue is the active request. Can safely remove
-        // the request in the queue now.
-        bio = bdev_front_bio(bdev, True);
-        kassert(bio);
-        kassert(bio->status == BIO_PENDING);
-        if (bio->op == BIO_READ) {
-            readn(IDE_REG_DATA, bio->buffer, bio->size * BDEV_BLK_SIZE);
+    if (ide->status == IDE_BUSY && ide->dma) {
+        if (ide_dma_end(bdev) != ERR_OK) {
+            // rewind to the start of the command, and redo it with PIO
+            kprintf("IDE disk %d: DMA transfer failed, falling back to PIO\n", ide->ide_index);
+            ide->dma = False;
+            ide->bio = ide->cmd_bio;
+            ide->bio_ofs = ide->cmd_bio_ofs;
+            ide->req_left += ide->cmd_left;
+            ide_issue_cmd(bdev);
+        } else if (ide->req_left > 0) {
+            ide_issue_cmd(bdev);
+        } else {
+            bdev_complete_request(ide->req);
+            ide_start_request(bdev);
+        }
+    } else if (ide->status == IDE_BUSY) {
+        // reading the status acknowledges the interrupt
+        readb(ide->iobase + IDE_REG_STATUS_CMD);
+        // A read interrupts once the next sectors are ready, a write once the
+        // sectors sent last are written
+        if (ide->req->op == BIO_READ) {
+            ide_transfer(bdev);
         }
-        // Complete the request, and wake up the thread waiting for
-        // completion
-        spinlock_acquire(&bio->lock);
-        bio->status = BIO_COMPLETE;
-        condvar_signal(&bio->cv);
-        spinlock_release(&bio->lock);
-        // Issue the next command in the queue (if present)
-        if ((bio = bdev_front_bio(bdev, False)) != NULL) {
-            kassert(bio->status == BIO_PENDING);
-            ide_issue_cmd(bdev, bio);
+        if (ide->cmd_left > 0) {
+            if (ide->req->op == BIO_WRITE) {
+                ide_transfer(bdev);
+            }
+        } else if (ide->req_left > 0) {
+            ide_issue_cmd(bdev);
         } else {
-            // We have completed all the requests
-            ide->status = IDE_IDLE;
+            // Complete the request, wake up the threads waiting for
+            // completion, and move on to the next request (if present)
+            bdev_complete_request(ide->req);
+            ide_start_request(bdev);
         }
     }
     spinlock_release(&ide->lock);
@@ -151,9 +234,10 @@ ide_trap_handler(irq_t irq, void *dev, void *regs)
 static err_t
 ide_wait(struct bdev *bdev)
 {
+    struct ide_dev *ide = (struct ide_dev*)bdev->data;
     int status;
 
-    while (((status = readb(IDE_REG_STATUS_CMD)) & (IDE_STATUS_BSY | IDE_STATUS_DRDY)) != IDE_STATUS_DRDY) {
+    while (((status = readb(ide->iobase + IDE_REG_STATUS_CMD)) & (IDE_STATUS_BSY | IDE_STATUS_DRDY)) != IDE_STATUS_DRDY) {
         ;
     }
     if ((status & (IDE_STATUS_DF | IDE_STATUS_ERR)) != 0) {
@@ -163,41 +247,252 @@ ide_wait(struct bdev *bdev)
 }
 
 static void
-ide_issue_cmd(struct bdev *bdev, struct bio *bio)
+ide_start_request(struct bdev *bdev)
+{
+    struct ide_dev *ide = (struct ide_dev*)bdev->data;
+    struct bio *req;
+
+    if ((req = bdev_next_request(bdev)) == NULL) {
+        // We have completed all the requests
+        ide->status = IDE_IDLE;
+        ide->req = NULL;
+        return;
+    }
+    kassert(req->status == BIO_PENDING);
+    kassert(req->req_size > 0);
+    ide->req = req;
+    ide->bio = req;
+    ide->bio_ofs = 0;
+    ide->req_left = req->req_size * IDE_SECTORS_PER_BLK;
+    ide_issue_cmd(bdev);
+}
+
+static void
+ide_issue_cmd(struct bdev *bdev)
 {
     struct ide_dev *ide;
+    struct bio *req;
     int sector, num_sectors, cmd = 0;
 
     kassert(bdev);
     kassert(bdev->data);
-    kassert(bio);
     ide = (struct ide_dev*)bdev->data;
-    // Determine the command
-    sector = bio->blk * (BDEV_BLK_SIZE / IDE_SECTOR_SIZE);
-    num_sectors = bio->size * (BDEV_BLK_SIZE / IDE_SECTOR_SIZE);
-    // Currently can write a maximum of 8 sectors at once
-    kassert(num_sectors > 0 && num_sectors <= 8);
-    if (bio->op == BIO_READ) {
-        cmd = num_sectors > 1 ? IDE_CMD_RDMUL : IDE_CMD_READ;
-    } else if (bio->op == BIO_WRITE) {
-        cmd = num_sectors > 1 ? IDE_CMD_WRMUL : IDE_CMD_WRITE;
+    req = ide->req;
+    kassert(req);
+    // Split the request into the largest commands the disk takes
+    num_sectors = min(ide->req_left, IDE_MAX_SECTORS);
+    sector = req->blk * IDE_SECTORS_PER_BLK + req->req_size * IDE_SECTORS_PER_BLK - ide->req_left;
+    if (ide->dma) {
+        cmd = req->op == BIO_READ ? IDE_CMD_READ_DMA : IDE_CMD_WRITE_DMA;
+    } else if (req->op == BIO_READ) {
+        cmd = ide->mult > 1 ? IDE_CMD_RDMUL : IDE_CMD_READ;
+    } else if (req->op == BIO_WRITE) {
+        cmd = ide->mult > 1 ? IDE_CMD_WRMUL : IDE_CMD_WRITE;
     }
     // Issue the command
     ide_wait(bdev);
-    writeb(IDE_REG_CTRL, 0);
-    writeb(IDE_REG_COUNT, num_sectors);
-    writeb(IDE_REG_SECTOR, sector & 0xFF);
-    writeb(IDE_REG_CYL_L, (sector >> 8) & 0xFF);
-    writeb(IDE_REG_CYL_H, (sector >> 16) & 0xFF);
-    writeb(IDE_REG_DRIVE, 0xE0 | (ide->ide_index << 4) | ((sector >> 24) & 0x0F));
-    writeb(IDE_REG_STATUS_CMD, cmd);
-    if (bio->op == BIO_WRITE) {
-        writen(IDE_REG_DATA, bio->buffer, bio->size * BDEV_BLK_SIZE);
+    if (ide->dma) {
+        // Point the controller at the command's memory, and clear its status
+        ide->cmd_bio = ide->bio;
+        ide->cmd_bio_ofs = ide->bio_ofs;
+        ide_build_prdt(ide, num_sectors);
+        writel(ide->bmbase + IDE_BM_PRDT, (uint32_t) kmap_v2p((vaddr_t) ide->prdt));
+        writeb(ide->bmbase + IDE_BM_CMD, req->op == BIO_READ ? IDE_BM_CMD_READ : 0);
+        writeb(ide->bmbase + IDE_BM_STATUS, IDE_BM_STATUS_ERR | IDE_BM_STATUS_IRQ);
+    }
+    writeb(ide->ctrlbase, 0);
+    writeb(ide->iobase + IDE_REG_COUNT, num_sectors & 0xFF);
+    writeb(ide->iobase + IDE_REG_SECTOR, sector & 0xFF);
+    writeb(ide->iobase + IDE_REG_CYL_L, (sector >> 8) & 0xFF);
+    writeb(ide->iobase + IDE_REG_CYL_H, (sector >> 16) & 0xFF);
+    writeb(ide->iobase + IDE_REG_DRIVE, 0xE0 | ((ide->ide_index & 1) << 4) | ((sector >> 24) & 0x0F));
+    writeb(ide->iobase + IDE_REG_STATUS_CMD, cmd);
+    ide->req_left -= num_sectors;
+    ide->cmd_left = num_sectors;
+    if (ide->dma) {
+        // the disk moves the data, and interrupts once at the end
+        writeb(ide->bmbase + IDE_BM_CMD, (req->op == BIO_READ ? IDE_BM_CMD_READ : 0) | IDE_BM_CMD_START);
+    } else if (req->op == BIO_WRITE) {
+        // the disk asks for the first sectors right away, the rest after
+        // each interrupt
+        while ((readb(ide->iobase + IDE_REG_STATUS_CMD) & (IDE_STATUS_BSY | IDE_STATUS_DRQ)) != IDE_STATUS_DRQ) {
+            ;
+        }
+        ide_transfer(bdev);
     }
     // Change status to busy
     ide->status = IDE_BUSY;
 }
 
+static void*
+ide_advance(struct ide_dev *ide, size_t n, size_t *nsectors)
+{
+    void *buf;
+
+    kassert(ide->bio);
+    // the sectors may span the end of one bio and the start of the next
+    *nsectors = min(n, ide->bio->size * IDE_SECTORS_PER_BLK - ide->bio_ofs);
+    buf = (char*) ide->bio->buffer + ide->bio_ofs * IDE_SECTOR_SIZE;
+    ide->bio_ofs += *nsectors;
+    if (ide->bio_ofs == ide->bio->size * IDE_SECTORS_PER_BLK) {
+        ide->bio = bdev_request_next_bio(ide->req, ide->bio);
+        ide->bio_ofs = 0;
+    }
+    return buf;
+}
+
+static void
+ide_transfer(struct bdev *bdev)
+{
+    struct ide_dev *ide = (struct ide_dev*)bdev->data;
+    size_t n, chunk;
+    void *buf;
+
+    for (n = min(ide->cmd_left, ide->mult); n > 0; n -= chunk) {
+        buf = ide_advance(ide, n, &chunk);
+        if (ide->req->op == BIO_READ) {
+            readn(ide->iobase + IDE_REG_DATA, buf, chunk * IDE_SECTOR_SIZE);
+        } else {
+            writen(ide->iobase + IDE_REG_DATA, buf, chunk * IDE_SECTOR_SIZE);
+        }
+        ide->cmd_left -= chunk;
+    }
+}
+
+static void
+ide_build_prdt(struct ide_dev *ide, size_t n)
+{
+    struct ide_prd *prd;
+    size_t chunk, len, size;
+    vaddr_t vaddr;
+    paddr_t paddr;
+    int nprd = 0;
+
+    prd = NULL;
+    for (; n > 0; n -= chunk) {
+        vaddr = (vaddr_t) ide_advance(ide, n, &chunk);
+        // the buffer is only contiguous in physical memory within a page
+        for (len = chunk * IDE_SECTOR_SIZE; len > 0; len -= size, vaddr += size) {
+            size = min(len, pg_size - (vaddr & (pg_size - 1)));
+            paddr = kmap_v2p(vaddr);
+            kassert(paddr + size <= 0x100000000);
+            // extend the last region if it continues there without crossing a
+            // 64KB boundary
+            if (prd && prd->addr + (prd->size == 0 ? IDE_PRD_BOUNDARY : prd->size) == paddr &&
+                prd->addr / IDE_PRD_BOUNDARY == (paddr + size - 1) / IDE_PRD_BOUNDARY) {
+                prd->size += size;
+                continue;
+            }
+            kassert(nprd < pg_size / sizeof(struct ide_prd));
+            prd = &ide->prdt[nprd++];
+            prd->addr = paddr;
+            prd->size = size;
+            prd->flags = 0;
+        }
+    }
+    kassert(prd);
+    prd->flags = IDE_PRD_EOT;
+}
+
+static err_t
+ide_dma_end(struct bdev *bdev)
+{
+    struct ide_dev *ide = (struct ide_dev*)bdev->data;
+    int bmstatus, status;
+
+    bmstatus = readb(ide->bmbase + IDE_BM_STATUS);
+    // stop the controller, clear its interrupt, and acknowledge the disk's
+    writeb(ide->bmbase + IDE_BM_CMD, 0);
+    writeb(ide->bmbase + IDE_BM_STATUS, IDE_BM_STATUS_ERR | IDE_BM_STATUS_IRQ);
+    status = readb(ide->iobase + IDE_REG_STATUS_CMD);
+    if ((bmstatus & IDE_BM_STATUS_ERR) != 0 || (status & (IDE_STATUS_DF | IDE_STATUS_ERR)) != 0) {
+        return ERR_IDE_DISK_ERR;
+    }
+    ide->cmd_left = 0;
+    return ERR_OK;
+}
+
+static void
+ide_dma_init(struct bdev *bdev, uint16_t caps)
+{
+    struct ide_dev *ide = (struct ide_dev*)bdev->data;
+    struct pci_dev pci;
+    paddr_t paddr;
+
+    if ((caps & IDE_CAPS_DMA) == 0 ||
+        pci_find_class(IDE_PCI_CLASS, IDE_PCI_SUBCLASS, &pci) != ERR_OK ||
+        (pci.prog_if & IDE_PCI_BUS_MASTER) == 0 ||
+        (ide->bmbase = pci_io_bar(&pci, IDE_PCI_BMBAR)) == 0) {
+        return;
+    }
+    // the controller takes a 32-bit table address
+    if (pmem_alloc(&paddr) != ERR_OK) {
+        return;
+    }
+    if (paddr >= 0x100000000) {
+        pmem_free(paddr);
+        return;
+    }
+    if (ide->ide_index >= 2) {
+        ide->bmbase += IDE_BM_SECONDARY;
+    }
+    pci_enable_bus_master(&pci);
+    ide->prdt = (struct ide_prd*) kmap_p2v(paddr);
+    ide->dma = True;
+}
+
+static err_t
+ide_identify(struct bdev *bdev, uint16_t *caps)
+{
+    struct ide_dev *ide = (struct ide_dev*)bdev->data;
+    uint16_t ident[IDE_SECTOR_SIZE / sizeof(uint16_t)];
+    int status;
+
+    // poll for the result, the handler isn't registered yet
+    writeb(ide->ctrlbase, IDE_CTRL_NIEN);
+    writeb(ide->iobase + IDE_REG_DRIVE, 0xA0 | ((ide->ide_index & 1) << 4));
+    // a channel without disks floats its status register high
+    if (readb(ide->iobase + IDE_REG_STATUS_CMD) == 0xFF) {
+        return ERR_IDE_INIT_FAIL;
+    }
+    writeb(ide->iobase + IDE_REG_COUNT, 0);
+    writeb(ide->iobase + IDE_REG_SECTOR, 0);
+    writeb(ide->iobase + IDE_REG_CYL_L, 0);
+    writeb(ide->iobase + IDE_REG_CYL_H, 0);
+    writeb(ide->iobase + IDE_REG_STATUS_CMD, IDE_CMD_IDENTIFY);
+    if ((status = readb(ide->iobase + IDE_REG_STATUS_CMD)) == 0) {
+        return ERR_IDE_INIT_FAIL;
+    }
+    while ((status & IDE_STATUS_BSY) != 0) {
+        status = readb(ide->iobase + IDE_REG_STATUS_CMD);
+    }
+    // ATAPI and SATA devices don't identify as ATA disks
+    if ((status & IDE_STATUS_ERR) != 0 ||
+        readb(ide->iobase + IDE_REG_CYL_L) != 0 || readb(ide->iobase + IDE_REG_CYL_H) != 0) {
+        return ERR_IDE_INIT_FAIL;
+    }
+    if (ide_wait(bdev) != ERR_OK) {
+        return ERR_IDE_INIT_FAIL;
+    }
+    readn(ide->iobase + IDE_REG_DATA, ident, sizeof(ident));
+    bdev->nblks = (ident[IDE_IDENT_LBA28] | ((blk_t) ident[IDE_IDENT_LBA28 + 1] << 16))
+        / IDE_SECTORS_PER_BLK;
+    *caps = ident[IDE_IDENT_CAPS];
+
+    // Fall back to an interrupt per sector if the disk doesn't take
+    // multiple-sector transfers
+    ide->mult = 1;
+    if ((ident[IDE_IDENT_MAX_MULT] & 0xFF) > 1) {
+        writeb(ide->iobase + IDE_REG_COUNT, ident[IDE_IDENT_MAX_MULT] & 0xFF);
+        writeb(ide->iobase + IDE_REG_DRIVE, 0xA0 | ((ide->ide_index & 1) << 4));
+        writeb(ide->iobase + IDE_REG_STATUS_CMD, IDE_CMD_SETMUL);
+        if (ide_wait(bdev) == ERR_OK) {
+            ide->mult = ident[IDE_IDENT_MAX_MULT] & 0xFF;
+        }
+    }
+    return ERR_OK;
+}
+
 struct bdev*
 ide_alloc(dev_t dev, uint8_t ide_index)
 {
@@ -218,7 +513,14 @@ ide_alloc(dev_t dev, uint8_t ide_index)
     }
     spinlock_init(&ide->lock);
     ide->status = IDE_IDLE;
+    ide->mult = 1;
+    ide->req = NULL;
+    ide->dma = False;
+    ide->prdt = NULL;
     ide->ide_index = ide_index;
+    ide->iobase = ide_index < 2 ? IDE_PRIMARY_IO : IDE_SECONDARY_IO;
+    ide->ctrlbase = ide_index < 2 ? IDE_PRIMARY_CTRL : IDE_SECONDARY_CTRL;
+    ide->irq = ide_index < 2 ? T_IRQ_IDE : T_IRQ_IDE2;
     bdev->data = (void*)ide;
     bdev->request_handler = ide_request_handler;
     return bdev;
@@ -233,6 +535,9 @@ ide_free(struct bdev *bdev)
     kassert(bdev->data);
     ide = (struct ide_dev*)bdev->data;
     // XXX wait for device to become idle?
+    if (ide->prdt) {
+        pmem_free(kmap_v2p((vaddr_t) ide->prdt));
+    }
     kmem_cache_free(ide_allocator, ide);
     bdev_free(bdev);
 }
@@ -240,13 +545,22 @@ ide_free(struct bdev *bdev)
 err_t
 ide_init(struct bdev *bdev)
 {
+    struct ide_dev *ide;
+    uint16_t caps;
+
     kassert(bdev);
+    kassert(bdev->data);
+    ide = (struct ide_dev*)bdev->data;
+    if (ide_identify(bdev, &caps) != ERR_OK) {
+        return ERR_IDE_INIT_FAIL;
+    }
+    ide_dma_init(bdev, caps);
     // register trap handler
-    if (trap_register_handler(T_IRQ_IDE, bdev, ide_trap_handler) != ERR_OK) {
+    if (trap_register_handler(ide->irq, bdev, ide_trap_handler) != ERR_OK) {
         return ERR_IDE_INIT_FAIL;
     }
     // Enable IRQ
-    if (trap_enable_irq(T_IRQ_IDE) != ERR_OK) {
+    if (trap_enable_irq(ide->irq) != ERR_OK) {
         return ERR_IDE_INIT_FAIL;
     }
     // Wait for the disk to become ready
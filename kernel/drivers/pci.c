@@ -0,0 +1,124 @@
+#include <kernel/pci.h>
+#include <kernel/io.h>
+#include <kernel/console.h>
+#include <lib/errcode.h>
+
+// Configuration mechanism #1 ports
+#define PCI_CONFIG_ADDRESS  0x0CF8
+#define PCI_CONFIG_DATA     0x0CFC
+#define PCI_CONFIG_ENABLE   0x80000000
+
+#define PCI_MAX_BUS         256
+#define PCI_MAX_SLOT        32
+#define PCI_MAX_FUNC        8
+// Vendor ID read from an empty slot
+#define PCI_VENDOR_NONE     0xFFFF
+// Header type bit set by multi-function devices
+#define PCI_HEADER_MULTIFUNC 0x80
+
+/*
+ * Fill in the IDs and class of the function at bus, slot, func. Return False
+ * if there is no such function.
+ */
+static bool pci_probe(uint8_t bus, uint8_t slot, uint8_t func, struct pci_dev *dev);
+
+/*
+ * Find the index-th PCI function whose configuration register reg, masked by
+ * mask, equals key, and fill in dev. Return ERR_NOTEXIST if there is none.
+ */
+static err_t pci_find(uint8_t reg, uint32_t mask, uint32_t key, int index, struct pci_dev *dev);
+
+static bool
+pci_probe(uint8_t bus, uint8_t slot, uint8_t func, struct pci_dev *dev)
+{
+    uint32_t id, class;
+
+    dev->bus = bus;
+    dev->slot = slot;
+    dev->func = func;
+    id = pci_read_config(dev, PCI_CONFIG_ID);
+    if ((id & 0xFFFF) == PCI_VENDOR_NONE) {
+        return False;
+    }
+    class = pci_read_config(dev, PCI_CONFIG_CLASS);
+    dev->vendor_id = id & 0xFFFF;
+    dev->device_id = id >> 16;
+    dev->class = class >> 24;
+    dev->subclass = (class >> 16) & 0xFF;
+    dev->prog_if = (class >> 8) & 0xFF;
+    dev->irq_line = pci_read_config(dev, PCI_CONFIG_IRQ) & 0xFF;
+    return True;
+}
+
+static err_t
+pci_find(uint8_t reg, uint32_t mask, uint32_t key, int index, struct pci_dev *dev)
+{
+    int bus, slot, func, nfunc;
+
+    kassert(dev);
+    for (bus = 0; bus < PCI_MAX_BUS; bus++) {
+        for (slot = 0; slot < PCI_MAX_SLOT; slot++) {
+            // only multi-function devices implement functions past 0
+            if (!pci_probe(bus, slot, 0, dev)) {
+                continue;
+            }
+            nfunc = (pci_read_config(dev, PCI_CONFIG_HEADER) >> 16) & PCI_HEADER_MULTIFUNC ? PCI_MAX_FUNC : 1;
+            for (func = 0; func < nfunc; func++) {
+                if (pci_probe(bus, slot, func, dev) && (pci_read_config(dev, reg) & mask) == key &&
+                    index-- == 0) {
+                    return ERR_OK;
+                }
+            }
+        }
+    }
+    return ERR_NOTEXIST;
+}
+
+uint32_t
+pci_read_config(struct pci_dev *dev, uint8_t reg)
+{
+    kassert((reg & 0x3) == 0);
+    writel(PCI_CONFIG_ADDRESS, PCI_CONFIG_ENABLE | (dev->bus << 16) | (dev->slot << 11) | (dev->func << 8) | reg);
+    return readl(PCI_CONFIG_DATA);
+}
+
+void
+pci_write_config(struct pci_dev *dev, uint8_t reg, uint32_t val)
+{
+    kassert((reg & 0x3) == 0);
+    writel(PCI_CONFIG_ADDRESS, PCI_CONFIG_ENABLE | (dev->bus << 16) | (dev->slot << 11) | (dev->func << 8) | reg);
+    writel(PCI_CONFIG_DATA, val);
+}
+
+err_t
+pci_find_class(uint8_t class, uint8_t subclass, struct pci_dev *dev)
+{
+    return pci_find(PCI_CONFIG_CLASS, 0xFFFF0000, ((uint32_t) class << 24) | (subclass << 16), 0, dev);
+}
+
+err_t
+pci_find_device(uint16_t vendor_id, uint16_t device_id, int index, struct pci_dev *dev)
+{
+    return pci_find(PCI_CONFIG_ID, 0xFFFFFFFF, ((uint32_t) device_id << 16) | vendor_id, index, dev);
+}
+
+port_t
+pci_io_bar(struct pci_dev *dev, int bar)
+{
+    uint32_t val;
+
+    kassert(bar >= 0 && bar < 6);
+    val = pci_read_config(dev, PCI_CONFIG_BAR0 + 4 * bar);
+    // bit 0 is set for I/O space BARs
+    return (val & 0x1) ? (port_t) (val & ~0x3) : 0;
+}
+
+void
+pci_enable_bus_master(struct pci_dev *dev)
+{
+    uint32_t cmd;
+
+    cmd = pci_read_config(dev, PCI_CONFIG_CMD);
+    // keep the status half zero, its bits are cleared by writing ones
+    pci_write_config(dev, PCI_CONFIG_CMD, (cmd & 0xFFFF) | PCI_CMD_IO | PCI_CMD_BUS_MASTER);
+}
@@ -0,0 +1,164 @@
+#include <kernel/kmalloc.h>
+#include <kernel/console.h>
+#include <kernel/pmem.h>
+#include <kernel/vm.h>
+#include <kernel/vpmap.h>
+#include <kernel/ramdisk.h>
+#include <lib/errcode.h>
+#include <lib/stddef.h>
+#include <lib/string.h>
+
+// Number of blocks in a page
+#define N_BLKS_PER_PAGE (pg_size / BDEV_BLK_SIZE)
+// Number of pages ramdisk_load reads at once
+#define LOAD_BATCH 32
+
+static struct kmem_cache *ramdisk_allocator = NULL;
+
+/*
+ * RAM disk request handling function: serve every queued request right away.
+ */
+static void ramdisk_request_handler(struct bdev *bdev);
+
+/*
+ * Copy the data of a bio from/to the RAM disk.
+ */
+static void ramdisk_copy(struct ramdisk_dev *rd, struct bio *bio);
+
+static void
+ramdisk_request_handler(struct bdev *bdev)
+{
+    struct ramdisk_dev *rd;
+    struct bio *req, *bio;
+
+    kassert(bdev);
+    kassert(bdev->data);
+    rd = (struct ramdisk_dev*)bdev->data;
+    // Requests don't overlap, so submitters can copy theirs concurrently
+    while ((req = bdev_next_request(bdev)) != NULL) {
+        for (bio = req; bio != NULL; bio = bdev_request_next_bio(req, bio)) {
+            ramdisk_copy(rd, bio);
+        }
+        bdev_complete_request(req);
+    }
+}
+
+static void
+ramdisk_copy(struct ramdisk_dev *rd, struct bio *bio)
+{
+    blk_t blk;
+    char *buf, *data;
+    size_t n;
+
+    kassert(bio->blk + bio->size <= rd->npages * N_BLKS_PER_PAGE);
+    buf = bio->buffer;
+    for (blk = bio->blk; blk < bio->blk + bio->size; blk += n, buf += n * BDEV_BLK_SIZE) {
+        // copy up to the end of the block's page
+        n = min(bio->blk + bio->size - blk, N_BLKS_PER_PAGE - blk % N_BLKS_PER_PAGE);
+        data = (char*) kmap_p2v(rd->pages[blk / N_BLKS_PER_PAGE]) + (blk % N_BLKS_PER_PAGE) * BDEV_BLK_SIZE;
+        if (bio->op == BIO_READ) {
+            memcpy(buf, data, n * BDEV_BLK_SIZE);
+        } else {
+            memcpy(data, buf, n * BDEV_BLK_SIZE);
+        }
+    }
+}
+
+struct bdev*
+ramdisk_alloc(dev_t dev, blk_t nblks)
+{
+    struct bdev *bdev;
+    struct ramdisk_dev *rd;
+    size_t i;
+
+    if (ramdisk_allocator == NULL) {
+        if ((ramdisk_allocator = kmem_cache_create(sizeof(struct ramdisk_dev))) == NULL) {
+            return NULL;
+        }
+    }
+    if (nblks == 0 || (bdev = bdev_alloc(dev)) == NULL) {
+        return NULL;
+    }
+    if ((rd = kmem_cache_alloc(ramdisk_allocator)) == NULL) {
+        goto fail_bdev;
+    }
+    rd->npages = (nblks + N_BLKS_PER_PAGE - 1) / N_BLKS_PER_PAGE;
+    if ((rd->pages = kmalloc(rd->npages * sizeof(paddr_t))) == NULL) {
+        goto fail_rd;
+    }
+    // Allocate all memory now, so requests never wait on the allocator
+    for (i = 0; i < rd->npages; i++) {
+        if (pmem_alloc_zeroed(&rd->pages[i]) != ERR_OK) {
+            while (i > 0) {
+                pmem_free(rd->pages[--i]);
+            }
+            kfree(rd->pages);
+            goto fail_rd;
+        }
+    }
+    bdev->data = (void*)rd;
+    bdev->request_handler = ramdisk_request_handler;
+    bdev->nblks = nblks;
+    return bdev;
+
+fail_rd:
+    kmem_cache_free(ramdisk_allocator, rd);
+fail_bdev:
+    bdev_free(bdev);
+    return NULL;
+}
+
+void
+ramdisk_free(struct bdev *bdev)
+{
+    struct ramdisk_dev *rd;
+    size_t i;
+
+    kassert(bdev);
+    kassert(bdev->data);
+    rd = (struct ramdisk_dev*)bdev->data;
+    for (i = 0; i < rd->npages; i++) {
+        pmem_free(rd->pages[i]);
+    }
+    kfree(rd->pages);
+    kmem_cache_free(ramdisk_allocator, rd);
+    bdev_free(bdev);
+}
+
+err_t
+ramdisk_load(struct bdev *bdev, struct bdev *src)
+{
+    struct ramdisk_dev *rd;
+    struct bio *bios[LOAD_BATCH];
+    size_t i, n;
+    blk_t blk;
+    err_t err = ERR_OK;
+
+    kassert(bdev && bdev->data && src);
+    rd = (struct ramdisk_dev*)bdev->data;
+    for (n = 0; n < LOAD_BATCH; n++) {
+        if ((bios[n] = bio_alloc()) == NULL) {
+            err = ERR_NOMEM;
+            goto done;
+        }
+    }
+    // Read straight into the RAM disk's pages, a batch of pages at a time
+    for (blk = 0; blk < bdev->nblks; ) {
+        for (i = 0; i < LOAD_BATCH && blk < bdev->nblks; i++) {
+            bios[i]->bdev = src;
+            bios[i]->blk = blk;
+            bios[i]->size = min(bdev->nblks - blk, N_BLKS_PER_PAGE);
+            bios[i]->buffer = (void*) kmap_p2v(rd->pages[blk / N_BLKS_PER_PAGE]);
+            bios[i]->op = BIO_READ;
+            blk += bios[i]->size;
+        }
+        bdev_submit_bios(bios, i);
+        bio_wait_all(bios, i);
+    }
+
+done:
+    while (n > 0) {
+        bio_free(bios[--n]);
+    }
+    return err;
+}
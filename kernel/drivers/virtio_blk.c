@@ -0,0 +1,487 @@
+#include <kernel/kmalloc.h>
+#include <kernel/io.h>
+#include <kernel/console.h>
+#include <kernel/trap.h>
+#include <kernel/pci.h>
+#include <kernel/pmem.h>
+#include <kernel/vm.h>
+#include <kernel/vpmap.h>
+#include <kernel/virtio_blk.h>
+#include <lib/errcode.h>
+#include <lib/stddef.h>
+#include <lib/string.h>
+// T_IRQ0 is defined in arch-specific trap header
+#include <arch/trap.h>
+
+#define VBLK_SECTOR_SIZE    512 // sector size
+#define VBLK_SECTORS_PER_BLK (BDEV_BLK_SIZE / VBLK_SECTOR_SIZE)
+// Maximum number of data descriptors per command
+#define VBLK_MAX_SEGS       64
+// PCI IDs of a transitional virtio-blk device, which has the legacy interface
+#define VIRTIO_PCI_VENDOR   0x1AF4
+#define VIRTIO_PCI_BLK      0x1001
+// Legacy registers, as offsets from the device's I/O BAR
+#define VIRTIO_REG_HOST_FEATURES  0x00
+#define VIRTIO_REG_GUEST_FEATURES 0x04
+#define VIRTIO_REG_QUEUE_PFN      0x08
+#define VIRTIO_REG_QUEUE_SIZE     0x0C
+#define VIRTIO_REG_QUEUE_SEL      0x0E
+#define VIRTIO_REG_QUEUE_NOTIFY   0x10
+#define VIRTIO_REG_STATUS         0x12
+#define VIRTIO_REG_ISR            0x13
+#define VIRTIO_REG_CONFIG         0x14
+// virtio-blk configuration fields, as offsets from VIRTIO_REG_CONFIG
+#define VIRTIO_BLK_CFG_CAPACITY   0x00 // 64-bit number of sectors
+#define VIRTIO_BLK_CFG_SEG_MAX    0x0C
+// Device status bits
+#define VIRTIO_STATUS_ACK         0x01
+#define VIRTIO_STATUS_DRIVER      0x02
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_FAILED      0x80
+// Feature bits
+#define VIRTIO_BLK_F_SEG_MAX      (1 << 2)
+#define VIRTIO_RING_F_EVENT_IDX   (1 << 29)
+// Virtqueue alignment of the legacy interface
+#define VIRTIO_QUEUE_ALIGN        4096
+// Descriptor flags
+#define VRING_DESC_F_NEXT         0x1
+#define VRING_DESC_F_WRITE        0x2 // device writes the buffer
+// Used ring flags
+#define VRING_USED_F_NO_NOTIFY    0x1
+// Command types and status
+#define VIRTIO_BLK_T_IN           0
+#define VIRTIO_BLK_T_OUT          1
+#define VIRTIO_BLK_S_OK           0
+// Size of the command header the device reads (type, reserved, sector)
+#define VBLK_HEADER_SIZE          16
+
+/*
+ * Virtqueue layout, shared with the device.
+ */
+struct vring_desc {
+    uint64_t addr; // physical address
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed));
+
+struct vring_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[]; // followed by used_event
+} __attribute__((packed));
+
+struct vring_used_elem {
+    uint32_t id; // head descriptor of the completed command
+    uint32_t len;
+} __attribute__((packed));
+
+struct vring_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct vring_used_elem ring[]; // followed by avail_event
+} __attribute__((packed));
+
+/*
+ * A command's header, read by the device, and status, written by the device.
+ */
+struct virtio_blk_cmd {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+    uint8_t status;
+    struct bio *req; // request the command is part of
+};
+
+static struct kmem_cache *vblk_allocator = NULL;
+
+/*
+ * virtio-blk request handling function
+ */
+static void vblk_request_handler(struct bdev *bdev);
+
+/*
+ * virtio-blk trap handler function
+ */
+static void vblk_trap_handler(irq_t irq, void *dev, void *regs);
+
+/*
+ * Place commands for queued requests on the virtqueue while it has room, and
+ * notify the device once for all of them. Must hold the descriptor lock when
+ * calling this function.
+ */
+static void vblk_issue(struct bdev *bdev);
+
+/*
+ * Place one command for the next sectors of the request being issued on the
+ * virtqueue: a header, up to max_segs data descriptors, and a status byte. The
+ * virtqueue must have at least 3 free descriptors.
+ */
+static void vblk_issue_cmd(struct virtio_blk_dev *vblk);
+
+/*
+ * Consume the used ring, completing requests whose commands are all done.
+ * With event_idx, ask for the next interrupt once half the commands in flight
+ * are done, so a burst of completions costs a few interrupts. Must hold the
+ * descriptor lock when calling this function.
+ */
+static void vblk_complete(struct virtio_blk_dev *vblk);
+
+/*
+ * Allocate/free a descriptor of the virtqueue.
+ */
+static uint16_t vblk_alloc_desc(struct virtio_blk_dev *vblk);
+static void vblk_free_desc(struct virtio_blk_dev *vblk, uint16_t d);
+
+/*
+ * Set up the device's virtqueue. Return ERR_VIRTIO_BLK_INIT_FAIL if failed.
+ */
+static err_t vblk_setup_queue(struct virtio_blk_dev *vblk);
+
+static void
+vblk_request_handler(struct bdev *bdev)
+{
+    struct virtio_blk_dev *vblk;
+
+    kassert(bdev);
+    kassert(bdev->data);
+    vblk = (struct virtio_blk_dev*)bdev->data;
+
+    spinlock_acquire(&vblk->lock);
+    vblk_issue(bdev);
+    spinlock_release(&vblk->lock);
+}
+
+static void
+vblk_trap_handler(irq_t irq, void *dev, void *regs)
+{
+    struct bdev *bdev;
+    struct virtio_blk_dev *vblk;
+    kassert(dev);
+
+    bdev = (struct bdev*)dev;
+    vblk = (struct virtio_blk_dev*)bdev->data;
+    // reading the ISR acknowledges the interrupt
+    readb(vblk->iobase + VIRTIO_REG_ISR);
+    spinlock_acquire(&vblk->lock);
+    vblk_complete(vblk);
+    // completed commands freed descriptors for queued requests
+    vblk_issue(bdev);
+    spinlock_release(&vblk->lock);
+    trap_notify_irq_completion();
+}
+
+static void
+vblk_issue(struct bdev *bdev)
+{
+    struct virtio_blk_dev *vblk = (struct virtio_blk_dev*)bdev->data;
+    uint16_t old_idx, new_idx, event;
+    struct bio *req;
+
+    old_idx = vblk->avail->idx;
+    while (vblk->nfree >= 3) {
+        if (vblk->req == NULL) {
+            if ((req = bdev_next_request(bdev)) == NULL) {
+                break;
+            }
+            kassert(req->status == BIO_PENDING);
+            kassert(req->req_size > 0);
+            req->nr_pending = 0;
+            vblk->req = req;
+            vblk->bio = req;
+            vblk->bio_ofs = 0;
+            vblk->req_left = req->req_size * VBLK_SECTORS_PER_BLK;
+        }
+        vblk_issue_cmd(vblk);
+    }
+    new_idx = vblk->avail->idx;
+    if (new_idx == old_idx) {
+        return;
+    }
+    // the device must see the new ring entries before we look at whether it
+    // wants to be notified
+    __sync_synchronize();
+    if (vblk->event_idx) {
+        event = *(volatile uint16_t*) &vblk->used->ring[vblk->qsize];
+        if ((uint16_t) (new_idx - event - 1) >= (uint16_t) (new_idx - old_idx)) {
+            return;
+        }
+    } else if (vblk->used->flags & VRING_USED_F_NO_NOTIFY) {
+        return;
+    }
+    writew(vblk->iobase + VIRTIO_REG_QUEUE_NOTIFY, 0);
+}
+
+static void
+vblk_issue_cmd(struct virtio_blk_dev *vblk)
+{
+    struct virtio_blk_cmd *cmd;
+    struct bio *req = vblk->req;
+    uint16_t head, prev, d;
+    size_t nsegs, n;
+    vaddr_t buf;
+
+    kassert(vblk->nfree >= 3);
+    head = vblk_alloc_desc(vblk);
+    cmd = &vblk->cmds[head];
+    cmd->type = req->op == BIO_READ ? VIRTIO_BLK_T_IN : VIRTIO_BLK_T_OUT;
+    cmd->reserved = 0;
+    cmd->sector = (req->blk + req->req_size) * VBLK_SECTORS_PER_BLK - vblk->req_left;
+    cmd->status = ~VIRTIO_BLK_S_OK;
+    cmd->req = req;
+    req->nr_pending++;
+    vblk->desc[head].addr = kmap_v2p((vaddr_t) cmd);
+    vblk->desc[head].len = VBLK_HEADER_SIZE;
+    vblk->desc[head].flags = 0;
+
+    // One data descriptor per physically contiguous piece, keeping one free
+    // descriptor for the status
+    prev = head;
+    for (nsegs = 0; vblk->req_left > 0 && nsegs < vblk->max_segs && vblk->nfree > 1; nsegs++) {
+        kassert(vblk->bio);
+        buf = (vaddr_t) vblk->bio->buffer + vblk->bio_ofs * VBLK_SECTOR_SIZE;
+        kassert(buf % VBLK_SECTOR_SIZE == 0);
+        n = min(vblk->req_left, vblk->bio->size * VBLK_SECTORS_PER_BLK - vblk->bio_ofs);
+        // the buffer is only contiguous in physical memory within a page
+        n = min(n, (pg_size - (buf & (pg_size - 1))) / VBLK_SECTOR_SIZE);
+        d = vblk_alloc_desc(vblk);
+        vblk->desc[d].addr = kmap_v2p(buf);
+        vblk->desc[d].len = n * VBLK_SECTOR_SIZE;
+        vblk->desc[d].flags = req->op == BIO_READ ? VRING_DESC_F_WRITE : 0;
+        vblk->desc[prev].next = d;
+        vblk->desc[prev].flags |= VRING_DESC_F_NEXT;
+        prev = d;
+        vblk->bio_ofs += n;
+        vblk->req_left -= n;
+        if (vblk->bio_ofs == vblk->bio->size * VBLK_SECTORS_PER_BLK) {
+            vblk->bio = bdev_request_next_bio(req, vblk->bio);
+            vblk->bio_ofs = 0;
+        }
+    }
+    d = vblk_alloc_desc(vblk);
+    vblk->desc[d].addr = kmap_v2p((vaddr_t) &cmd->status);
+    vblk->desc[d].len = sizeof(cmd->status);
+    vblk->desc[d].flags = VRING_DESC_F_WRITE;
+    vblk->desc[prev].next = d;
+    vblk->desc[prev].flags |= VRING_DESC_F_NEXT;
+    if (vblk->req_left == 0) {
+        vblk->req = NULL;
+    }
+
+    // publish the command, the device must see the descriptors first
+    vblk->avail->ring[vblk->avail->idx % vblk->qsize] = head;
+    __sync_synchronize();
+    vblk->avail->idx++;
+    vblk->ncmds++;
+}
+
+static void
+vblk_complete(struct virtio_blk_dev *vblk)
+{
+    struct virtio_blk_cmd *cmd;
+    struct bio *req;
+    uint16_t d, next;
+    bool more;
+
+    do {
+        while (vblk->last_used != vblk->used->idx) {
+            // read the entry only after seeing the index
+            __sync_synchronize();
+            d = vblk->used->ring[vblk->last_used % vblk->qsize].id;
+            vblk->last_used++;
+            cmd = &vblk->cmds[d];
+            req = cmd->req;
+            if (cmd->status != VIRTIO_BLK_S_OK) {
+                kprintf("virtio-blk %d: command at sector %u failed\n", vblk->index, (uint32_t) cmd->sector);
+            }
+            // free the descriptor chain
+            do {
+                next = vblk->desc[d].next;
+                more = (vblk->desc[d].flags & VRING_DESC_F_NEXT) != 0;
+                vblk_free_desc(vblk, d);
+                d = next;
+            } while (more);
+            vblk->ncmds--;
+            // a request completes with its last command, once all of it has
+            // been placed on the queue
+            if (--req->nr_pending == 0 && req != vblk->req) {
+                bdev_complete_request(req);
+            }
+        }
+        if (!vblk->event_idx) {
+            return;
+        }
+        // interrupt coalescing: the device interrupts once used->idx passes
+        // used_event
+        vblk->avail->ring[vblk->qsize] = vblk->last_used + (vblk->ncmds > 1 ? vblk->ncmds / 2 : 1) - 1;
+        __sync_synchronize();
+        // commands completed before the device saw the new used_event don't
+        // interrupt
+    } while (vblk->last_used != vblk->used->idx);
+}
+
+static uint16_t
+vblk_alloc_desc(struct virtio_blk_dev *vblk)
+{
+    uint16_t d;
+
+    kassert(vblk->nfree > 0);
+    d = vblk->free_head;
+    vblk->free_head = vblk->desc[d].next;
+    vblk->nfree--;
+    return d;
+}
+
+static void
+vblk_free_desc(struct virtio_blk_dev *vblk, uint16_t d)
+{
+    vblk->desc[d].flags = 0;
+    vblk->desc[d].next = vblk->free_head;
+    vblk->free_head = d;
+    vblk->nfree++;
+}
+
+static err_t
+vblk_setup_queue(struct virtio_blk_dev *vblk)
+{
+    size_t avail_end;
+    uint16_t i;
+
+    writew(vblk->iobase + VIRTIO_REG_QUEUE_SEL, 0);
+    // a command takes at least 3 descriptors
+    if ((vblk->qsize = readw(vblk->iobase + VIRTIO_REG_QUEUE_SIZE)) < 3 ||
+        readl(vblk->iobase + VIRTIO_REG_QUEUE_PFN) != 0) {
+        vblk->qsize = 0;
+        return ERR_VIRTIO_BLK_INIT_FAIL;
+    }
+    // descriptors and the available ring, then the used ring on the next
+    // aligned boundary
+    avail_end = vblk->qsize * sizeof(struct vring_desc) + sizeof(struct vring_avail) +
+        (vblk->qsize + 1) * sizeof(uint16_t);
+    vblk->vq_npages = pg_round_up(avail_end) / pg_size +
+        pg_round_up(sizeof(struct vring_used) + vblk->qsize * sizeof(struct vring_used_elem) + sizeof(uint16_t)) / pg_size;
+    if (pmem_nalloc(&vblk->vq_paddr, vblk->vq_npages) != ERR_OK) {
+        vblk->qsize = 0;
+        return ERR_VIRTIO_BLK_INIT_FAIL;
+    }
+    vblk->cmds_npages = pg_round_up(vblk->qsize * sizeof(struct virtio_blk_cmd)) / pg_size;
+    if (pmem_nalloc(&vblk->cmds_paddr, vblk->cmds_npages) != ERR_OK) {
+        pmem_nfree(vblk->vq_paddr, vblk->vq_npages);
+        vblk->qsize = 0;
+        return ERR_VIRTIO_BLK_INIT_FAIL;
+    }
+    memset((void*) kmap_p2v(vblk->vq_paddr), 0, vblk->vq_npages * pg_size);
+    vblk->desc = (struct vring_desc*) kmap_p2v(vblk->vq_paddr);
+    vblk->avail = (struct vring_avail*) (kmap_p2v(vblk->vq_paddr) + vblk->qsize * sizeof(struct vring_desc));
+    vblk->used = (struct vring_used*) (kmap_p2v(vblk->vq_paddr) + pg_round_up(avail_end));
+    vblk->cmds = (struct virtio_blk_cmd*) kmap_p2v(vblk->cmds_paddr);
+    for (i = 0; i < vblk->qsize; i++) {
+        vblk->desc[i].next = i + 1;
+    }
+    vblk->free_head = 0;
+    vblk->nfree = vblk->qsize;
+    vblk->last_used = 0;
+    vblk->ncmds = 0;
+    kassert(VIRTIO_QUEUE_ALIGN == pg_size);
+    writel(vblk->iobase + VIRTIO_REG_QUEUE_PFN, vblk->vq_paddr / VIRTIO_QUEUE_ALIGN);
+    return ERR_OK;
+}
+
+struct bdev*
+virtio_blk_alloc(dev_t dev, int index)
+{
+    struct bdev *bdev;
+    struct virtio_blk_dev *vblk;
+
+    if (vblk_allocator == NULL) {
+        if ((vblk_allocator = kmem_cache_create(sizeof(struct virtio_blk_dev))) == NULL) {
+            return NULL;
+        }
+    }
+    if ((bdev = bdev_alloc(dev)) == NULL) {
+        return NULL;
+    }
+    if ((vblk = kmem_cache_alloc(vblk_allocator)) == NULL) {
+        bdev_free(bdev);
+        return NULL;
+    }
+    spinlock_init(&vblk->lock);
+    vblk->index = index;
+    vblk->iobase = 0;
+    vblk->qsize = 0;
+    vblk->req = NULL;
+    bdev->data = (void*)vblk;
+    bdev->request_handler = vblk_request_handler;
+    return bdev;
+}
+
+void
+virtio_blk_free(struct bdev *bdev)
+{
+    struct virtio_blk_dev *vblk;
+
+    kassert(bdev);
+    kassert(bdev->data);
+    vblk = (struct virtio_blk_dev*)bdev->data;
+    // XXX wait for device to become idle?
+    if (vblk->qsize > 0) {
+        // reset the device so it lets go of the queue
+        writeb(vblk->iobase + VIRTIO_REG_STATUS, 0);
+        pmem_nfree(vblk->vq_paddr, vblk->vq_npages);
+        pmem_nfree(vblk->cmds_paddr, vblk->cmds_npages);
+    }
+    kmem_cache_free(vblk_allocator, vblk);
+    bdev_free(bdev);
+}
+
+err_t
+virtio_blk_init(struct bdev *bdev)
+{
+    struct virtio_blk_dev *vblk;
+    struct pci_dev pci;
+    uint32_t features;
+
+    kassert(bdev);
+    kassert(bdev->data);
+    vblk = (struct virtio_blk_dev*)bdev->data;
+    if (pci_find_device(VIRTIO_PCI_VENDOR, VIRTIO_PCI_BLK, vblk->index, &pci) != ERR_OK ||
+        (vblk->iobase = pci_io_bar(&pci, 0)) == 0) {
+        return ERR_VIRTIO_BLK_INIT_FAIL;
+    }
+    pci_enable_bus_master(&pci);
+    vblk->irq = T_IRQ0 + pci.irq_line;
+
+    // reset, then tell the device we found it and can drive it
+    writeb(vblk->iobase + VIRTIO_REG_STATUS, 0);
+    writeb(vblk->iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK);
+    writeb(vblk->iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+    features = readl(vblk->iobase + VIRTIO_REG_HOST_FEATURES) & (VIRTIO_BLK_F_SEG_MAX | VIRTIO_RING_F_EVENT_IDX);
+    writel(vblk->iobase + VIRTIO_REG_GUEST_FEATURES, features);
+    vblk->event_idx = (features & VIRTIO_RING_F_EVENT_IDX) != 0;
+    vblk->max_segs = VBLK_MAX_SEGS;
+    if (features & VIRTIO_BLK_F_SEG_MAX) {
+        vblk->max_segs = min(vblk->max_segs, (size_t) readl(vblk->iobase + VIRTIO_REG_CONFIG + VIRTIO_BLK_CFG_SEG_MAX));
+    }
+    bdev->nblks = (readl(vblk->iobase + VIRTIO_REG_CONFIG + VIRTIO_BLK_CFG_CAPACITY) |
+        ((uint64_t) readl(vblk->iobase + VIRTIO_REG_CONFIG + VIRTIO_BLK_CFG_CAPACITY + 4) << 32))
+        / VBLK_SECTORS_PER_BLK;
+    if (vblk->max_segs == 0 || vblk_setup_queue(vblk) != ERR_OK) {
+        goto fail;
+    }
+    // register trap handler
+    if (trap_register_handler(vblk->irq, bdev, vblk_trap_handler) != ERR_OK) {
+        goto fail;
+    }
+    // Enable IRQ
+    if (trap_enable_irq(vblk->irq) != ERR_OK) {
+        // the caller frees bdev, so its handler must not stay registered
+        trap_unregister_handler(vblk->irq);
+        goto fail;
+    }
+    writeb(vblk->iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+    return ERR_OK;
+
+fail:
+    writeb(vblk->iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+    return ERR_VIRTIO_BLK_INIT_FAIL;
+}
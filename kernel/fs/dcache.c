@@ -0,0 +1,223 @@
+#include <kernel/dcache.h>
+#include <kernel/fs.h>
+#include <kernel/console.h>
+#include <kernel/kmalloc.h>
+#include <kernel/synch.h>
+#include <kernel/list.h>
+#include <lib/errcode.h>
+#include <lib/stddef.h>
+#include <lib/string.h>
+
+// Number of hash chains
+#define DCACHE_NCHAINS 256
+
+struct dentry {
+    struct super_block *d_sb;
+    inum_t d_dir;                   // inode number of the directory
+    inum_t d_inum;                  // inode number of the name, 0 if none
+    char d_name[DCACHE_NAME_LEN];
+    Node d_hash_node;               // on the hash chain of its key
+    Node d_lru_node;                // on the LRU, least recently used first
+};
+
+static struct kmem_cache *dentry_allocator;
+
+/*
+ * Hash chains and LRU of all cached entries, protected by dcache_lock.
+ */
+static List dcache_chains[DCACHE_NCHAINS];
+static List dcache_lru;
+static size_t dcache_nentries;
+static struct spinlock dcache_lock;
+
+/*
+ * Return the hash chain of a key. Super blocks share chains.
+ */
+static List *dcache_chain(inum_t dir, const char *name);
+
+/*
+ * Find the entry of a key on its chain. Return NULL if there is none.
+ *
+ * Precondition:
+ * Caller must hold dcache_lock.
+ */
+static struct dentry *dcache_find(struct super_block *sb, inum_t dir, const char *name);
+
+/*
+ * Unlink an entry from its chain and the LRU. The caller frees it after
+ * releasing dcache_lock.
+ *
+ * Precondition:
+ * Caller must hold dcache_lock.
+ */
+static void dcache_unlink(struct dentry *d);
+
+/*
+ * Drop every entry of sb, only those of directory dir if dir is not 0.
+ */
+static void dcache_purge(struct super_block *sb, inum_t dir);
+
+static List*
+dcache_chain(inum_t dir, const char *name)
+{
+    uint32_t hash;
+
+    // FNV-1a over the name, seeded with the directory
+    for (hash = 2166136261u ^ dir; *name != 0; name++) {
+        hash = (hash ^ (uint8_t) *name) * 16777619u;
+    }
+    return &dcache_chains[hash % DCACHE_NCHAINS];
+}
+
+static struct dentry*
+dcache_find(struct super_block *sb, inum_t dir, const char *name)
+{
+    List *chain;
+    struct dentry *d;
+
+    chain = dcache_chain(dir, name);
+    for (Node *n = list_begin(chain); n != list_end(chain); n = list_next(n)) {
+        d = list_entry(n, struct dentry, d_hash_node);
+        if (d->d_sb == sb && d->d_dir == dir && strcmp(d->d_name, name) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+static void
+dcache_unlink(struct dentry *d)
+{
+    list_remove(&d->d_hash_node);
+    list_remove(&d->d_lru_node);
+    dcache_nentries--;
+}
+
+static void
+dcache_purge(struct super_block *sb, inum_t dir)
+{
+    struct dentry *d;
+    List dead;
+    Node *n;
+
+    list_init(&dead);
+    spinlock_acquire(&dcache_lock);
+    for (n = list_begin(&dcache_lru); n != list_end(&dcache_lru);) {
+        d = list_entry(n, struct dentry, d_lru_node);
+        n = list_next(n);
+        if (d->d_sb == sb && (dir == 0 || d->d_dir == dir)) {
+            dcache_unlink(d);
+            list_append(&dead, &d->d_hash_node);
+        }
+    }
+    spinlock_release(&dcache_lock);
+
+    while (!list_empty(&dead)) {
+        d = list_entry(list_begin(&dead), struct dentry, d_hash_node);
+        list_remove(&d->d_hash_node);
+        kmem_cache_free(dentry_allocator, d);
+    }
+}
+
+void
+dcache_init(void)
+{
+    int i;
+
+    if ((dentry_allocator = kmem_cache_create(sizeof(struct dentry))) == NULL) {
+        panic("Failed to create dentry_allocator");
+    }
+    for (i = 0; i < DCACHE_NCHAINS; i++) {
+        list_init(&dcache_chains[i]);
+    }
+    list_init(&dcache_lru);
+    dcache_nentries = 0;
+    spinlock_init(&dcache_lock);
+}
+
+err_t
+dcache_lookup(struct inode *dir, const char *name, inum_t *inum)
+{
+    struct dentry *d;
+    err_t err = ERR_NOTEXIST;
+
+    if (strlen(name) >= DCACHE_NAME_LEN) {
+        return ERR_NOTEXIST;
+    }
+    spinlock_acquire(&dcache_lock);
+    if ((d = dcache_find(dir->sb, dir->i_inum, name)) != NULL) {
+        // Move the entry to the back of the LRU
+        list_remove(&d->d_lru_node);
+        list_append(&dcache_lru, &d->d_lru_node);
+        *inum = d->d_inum;
+        err = ERR_OK;
+    }
+    spinlock_release(&dcache_lock);
+    return err;
+}
+
+void
+dcache_insert(struct inode *dir, const char *name, inum_t inum)
+{
+    struct dentry *d, *victim = NULL;
+
+    if (strlen(name) >= DCACHE_NAME_LEN) {
+        return;
+    }
+    if ((d = kmem_cache_alloc(dentry_allocator)) == NULL) {
+        return;
+    }
+    d->d_sb = dir->sb;
+    d->d_dir = dir->i_inum;
+    d->d_inum = inum;
+    strncpy(d->d_name, name, DCACHE_NAME_LEN);
+
+    spinlock_acquire(&dcache_lock);
+    // Replace an entry for the same name, otherwise make room for the new one
+    if ((victim = dcache_find(d->d_sb, d->d_dir, name)) == NULL && dcache_nentries == DCACHE_MAX_ENTRIES) {
+        victim = list_entry(list_begin(&dcache_lru), struct dentry, d_lru_node);
+    }
+    if (victim != NULL) {
+        dcache_unlink(victim);
+    }
+    list_append(dcache_chain(d->d_dir, name), &d->d_hash_node);
+    list_append(&dcache_lru, &d->d_lru_node);
+    dcache_nentries++;
+    spinlock_release(&dcache_lock);
+
+    if (victim != NULL) {
+        kmem_cache_free(dentry_allocator, victim);
+    }
+}
+
+void
+dcache_remove(struct inode *dir, const char *name)
+{
+    struct dentry *d;
+
+    if (strlen(name) >= DCACHE_NAME_LEN) {
+        return;
+    }
+    spinlock_acquire(&dcache_lock);
+    if ((d = dcache_find(dir->sb, dir->i_inum, name)) != NULL) {
+        dcache_unlink(d);
+    }
+    spinlock_release(&dcache_lock);
+
+    if (d != NULL) {
+        kmem_cache_free(dentry_allocator, d);
+    }
+}
+
+void
+dcache_remove_dir(struct inode *dir)
+{
+    kassert(dir->i_inum > 0);
+    dcache_purge(dir->sb, dir->i_inum);
+}
+
+void
+dcache_remove_sb(struct super_block *sb)
+{
+    dcache_purge(sb, 0);
+}
@@ -16,10 +16,22 @@ static struct kmem_cache *filems_allocator = NULL;
 static err_t fillpage(struct memstore *store, offset_t ofs, struct page *page);
 
 /*
- * File memstore write function.
+ * File memstore write function. Cached file pages are never dirty, so the page
+ * cache never calls it.
  */
 static err_t write(struct memstore *store, paddr_t paddr, offset_t ofs);
 
+/*
+ * File memstore size function, the size of the file.
+ */
+static offset_t size(struct memstore *store);
+
+/*
+ * File memstore reference functions, pin the inode while it is mapped.
+ */
+static void ref(struct memstore *store);
+static void unref(struct memstore *store);
+
 static err_t
 fillpage(struct memstore *store, offset_t ofs, struct page *page)
 {
@@ -29,17 +41,46 @@ fillpage(struct memstore *store, offset_t ofs, struct page *page)
     kassert(store->info);
     kassert(page);
     info = (struct filems_info*)store->info;
+    sleeplock_acquire(&info->inode->i_lock);
     if (info->inode->i_ops->fillpage(info->inode, pg_round_down(ofs), page) != ERR_OK) {
+        sleeplock_release(&info->inode->i_lock);
         return ERR_MEMSTORE_IO;
     }
+    sleeplock_release(&info->inode->i_lock);
     return ERR_OK;
 }
 
 static err_t
 write(struct memstore *store, paddr_t paddr, offset_t ofs)
 {
-    // TODO
-    return ERR_OK;
+    // File pages are only mapped read-only (mmap refuses shared writable file
+    // mappings, private ones copy on write) and read/write go through the
+    // block cache, so nothing dirties a cached file page. Writing one back
+    // would need dirty bits harvested from the page tables and a write path
+    // kept coherent with the block cache.
+    panic("filems: cached file page is dirty");
+}
+
+static offset_t
+size(struct memstore *store)
+{
+    kassert(store && store->info);
+    // racy peek, readahead only needs an estimate
+    return ((struct filems_info*)store->info)->inode->i_size;
+}
+
+static void
+ref(struct memstore *store)
+{
+    kassert(store && store->info);
+    fs_reopen_inode(((struct filems_info*)store->info)->inode);
+}
+
+static void
+unref(struct memstore *store)
+{
+    kassert(store && store->info);
+    fs_release_inode(((struct filems_info*)store->info)->inode);
 }
 
 struct memstore*
@@ -60,6 +101,9 @@ filems_alloc(struct inode *inode)
             info = (struct filems_info*)store->info;
             store->fillpage = fillpage;
             store->write = write;
+            store->size = size;
+            store->ref = ref;
+            store->unref = unref;
             info->inode = inode;
         } else {
             memstore_free(store);
@@ -74,6 +118,9 @@ filems_free(struct memstore *store)
 {
     kassert(store);
     kassert(store->info);
+    sleeplock_acquire(&store->pgcache_lock);
+    pgcache_remove_pages(store);
+    sleeplock_release(&store->pgcache_lock);
     kmem_cache_free(filems_allocator, store->info);
     memstore_free(store);
 }
@@ -7,6 +7,7 @@
 #include <kernel/filems.h>
 #include <kernel/proc.h>
 #include <kernel/jbd.h>
+#include <kernel/dcache.h>
 #include <lib/errcode.h>
 #include <lib/stddef.h>
 #include <lib/string.h>
@@ -73,6 +74,21 @@ static const char *path_next_element(const char *path, char *name);
  */
 static err_t fs_find_parent_inode(const char *path, struct inode **parent, char *leaf);
 
+/*
+ * Look up name in directory dir through the directory entry cache, falling
+ * back to dir->i_ops->lookup and caching its result.
+ *
+ * Precondition:
+ * Caller must hold dir->i_lock.
+ *
+ * Return:
+ * ERR_OK - Inode found and written to pointer inode. The caller is responsible
+ *          for releasing the inode after use.
+ * ERR_NOTEXIST - Name does not exist in dir.
+ * Other errors - Failed to look up the inode.
+ */
+static err_t fs_lookup(struct inode *dir, const char *name, struct inode **inode);
+
 /*
  * Give an inode to the cleanup thread.
  */
@@ -159,7 +175,7 @@ fs_find_parent_inode(const char *path, struct inode **parent, char *name)
             sleeplock_release(&curr->i_lock);
             return ERR_OK;
         }
-        if ((err = curr->i_ops->lookup(curr, name, &next)) != ERR_OK) {
+        if ((err = fs_lookup(curr, name, &next)) != ERR_OK) {
             goto fail;
         }
         sleeplock_release(&curr->i_lock);
@@ -173,6 +189,23 @@ fail:
     return err;
 }
 
+static err_t
+fs_lookup(struct inode *dir, const char *name, struct inode **inode)
+{
+    inum_t inum;
+    err_t err;
+
+    if (dcache_lookup(dir, name, &inum) == ERR_OK) {
+        return inum == 0 ? ERR_NOTEXIST : fs_get_inode(dir->sb, inum, inode);
+    }
+    if ((err = dir->i_ops->lookup(dir, name, inode)) == ERR_OK) {
+        dcache_insert(dir, name, (*inode)->i_inum);
+    } else if (err == ERR_NOTEXIST) {
+        dcache_insert(dir, name, 0);
+    }
+    return err;
+}
+
 static void
 fs_push_inode_cleanup(struct inode *inode)
 {
@@ -222,6 +255,9 @@ fs_init(void)
     // Initialize JBD
     jbd_init();
 
+    // Initialize directory entry cache
+    dcache_init();
+
     // Root file system: currently use SFS
     if (sfs_init() != ERR_OK) {
         panic("Failed to initialize root file system");
@@ -422,6 +458,7 @@ fs_release_sb(struct super_block *sb)
     sleeplock_acquire(&fs_sb_table_lock);
     if (--sb->s_ref == 0) {
         kassert(radix_tree_remove(&fs_sb_table, sb->bdev->dev) == sb);
+        dcache_remove_sb(sb);
         sb->s_fs_type->free_sb(sb);
     }
     sleeplock_release(&fs_sb_table_lock);
@@ -528,6 +565,15 @@ fs_get_inode(struct super_block *sb, inum_t inum, struct inode **inode)
     return ERR_OK;
 }
 
+void
+fs_reopen_inode(struct inode *inode)
+{
+    sleeplock_acquire(&inode->sb->s_lock);
+    kassert(inode->i_ref > 0);
+    inode->i_ref++;
+    sleeplock_release(&inode->sb->s_lock);
+}
+
 void
 fs_release_inode(struct inode *inode)
 {
@@ -579,7 +625,9 @@ fs_find_inode(const char *path, struct inode **inode)
         *inode = parent;
         err = ERR_OK;
     } else {
-        err = parent->i_ops->lookup(parent, name, inode);
+        sleeplock_acquire(&parent->i_lock);
+        err = fs_lookup(parent, name, inode);
+        sleeplock_release(&parent->i_lock);
         fs_release_inode(parent);
     }
     return err;
@@ -606,6 +654,11 @@ fs_inode_cleanup_thread(void)
         inode->sb->s_ops->journal_begin_txn(inode->sb);
         sleeplock_acquire(&inode->i_lock);
         if (inode->i_nlink == 0) {
+            // The inode number can be reused once deleted, forget the names
+            // looked up in it if it was a directory
+            if (inode->i_ftype == FTYPE_DIR) {
+                dcache_remove_dir(inode);
+            }
             while (inode->sb->s_ops->delete_inode(inode) != ERR_OK) {
                 // XXX Just retry or check error and decide appropriate action?
                 ;
@@ -658,6 +711,7 @@ fs_link(const char *oldpath, const char *newpath)
     sleeplock_acquire(&src->i_lock);
     sleeplock_acquire(&dir->i_lock);
     err = dir->i_ops->link(dir, src, name);
+    dcache_remove(dir, name);
     sleeplock_release(&dir->i_lock);
     sleeplock_release(&src->i_lock);
     fs_release_inode(dir);
@@ -690,6 +744,7 @@ fs_unlink(const char *pathname)
 
     sleeplock_acquire(&dir->i_lock);
     err = dir->i_ops->unlink(dir, name);
+    dcache_remove(dir, name);
     sleeplock_release(&dir->i_lock);
     fs_release_inode(dir);
 
@@ -721,6 +776,7 @@ fs_mkdir(const char *pathname)
     sleeplock_acquire(&dir->i_lock);
     // Directories have read/execute permission
     err = dir->i_ops->mkdir(dir, name, FMODE_R | FMODE_X);
+    dcache_remove(dir, name);
     sleeplock_release(&dir->i_lock);
     fs_release_inode(dir);
 
@@ -751,6 +807,7 @@ fs_rmdir(const char *pathname)
 
     sleeplock_acquire(&dir->i_lock);
     err = dir->i_ops->rmdir(dir, name);
+    dcache_remove(dir, name);
     sleeplock_release(&dir->i_lock);
     fs_release_inode(dir);
 
@@ -798,7 +855,7 @@ fs_open_file(const char *path, int flags, fmode_t mode, struct file **file)
         fi = parent;
     } else {
         sleeplock_acquire(&parent->i_lock);
-        if ((err = parent->i_ops->lookup(parent, name, &fi)) != ERR_OK) {
+        if ((err = fs_lookup(parent, name, &fi)) != ERR_OK) {
             if (err != ERR_NOTEXIST) {
                 goto fail;
             }
@@ -811,7 +868,9 @@ fs_open_file(const char *path, int flags, fmode_t mode, struct file **file)
                 kassert(err != ERR_EXIST);
                 goto fail;
             }
-            if ((err = parent->i_ops->lookup(parent, name, &fi)) != ERR_OK) {
+            // Drop the cached negative entry
+            dcache_remove(parent, name);
+            if ((err = fs_lookup(parent, name, &fi)) != ERR_OK) {
                 kassert(err != ERR_NOTEXIST);
                 goto fail;
             }
@@ -1,6 +1,8 @@
 #include <kernel/jbd.h>
 #include <kernel/bdev.h>
 #include <kernel/fs.h>
+#include <kernel/pmem.h>
+#include <kernel/kmalloc.h>
 #include <kernel/console.h>
 #include <lib/errcode.h>
 #include <lib/string.h>
@@ -30,20 +32,35 @@ static err_t commit_journal(struct journal *journal);
 static err_t write_journal_blks(struct journal *journal);
 
 /*
- * Write journal header to the block device.
+ * Write a journal header recording n_blks data blocks to the block device.
  *
  * Return:
  * ERR_NOMEM - Failed to allocate memory.
  */
-static err_t write_journal_header(struct journal *journal);
+static err_t write_journal_header(struct journal *journal, uint32_t n_blks);
 
 /*
- * Apply journal data blocks to the file system.
+ * Apply journal data blocks to the file system: queue them for the bdev
+ * flusher, which writes them out in the background. The journal keeps them as
+ * the blocks to checkpoint before it is reused.
+ */
+static void apply_journal(struct journal *journal);
+
+/*
+ * Checkpoint the last committed transaction so the journal can be reused: make
+ * sure its blocks are on the file system, then erase the journal. Blocks that
+ * the committing transaction logged again are written from their copy in the
+ * journal, since their cached content is not committed yet. The others have
+ * not changed since, and are taken off the flusher's queue if still there.
+ *
+ * Precondition:
+ * Caller must hold the device's flush_lock, so the flusher can't write a block
+ * of the committing transaction before the transaction is committed.
  *
  * Return:
  * ERR_NOMEM - Failed to allocate memory.
  */
-static err_t apply_journal(struct journal *journal);
+static err_t checkpoint_journal(struct journal *journal);
 
 /*
  * Erase the journal.
@@ -57,39 +74,45 @@ static err_t
 commit_journal(struct journal *journal)
 {
     // Commit the journal in the following steps:
-    // 1. Write all journal data blocks to bdev
-    // 2. Write header to bdev (journal is now committed)
-    // 3. Apply journal data blocks to the file system
-    // 4. Erase the journal
+    // 1. Checkpoint the previous transaction, whose blocks may still be
+    //    queued for the flusher, and erase the journal
+    // 2. Write all journal data blocks to bdev
+    // 3. Write header to bdev (journal is now committed)
+    // 4. Apply journal data blocks to the file system in the background
     // 5. Change journal to ACTIVE state, and wake up waiters
+    struct bdev *bdev = journal->sb->bdev;
     err_t err;
 
-    if ((err = write_journal_blks(journal)) != ERR_OK) {
-        return err;
+    sleeplock_acquire(&bdev->flush_lock);
+    if (journal->nckpt > 0 && (err = checkpoint_journal(journal)) != ERR_OK) {
+        goto done;
     }
-    if ((err = write_journal_header(journal)) != ERR_OK) {
-        return err;
+    if ((err = write_journal_blks(journal)) != ERR_OK) {
+        goto done;
     }
-    if ((err = apply_journal(journal)) != ERR_OK) {
-        return err;
-    }
-    if ((err = erase_journal(journal)) != ERR_OK) {
-        return err;
+    if ((err = write_journal_header(journal, journal->next_index)) != ERR_OK) {
+        goto done;
     }
+    apply_journal(journal);
+    journal->next_index = 0;
 
-    return ERR_OK;
+done:
+    sleeplock_release(&bdev->flush_lock);
+    return err;
 }
 
 static err_t
 write_journal_blks(struct journal *journal)
 {
     int i, bi;
-    size_t n;
+    size_t n, njbh;
     blk_t pb, bmap[JOURNAL_SIZE];
-    struct blk_header *jbh;
+    struct blk_header *jbh, *jbhs[JOURNAL_SIZE + BMAP_BLKS];
     err_t err;
 
     kassert(journal->next_index < JOURNAL_SIZE);
+    njbh = 0;
+    err = ERR_OK;
     for (i = 0; i < journal->next_index; i++) {
         // Write journal data block to the mapped physical block (using jbd_bmap
         // to get the block number) on bdev. Log the data block number in the
@@ -97,78 +120,155 @@ write_journal_blks(struct journal *journal)
         pb = journal->sb->s_ops->journal_bmap(journal->sb, JDATA_START_BLK + i);
         bmap[i] = journal->datablks[i]->blk;
         if ((jbh = bdev_get_blk(journal->sb->bdev, pb)) == NULL) {
-            return ERR_NOMEM;
+            err = ERR_NOMEM;
+            goto done;
         }
         sleeplock_acquire(&journal->datablks[i]->lock);
         memmove(jbh->data, journal->datablks[i]->data, BDEV_BLK_SIZE);
         sleeplock_release(&journal->datablks[i]->lock);
-        if ((err = bdev_write_blk(jbh)) != ERR_OK) {
-            return err;
-        }
-        bdev_release_blk(jbh);
+        jbhs[njbh++] = jbh;
     }
     // Write bmap blocks
     for (i = 0, bi = 0; i < journal->next_index && bi < BMAP_BLKS; bi++, i += n) {
         pb = journal->sb->s_ops->journal_bmap(journal->sb, BMAP_START_BLK + bi);
         if ((jbh = bdev_get_blk(journal->sb->bdev, pb)) == NULL) {
-            return ERR_NOMEM;
+            err = ERR_NOMEM;
+            goto done;
         }
         n = min(BDEV_BLK_SIZE / sizeof(blk_t) , journal->next_index - i);
         memmove(jbh->data, &bmap[i], n * sizeof(blk_t));
-        if ((err = bdev_write_blk(jbh)) != ERR_OK) {
-            return err;
-        }
-        bdev_release_blk(jbh);
+        jbhs[njbh++] = jbh;
     }
-    return ERR_OK;
+    // Submit the whole journal at once, the elevator merges it into a few
+    // large writes
+    err = bdev_write_blks(jbhs, njbh);
+
+done:
+    while (njbh > 0) {
+        bdev_release_blk(jbhs[--njbh]);
+    }
+    return err;
 }
 
 static err_t
-write_journal_header(struct journal *journal)
+write_journal_header(struct journal *journal, uint32_t n_blks)
 {
     struct journal_header header;
     struct blk_header *bh;
     blk_t pb;
     err_t err;
 
-    header.n_blks = journal->next_index;
+    header.n_blks = n_blks;
     pb = journal->sb->s_ops->journal_bmap(journal->sb, HEADER_BLK);
     if ((bh = bdev_get_blk(journal->sb->bdev, pb)) == NULL) {
         return ERR_NOMEM;
     }
     memmove(bh->data, &header, sizeof(header));
-    if ((err = bdev_write_blk(bh)) != ERR_OK) {
-        return err;
-    }
+    err = bdev_write_blk(bh);
     bdev_release_blk(bh);
-    return ERR_OK;
+    return err;
 }
 
-static err_t
+static void
 apply_journal(struct journal *journal)
 {
     int i;
-    err_t err;
 
     for (i = 0; i < journal->next_index; i++) {
-        // Write journal data block to file system block
-        sleeplock_acquire(&journal->datablks[i]->lock);
-        if ((err = bdev_write_blk(journal->datablks[i])) != ERR_OK) {
-            return err;
+        // The flusher writes the block to the file system, and holds its own
+        // reference until then. The journal's reference moves to the
+        // checkpoint list.
+        bdev_writeback_blk(journal->datablks[i]);
+        journal->ckptblks[i] = journal->datablks[i];
+    }
+    journal->nckpt = journal->next_index;
+}
+
+static err_t
+checkpoint_journal(struct journal *journal)
+{
+    struct bdev *bdev = journal->sb->bdev;
+    struct blk_header *bh, **relogged, **jbhs, **old;
+    struct bio **bios;
+    size_t nnew, nold, i, j;
+    blk_t pb;
+    err_t err = ERR_OK;
+
+    // Kernel stacks are small, keep the block lists on the heap
+    if ((relogged = kmalloc(3 * JOURNAL_SIZE * sizeof(struct blk_header*))) == NULL) {
+        return ERR_NOMEM;
+    }
+    jbhs = relogged + JOURNAL_SIZE;
+    old = jbhs + JOURNAL_SIZE;
+    if ((bios = kmalloc(JOURNAL_SIZE * sizeof(struct bio*))) == NULL) {
+        kfree(relogged);
+        return ERR_NOMEM;
+    }
+
+    // Sort the blocks by whether the committing transaction logged them again.
+    // jbhs[i] is the journal copy of relogged[i].
+    nnew = nold = 0;
+    for (i = 0; i < journal->nckpt; i++) {
+        bh = journal->ckptblks[i];
+        for (j = 0; j < journal->next_index && journal->datablks[j] != bh; j++) {
+            ;
+        }
+        if (j == journal->next_index) {
+            old[nold++] = bh;
+            continue;
+        }
+        pb = journal->sb->s_ops->journal_bmap(journal->sb, JDATA_START_BLK + i);
+        if ((jbhs[nnew] = bdev_get_blk(bdev, pb)) == NULL) {
+            err = ERR_NOMEM;
+            goto done;
+        }
+        if ((bios[nnew] = bio_alloc()) == NULL) {
+            bdev_release_blk(jbhs[nnew]);
+            err = ERR_NOMEM;
+            goto done;
         }
-        // Block is now clean
-        bdev_set_blk_dirty(journal->datablks[i], False);
-        // Now we can release the block
-        bdev_release_blk(journal->datablks[i]);
+        bios[nnew]->bdev = bdev;
+        bios[nnew]->blk = bh->blk;
+        bios[nnew]->size = 1;
+        bios[nnew]->buffer = jbhs[nnew]->data;
+        bios[nnew]->op = BIO_WRITE;
+        relogged[nnew++] = bh;
     }
-    return ERR_OK;
+
+    // Write the committed content of the relogged blocks, and the other blocks
+    // unless the flusher got to them already
+    bdev_submit_bios(bios, nnew);
+    bdev_flush_blks(bdev, old, nold);
+    bio_wait_all(bios, nnew);
+    for (i = 0; i < nnew; i++) {
+        // The flusher may have cleaned the block while the committing
+        // transaction was modifying it, its content still has to be written
+        sleeplock_acquire(&relogged[i]->lock);
+        bdev_set_blk_dirty(relogged[i], True);
+        sleeplock_release(&relogged[i]->lock);
+    }
+    if ((err = erase_journal(journal)) != ERR_OK) {
+        goto done;
+    }
+    for (i = 0; i < journal->nckpt; i++) {
+        bdev_release_blk_unlocked(journal->ckptblks[i]);
+    }
+    journal->nckpt = 0;
+
+done:
+    for (i = 0; i < nnew; i++) {
+        bio_free(bios[i]);
+        bdev_release_blk(jbhs[i]);
+    }
+    kfree(bios);
+    kfree(relogged);
+    return err;
 }
 
 static err_t
 erase_journal(struct journal *journal)
 {
-    journal->next_index = 0;
-    return write_journal_header(journal);
+    return write_journal_header(journal, 0);
 }
 
 void
@@ -192,6 +292,7 @@ jbd_alloc_journal(struct super_block *sb)
         journal->enabled = True;
         journal->state = IDLE;
         journal->next_index = 0;
+        journal->nckpt = 0;
     }
     return journal;
 }
@@ -199,6 +300,12 @@ jbd_alloc_journal(struct super_block *sb)
 void
 jbd_free_journal(struct journal *journal)
 {
+    int i;
+
+    // The flusher keeps its own references on the last transaction's blocks
+    for (i = 0; i < journal->nckpt; i++) {
+        bdev_release_blk_unlocked(journal->ckptblks[i]);
+    }
     kmem_cache_free(journal_allocator, journal);
 }
 
@@ -243,6 +350,8 @@ jbd_write_blk(struct journal *journal, struct blk_header *bh)
     int i;
 
     if (!journal->enabled) {
+        // Without a journal, the block goes straight to the flusher
+        bdev_writeback_blk(bh);
         return;
     }
     kassert(journal->state == BUSY);
@@ -260,6 +369,7 @@ jbd_write_blk(struct journal *journal, struct blk_header *bh)
     sleeplock_acquire(&bh->page->lock);
     bh->ref++;
     sleeplock_release(&bh->page->lock);
+    pmem_inc_refcnt(page_to_paddr(bh->page), 1);
     journal->datablks[journal->next_index++] = bh;
 }
 
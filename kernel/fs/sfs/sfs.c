@@ -10,7 +10,8 @@
 /*
  * Note: We do not acquire superblock's s_lock when allocating and deallocating
  * on-disk data blocks and inodes -- we rely on buffer cache's lock for
- * synchronization.
+ * synchronization. The free block count of a data bitmap block is protected by
+ * the lock of that bitmap block, reservation windows by s_rsv_lock.
  */
 
 // SFS disk layout
@@ -20,8 +21,11 @@
 
 #define SFS_ROOT_INUM 1
 
-// Limits
-#define SFS_MAX_FILE_SIZE ((SFS_NDIRECT + SFS_NINDIRECT * (BDEV_BLK_SIZE / sizeof(uint32_t))) * BDEV_BLK_SIZE)
+// Number of data blocks covered by a data bitmap block
+#define BMAP_BITS (BDEV_BLK_SIZE * 8)
+
+// Limits: i_size is 32 bits
+#define SFS_MAX_FILE_SIZE ((offset_t) 0xFFFFFFFF / BDEV_BLK_SIZE * BDEV_BLK_SIZE)
 
 // Get journal from blk_header
 #define BH_JOURNAL(bh) (((struct sfs_sb_info*)bh->bdev->sb->s_fs_info)->journal)
@@ -32,6 +36,28 @@
 // Get sfs_inode_info from inode
 #define INODE_INFO(inode) ((struct sfs_inode_info*)inode->i_fs_info)
 
+// Hashed directory index layout, in file blocks past the largest file size
+#define DX_MAX_DEPTH 12 // At most 2^DX_MAX_DEPTH buckets
+#define DX_TABLE_PER_BLK (BDEV_BLK_SIZE / sizeof(uint32_t))
+#define DX_BUCKET_ENTRIES ((BDEV_BLK_SIZE - sizeof(struct sfs_dx_bucket)) / sizeof(struct sfs_dx_entry))
+#define DX_FREE_PER_BLK (BDEV_BLK_SIZE / sizeof(uint32_t))
+#define DX_HEADER_LBLK ((blk_t) (SFS_MAX_FILE_SIZE / BDEV_BLK_SIZE))
+#define DX_TABLE_LBLK (DX_HEADER_LBLK + 1)
+#define DX_BUCKET_LBLK (DX_TABLE_LBLK + (1 << DX_MAX_DEPTH) / DX_TABLE_PER_BLK)
+#define DX_FREE_LBLK (DX_BUCKET_LBLK + (1 << DX_MAX_DEPTH))
+// Largest linear directory that gets indexed. Building an index for a bigger
+// one could overflow a journal transaction.
+#define DX_BUILD_MAX_SIZE (8 * BDEV_BLK_SIZE)
+
+// Size of the kernel buffer file reads and writes are copied through
+#define SFS_BOUNCE_SIZE ((size_t) (8 * BDEV_BLK_SIZE))
+
+// Number of directory entries per block
+#define DIRENTS_PER_BLK (BDEV_BLK_SIZE / sizeof(struct sfs_dirent))
+
+// Get the entries of an extent tree node
+#define EXTENTS(eh) ((struct sfs_extent*)((eh) + 1))
+
 // Acquire reference to disk inode
 #define ACQUIRE_INODE_BH(inode) (bdev_get_blk_unlocked(inode->sb->bdev, inum_to_blk(inode->sb, inode->i_inum)))
 
@@ -182,21 +208,187 @@ static err_t create_inode_in_dir(struct inode *dir, ftype_t ftype, const char *n
 static err_t unlink_inode_in_dir(struct inode *dir, ftype_t ftype, const char *name);
 
 /*
- * Allocate a new data block. Write the block number into *blk.
+ * Return the number of data blocks data bitmap block g keeps track of.
+ */
+static inline int bmap_nbits(const struct sfs_sb_info *info, size_t g);
+
+/*
+ * Count the free blocks of each data bitmap block into info->s_bmap_free.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ */
+static err_t count_free_blocks(struct bdev *bdev, struct sfs_sb_info *info);
+
+/*
+ * Search a bitmap block of nbits elements for the first run of len free
+ * elements at or after element from. Return the index of the run's first
+ * element, or -1 if there is none.
+ *
+ * Precondition:
+ * Caller must hold bh->lock.
+ */
+static int bmap_find_run(struct blk_header *bh, int nbits, int from, int len);
+
+/*
+ * Check whether windows other than skip overlap data blocks [start, end). If
+ * so, write the lowest start and the highest end of the overlapping windows
+ * into *first and *last.
+ */
+static bool rsv_overlap(struct super_block *sb, blk_t start, blk_t end, struct sfs_rsv *skip,
+                        blk_t *first, blk_t *last);
+
+/*
+ * Make rsv reserve data blocks [start, end), releasing what it reserved before.
+ * An empty range leaves rsv without blocks.
+ *
+ * Precondition:
+ * Caller must own rsv (hold the lock of the inode it belongs to).
+ */
+static void rsv_set(struct super_block *sb, struct sfs_rsv *rsv, blk_t start, blk_t end);
+
+/*
+ * Allocate a free data block from data bitmap block g, at or after element
+ * from, that starts a run of len free blocks. If exact is True, only element
+ * from itself will do. Unless steal is True, blocks reserved by windows other
+ * than rsv are passed over. If rsv is not NULL, the free blocks following the
+ * new one (up to SFS_RSV_BLKS - 1 of them) become its reservation. Write the
+ * block number into *blk.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ * ERR_NORES - No such block in the bitmap block.
+ */
+static err_t alloc_in_bmap(struct super_block *sb, size_t g, int from, int len, bool exact, bool steal,
+                           struct sfs_rsv *rsv, blk_t *blk);
+
+/*
+ * Allocate a new data block, preferably goal (or the first free block after
+ * it) for contiguity. A goal of 0 means no preference: the search continues
+ * where the last allocation left off. If rsv is not NULL, the allocation comes
+ * from, or sets up, a reservation window for a growing file. Write the block
+ * number into *blk.
  *
  * Return:
  * ERR_NOMEM - Failed to allocate memory.
  * ERR_NORES - No more data blocks are available.
  */
-static err_t alloc_data_block(struct super_block *sb, blk_t *blk);
+static err_t alloc_data_block(struct super_block *sb, blk_t goal, struct sfs_rsv *rsv, blk_t *blk);
+
+/*
+ * Free nblks consecutive data blocks starting at blk.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ */
+static err_t free_data_blocks(struct super_block *sb, blk_t blk, size_t nblks);
+
+/*
+ * Return the position of the last entry of an extent tree node that starts at
+ * or before file block lblk, or -1 if there is none.
+ */
+static int search_node(struct sfs_extent_header *eh, blk_t lblk);
+
+/*
+ * Record a change to a node of inode's extent tree. bh is the block holding the
+ * node, or NULL for the root in the inode.
+ *
+ * Precondition:
+ * Caller must hold inode->i_lock, and bh->lock if bh is not NULL.
+ * Caller must hold a reference to the disk inode if bh is NULL.
+ */
+static void set_node_dirty(struct inode *inode, struct blk_header *bh);
+
+/*
+ * Find the leaf node of inode's extent tree that file block lblk falls into.
+ * Write the node into *eh and the block holding it into *bh (NULL for the root
+ * in the inode).
+ *
+ * Precondition:
+ * Caller must hold inode->i_lock.
+ *
+ * Postcondition:
+ * If successful and *bh is not NULL, (*bh)->lock is locked.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ */
+static err_t find_leaf(struct inode *inode, blk_t lblk, struct sfs_extent_header **eh, struct blk_header **bh);
+
+/*
+ * Look up the extent of an inode that maps file block lblk. Write the extent
+ * into *ext.
+ *
+ * Precondition:
+ * Caller must hold inode->i_lock.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ * ERR_NOTEXIST - lblk is not mapped.
+ */
+static err_t lookup_extent(struct inode *inode, blk_t lblk, struct sfs_extent *ext);
+
+/*
+ * Move the entries of the full root of inode's extent tree into a new tree
+ * block, which becomes the only child of the root.
+ *
+ * Precondition:
+ * Caller must hold inode->i_lock and a reference to the disk inode.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ * ERR_NORES - No data block available.
+ */
+static err_t grow_tree(struct inode *inode);
+
+/*
+ * Split the full child at position i of index node parent in two, moving the
+ * upper half of its entries into a new tree block linked in right after it.
+ * parent_bh is the block holding parent (NULL for the root), which must not be
+ * full. Write the new node's block into *sibling_bh.
+ *
+ * Precondition:
+ * Caller must hold inode->i_lock, parent_bh->lock if parent_bh is not NULL,
+ * and child_bh->lock.
+ * Caller must hold a reference to the disk inode if parent_bh is NULL.
+ *
+ * Postcondition:
+ * If successful, (*sibling_bh)->lock is locked.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ * ERR_NORES - No data block available.
+ */
+static err_t split_node(struct inode *inode, struct sfs_extent_header *parent, struct blk_header *parent_bh,
+                        int i, struct blk_header *child_bh, struct blk_header **sibling_bh);
+
+/*
+ * Map file block lblk of inode, which must not be mapped yet, to disk block
+ * blk. Extend the extent that ends right before lblk if blk follows it on
+ * disk, otherwise insert a new extent, splitting full tree nodes on the way
+ * down.
+ *
+ * Precondition:
+ * Caller must hold inode->i_lock and a reference to the disk inode.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ * ERR_NORES - No data block available for a new tree block.
+ */
+static err_t insert_extent(struct inode *inode, blk_t lblk, blk_t blk);
 
 /*
- * Free a data block.
+ * Free the data blocks and tree blocks below a node of inode's extent tree.
+ * bh is the block holding the node, or NULL for the root. Entries are dropped
+ * as their blocks are freed, so a failed call can be retried.
+ *
+ * Precondition:
+ * Caller must hold inode->i_lock, and bh->lock if bh is not NULL.
  *
  * Return:
  * ERR_NOMEM - Failed to allocate memory.
  */
-static err_t free_data_block(struct super_block *sb, blk_t blk);
+static err_t free_extent_tree(struct inode *inode, struct sfs_extent_header *eh, struct blk_header *bh);
 
 /*
  * Allocate a directory entry in dir with the specified inode number and name.
@@ -245,6 +437,161 @@ static err_t is_dir_empty(struct inode *dir, int *empty);
  */
 static inum_t search_dir(struct inode *dir, const char *name);
 
+/*
+ * Hash a directory entry name for the directory index. Only the part of the
+ * name a dirent can hold counts.
+ */
+static uint32_t dx_hash(const char *name);
+
+/*
+ * Get the header block of dir's directory index. Write the block buffer
+ * header into *bh.
+ *
+ * Precondition:
+ * Caller must hold dir->i_lock.
+ *
+ * Postcondition:
+ * If successful, (*bh)->lock is locked.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ * ERR_NOTEXIST - dir has no index.
+ */
+static err_t dx_get_header(struct inode *dir, struct blk_header **bh);
+
+/*
+ * Get the bucket of dir's directory index that hash goes to. Write the block
+ * buffer header into *bh and the bucket number into *bucket.
+ *
+ * Precondition:
+ * Caller must hold dir->i_lock and the lock of hdr's block.
+ *
+ * Postcondition:
+ * If successful, (*bh)->lock is locked.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ */
+static err_t dx_get_bucket(struct inode *dir, struct sfs_dx_header *hdr, uint32_t hash,
+                           struct blk_header **bh, uint32_t *bucket);
+
+/*
+ * Find the directory entry called name through dir's index. Write its slot
+ * into *slot and the block holding it into *bh.
+ *
+ * Precondition:
+ * Caller must hold dir->i_lock and the lock of hdr's block.
+ *
+ * Postcondition:
+ * If successful, (*bh)->lock is locked.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ * ERR_NOTEXIST - No entry called name.
+ */
+static err_t dx_lookup(struct inode *dir, struct sfs_dx_header *hdr, const char *name,
+                       uint32_t *slot, struct blk_header **bh);
+
+/*
+ * Split full bucket of dir's index, held in bucket_bh, in two by one more hash
+ * bit, doubling the bucket table first if needed. hash is any hash that goes
+ * to the bucket.
+ *
+ * Precondition:
+ * Caller must hold dir->i_lock, hdr_bh->lock and bucket_bh->lock.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ * ERR_NORES - The index can't grow any further.
+ */
+static err_t dx_split(struct inode *dir, struct blk_header *hdr_bh, uint32_t bucket,
+                      struct blk_header *bucket_bh, uint32_t hash);
+
+/*
+ * Add slot with name hash to dir's index.
+ *
+ * Precondition:
+ * Caller must hold dir->i_lock and hdr_bh->lock.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ * ERR_NORES - The index can't grow any further.
+ */
+static err_t dx_insert(struct inode *dir, struct blk_header *hdr_bh, uint32_t hash, uint32_t slot);
+
+/*
+ * Remove slot with name hash from dir's index.
+ *
+ * Precondition:
+ * Caller must hold dir->i_lock and hdr_bh->lock.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ * ERR_NOTEXIST - slot is not in the index.
+ */
+static err_t dx_remove(struct inode *dir, struct blk_header *hdr_bh, uint32_t hash, uint32_t slot);
+
+/*
+ * Push a free slot on the free slot stack of dir's index.
+ *
+ * Precondition:
+ * Caller must hold dir->i_lock and hdr_bh->lock.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ * ERR_NORES - No data block available.
+ */
+static err_t dx_push_free(struct inode *dir, struct blk_header *hdr_bh, uint32_t slot);
+
+/*
+ * Build an index for linear directory dir. Write the header block of the new
+ * index into *hdr_bh.
+ *
+ * Precondition:
+ * Caller must hold dir->i_lock and a reference to the disk inode.
+ *
+ * Postcondition:
+ * If successful, (*hdr_bh)->lock is locked.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ * ERR_NORES - No data block available.
+ */
+static err_t dx_build(struct inode *dir, struct blk_header **hdr_bh);
+
+/*
+ * Allocate a directory entry in indexed directory dir with the specified inode
+ * number and name.
+ *
+ * Precondition:
+ * Caller must hold dir->i_lock, hdr_bh->lock and a reference to the disk
+ * inode.
+ * Another directory entry with the same name must not exist in dir.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ * ERR_NORES - Failed to allocate directory entry.
+ */
+static err_t dx_alloc_dirent(struct inode *dir, struct blk_header *hdr_bh, const char *name, inum_t inum);
+
+/*
+ * Remove a directory entry in indexed directory dir.
+ *
+ * Precondition:
+ * Caller must hold dir->i_lock and hdr_bh->lock.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate memory.
+ * ERR_NOTEXIST - Directory entry does not exist.
+ */
+static err_t dx_free_dirent(struct inode *dir, struct blk_header *hdr_bh, const char *name);
+
+/*
+ * Get the block of an inode that contains file block lblk, which may lie past
+ * the largest file size. Same as get_data_block otherwise.
+ */
+static err_t get_file_block(struct inode *inode, blk_t lblk, struct blk_header **bh, int alloc);
+
 /*
  * Get the data block of an inode that contains inode offset ofs. Write the
  * block buffer header into *buf. If alloc is True, allocate a new data block if block
@@ -368,6 +715,7 @@ alloc_disk_inode(struct super_block *sb, ftype_t ftype, fmode_t mode, inum_t *in
     sfs_inode->i_ftype = ftype;
     sfs_inode->i_mode = mode;
     sfs_inode->i_nlink = 1;
+    sfs_inode->i_eh.eh_max = SFS_INODE_EXTENTS;
     bdev_set_blk_dirty(inode_bh, True);
     jbd_write_blk(BH_JOURNAL(inode_bh), inode_bh);
     bdev_release_blk(inode_bh);
@@ -492,86 +840,277 @@ fail:
     return err;
 }
 
+static inline int
+bmap_nbits(const struct sfs_sb_info *info, size_t g)
+{
+    // Whole bytes only, like the rest of the bitmap code
+    return min((size_t) BMAP_BITS, (info->s_size - g * BMAP_BITS) / 8 * 8);
+}
+
 static err_t
-alloc_data_block(struct super_block *sb, blk_t *blk)
+count_free_blocks(struct bdev *bdev, struct sfs_sb_info *info)
 {
-    struct blk_header *bmap_bh, *data_bh;
-    blk_t bmap_blk;
-    int index;
-    size_t num_blks;
+    struct blk_header *bh;
+    uint8_t *bmap;
+    size_t ngroups, g;
+    int i, nbits;
 
-    // Use data block bitmap to find a free block
-    for (bmap_blk = SB_INFO(sb)->s_data_bmap_start, num_blks = SB_INFO(sb)->s_size; bmap_blk < SB_INFO(sb)->s_journal_start; bmap_blk++, num_blks -= BDEV_BLK_SIZE * 8) {
-        if ((bmap_bh = bdev_get_blk(sb->bdev, bmap_blk)) == NULL) {
+    ngroups = info->s_journal_start - info->s_data_bmap_start;
+    if ((info->s_bmap_free = kmalloc(ngroups * sizeof(*info->s_bmap_free))) == NULL) {
+        return ERR_NOMEM;
+    }
+    for (g = 0; g < ngroups; g++) {
+        if ((bh = bdev_get_blk(bdev, info->s_data_bmap_start + g)) == NULL) {
+            kfree(info->s_bmap_free);
             return ERR_NOMEM;
         }
-        if ((index = bmap_alloc_element(bmap_bh, min(BDEV_BLK_SIZE, num_blks / 8))) >= 0) {
-            // Not releasing bmap_bh immediately -- we might need to free the
-            // inode again in case of errors
-            *blk = SB_INFO(sb)->s_data_start + BDEV_BLK_SIZE * 8 * (bmap_blk - SB_INFO(sb)->s_data_bmap_start) + index;
-            // Fill newly allocated block with zero
-            if ((data_bh = bdev_get_blk(sb->bdev, *blk)) == NULL) {
-                bmap_free_element(bmap_bh, index);
-                bdev_release_blk(bmap_bh);
-                return ERR_NOMEM;
+        bmap = (uint8_t*)bh->data;
+        nbits = bmap_nbits(info, g);
+        for (i = 0, info->s_bmap_free[g] = 0; i < nbits; i++) {
+            if ((bmap[i / 8] & (1 << (i % 8))) == 0) {
+                info->s_bmap_free[g]++;
             }
-            bdev_release_blk(bmap_bh);
-
-            memset(data_bh->data, 0, BDEV_BLK_SIZE);
-            bdev_set_blk_dirty(data_bh, True);
-            jbd_write_blk(BH_JOURNAL(data_bh), data_bh);
-            bdev_release_blk(data_bh);
+        }
+        bdev_release_blk(bh);
+    }
+    return ERR_OK;
+}
 
-            return ERR_OK;
+static int
+bmap_find_run(struct blk_header *bh, int nbits, int from, int len)
+{
+    uint8_t *bmap;
+    int start, i;
+
+    for (bmap = (uint8_t*)bh->data, start = from; start + len <= nbits;) {
+        if (start % 8 == 0 && bmap[start / 8] == 0xFF) {
+            // Skip a whole byte of in-use elements
+            start += 8;
+        } else if (bmap[start / 8] & (1 << (start % 8))) {
+            start++;
+        } else {
+            for (i = 1; i < len && (bmap[(start + i) / 8] & (1 << ((start + i) % 8))) == 0; i++) {
+                ;
+            }
+            if (i == len) {
+                return start;
+            }
+            // Element start + i is in use, the next run starts after it
+            start += i + 1;
         }
-        bdev_release_blk(bmap_bh);
     }
-    return ERR_NORES;
+    return -1;
 }
 
-static err_t
-free_data_block(struct super_block *sb, blk_t blk)
+static bool
+rsv_overlap(struct super_block *sb, blk_t start, blk_t end, struct sfs_rsv *skip, blk_t *first, blk_t *last)
 {
-    struct blk_header *bh;
-    blk_t bmap_blk;
+    struct sfs_rsv *rsv;
+    bool overlap;
+    Node *n;
+
+    spinlock_acquire(&SB_INFO(sb)->s_rsv_lock);
+    for (n = list_begin(&SB_INFO(sb)->s_rsv_list), overlap = False; n != list_end(&SB_INFO(sb)->s_rsv_list); n = list_next(n)) {
+        rsv = list_entry(n, struct sfs_rsv, r_node);
+        if (rsv != skip && rsv->r_start < end && start < rsv->r_end) {
+            if (!overlap || rsv->r_start < *first) {
+                *first = rsv->r_start;
+            }
+            if (!overlap || rsv->r_end > *last) {
+                *last = rsv->r_end;
+            }
+            overlap = True;
+        }
+    }
+    spinlock_release(&SB_INFO(sb)->s_rsv_lock);
+    return overlap;
+}
 
-    // Mark data block bitmap entry as free
-    kassert(blk >= SB_INFO(sb)->s_data_start);
-    bmap_blk = SB_INFO(sb)->s_data_bmap_start + (blk - SB_INFO(sb)->s_data_start) / (BDEV_BLK_SIZE * 8);
-    if ((bh = bdev_get_blk(sb->bdev, bmap_blk)) == NULL) {
-        return ERR_NOMEM;
+static void
+rsv_set(struct super_block *sb, struct sfs_rsv *rsv, blk_t start, blk_t end)
+{
+    spinlock_acquire(&SB_INFO(sb)->s_rsv_lock);
+    if (rsv->r_start < rsv->r_end) {
+        list_remove(&rsv->r_node);
     }
-    bmap_free_element(bh, (blk - SB_INFO(sb)->s_data_start) % (BDEV_BLK_SIZE * 8));
-    bdev_release_blk(bh);
-    return ERR_OK;
+    rsv->r_start = start;
+    rsv->r_end = end;
+    if (start < end) {
+        list_append(&SB_INFO(sb)->s_rsv_list, &rsv->r_node);
+    }
+    spinlock_release(&SB_INFO(sb)->s_rsv_lock);
 }
 
 static err_t
-alloc_dirent(struct inode *dir, const char *name, inum_t inum)
+alloc_in_bmap(struct super_block *sb, size_t g, int from, int len, bool exact, bool steal,
+              struct sfs_rsv *rsv, blk_t *blk)
 {
-    struct sfs_dirent *dirent;
-    struct blk_header *bh, *inode_bh;
-    offset_t ofs;
-    err_t err;
+    struct blk_header *bmap_bh, *data_bh;
+    uint8_t *bmap;
+    blk_t base, first, last, end;
+    int nbits, index;
 
-    // Acquire reference to the disk inode in case we need to update it.
-    if ((inode_bh = ACQUIRE_INODE_BH(dir)) == NULL) {
+    base = SB_INFO(sb)->s_data_start + g * BMAP_BITS;
+    nbits = bmap_nbits(SB_INFO(sb), g);
+    if ((bmap_bh = bdev_get_blk(sb->bdev, SB_INFO(sb)->s_data_bmap_start + g)) == NULL) {
         return ERR_NOMEM;
     }
-    // Iterate through all blocks in the dir inode and find the first free
-    // directory entry.
-    for (ofs = 0, bh = NULL; ofs < SFS_MAX_FILE_SIZE; ofs += sizeof(struct sfs_dirent), dirent++) {
-        if (ofs % BDEV_BLK_SIZE == 0) {
-            if (bh != NULL) {
-                bdev_release_blk(bh);
-            }
-            if ((err = get_data_block(dir, ofs, &bh, True)) != ERR_OK) {
-                bdev_release_blk_unlocked(inode_bh);
-                return err;
-            }
-            dirent = (struct sfs_dirent*)bh->data;
+    bmap = (uint8_t*)bmap_bh->data;
+    while ((index = bmap_find_run(bmap_bh, nbits, from, len)) >= 0 && (!exact || index == from)) {
+        if (steal || !rsv_overlap(sb, base + index, base + index + len, rsv, &first, &last)) {
+            break;
         }
-        if (ofs >= dir->i_size || dirent->inum == 0) {
+        // Other files have reserved some of the run, look past their windows
+        if (exact) {
+            index = -1;
+            break;
+        }
+        from = last - base;
+    }
+    if (index < 0 || (exact && index != from)) {
+        bdev_release_blk(bmap_bh);
+        return ERR_NORES;
+    }
+
+    bmap[index / 8] |= 1 << (index % 8);
+    bdev_set_blk_dirty(bmap_bh, True);
+    jbd_write_blk(BH_JOURNAL(bmap_bh), bmap_bh);
+    SB_INFO(sb)->s_bmap_free[g]--;
+    *blk = base + index;
+    // Fill newly allocated block with zero. Not releasing bmap_bh until then
+    // -- we might need to free the block again in case of errors
+    if ((data_bh = bdev_get_blk(sb->bdev, *blk)) == NULL) {
+        bmap_free_element(bmap_bh, index);
+        SB_INFO(sb)->s_bmap_free[g]++;
+        bdev_release_blk(bmap_bh);
+        return ERR_NOMEM;
+    }
+    memset(data_bh->data, 0, BDEV_BLK_SIZE);
+    bdev_set_blk_dirty(data_bh, True);
+    jbd_write_blk(BH_JOURNAL(data_bh), data_bh);
+    bdev_release_blk(data_bh);
+
+    if (rsv != NULL) {
+        // Reserve the free blocks that follow, unless another file has
+        for (end = *blk + 1; end < *blk + SFS_RSV_BLKS && end < base + nbits &&
+             (bmap[(end - base) / 8] & (1 << ((end - base) % 8))) == 0; end++) {
+            ;
+        }
+        if (rsv_overlap(sb, *blk + 1, end, rsv, &first, &last)) {
+            end = first > *blk + 1 ? first : *blk + 1;
+        }
+        rsv_set(sb, rsv, *blk + 1, end);
+    }
+    SB_INFO(sb)->s_alloc_goal = *blk + 1;
+    bdev_release_blk(bmap_bh);
+    return ERR_OK;
+}
+
+static err_t
+alloc_data_block(struct super_block *sb, blk_t goal, struct sfs_rsv *rsv, blk_t *blk)
+{
+    struct sfs_sb_info *info;
+    size_t ngroups, g, i;
+    int pass, len;
+    err_t err;
+
+    info = SB_INFO(sb);
+    ngroups = info->s_journal_start - info->s_data_bmap_start;
+    if (goal < info->s_data_start || goal >= info->s_data_start + info->s_size) {
+        goal = info->s_alloc_goal;
+    }
+    if (goal < info->s_data_start || goal >= info->s_data_start + info->s_size) {
+        goal = info->s_data_start;
+    }
+    goal -= info->s_data_start;
+
+    // Pass 0 tries the goal block itself. Pass 1 looks for a full window of
+    // free blocks (any free block without rsv), starting at the goal and
+    // wrapping around to the beginning of its bitmap block. Pass 2 takes any
+    // free block, even one reserved by another file.
+    for (pass = 0, err = ERR_NORES; pass < 3 && err == ERR_NORES; pass++) {
+        len = pass == 1 && rsv != NULL ? SFS_RSV_BLKS : 1;
+        for (i = 0; i <= (pass == 0 ? 0 : ngroups) && err == ERR_NORES; i++) {
+            g = (goal / BMAP_BITS + i) % ngroups;
+            // Bitmap blocks without enough free blocks need not be read
+            if (info->s_bmap_free[g] >= len) {
+                err = alloc_in_bmap(sb, g, i == 0 ? goal % BMAP_BITS : 0, len, pass == 0, pass == 2, rsv, blk);
+            }
+        }
+    }
+    return err;
+}
+
+static err_t
+free_data_blocks(struct super_block *sb, blk_t blk, size_t nblks)
+{
+    struct blk_header *bh;
+    uint8_t *bmap;
+    size_t g, index, n, i;
+
+    kassert(blk >= SB_INFO(sb)->s_data_start);
+    // Mark data block bitmap entries as free, one bitmap block at a time
+    for (; nblks > 0; blk += n, nblks -= n) {
+        g = (blk - SB_INFO(sb)->s_data_start) / BMAP_BITS;
+        index = (blk - SB_INFO(sb)->s_data_start) % BMAP_BITS;
+        n = min(nblks, BMAP_BITS - index);
+        if ((bh = bdev_get_blk(sb->bdev, SB_INFO(sb)->s_data_bmap_start + g)) == NULL) {
+            return ERR_NOMEM;
+        }
+        for (i = 0, bmap = (uint8_t*)bh->data; i < n; i++) {
+            // Blocks may already be free when a failed deletion is retried
+            if (bmap[(index + i) / 8] & (1 << ((index + i) % 8))) {
+                bmap_free_element(bh, index + i);
+                SB_INFO(sb)->s_bmap_free[g]++;
+            }
+        }
+        bdev_release_blk(bh);
+    }
+    return ERR_OK;
+}
+
+static err_t
+alloc_dirent(struct inode *dir, const char *name, inum_t inum)
+{
+    struct sfs_dirent *dirent;
+    struct blk_header *bh, *inode_bh, *hdr_bh;
+    offset_t ofs;
+    err_t err;
+
+    // Acquire reference to the disk inode in case we need to update it.
+    if ((inode_bh = ACQUIRE_INODE_BH(dir)) == NULL) {
+        return ERR_NOMEM;
+    }
+    // Directories that outgrow a block get an index. If the index can't be
+    // built, it is left incomplete (and ignored), and the entry is added
+    // without it.
+    err = dx_get_header(dir, &hdr_bh);
+    if (err == ERR_NOTEXIST && dir->i_size >= BDEV_BLK_SIZE && dir->i_size <= DX_BUILD_MAX_SIZE &&
+        dx_build(dir, &hdr_bh) == ERR_OK) {
+        err = ERR_OK;
+    }
+    if (err != ERR_NOTEXIST) {
+        if (err == ERR_OK) {
+            err = dx_alloc_dirent(dir, hdr_bh, name, inum);
+            bdev_release_blk(hdr_bh);
+        }
+        bdev_release_blk_unlocked(inode_bh);
+        return err;
+    }
+    // Iterate through all blocks in the dir inode and find the first free
+    // directory entry.
+    for (ofs = 0, bh = NULL; ofs < SFS_MAX_FILE_SIZE; ofs += sizeof(struct sfs_dirent), dirent++) {
+        if (ofs % BDEV_BLK_SIZE == 0) {
+            if (bh != NULL) {
+                bdev_release_blk(bh);
+            }
+            if ((err = get_data_block(dir, ofs, &bh, True)) != ERR_OK) {
+                bdev_release_blk_unlocked(inode_bh);
+                return err;
+            }
+            dirent = (struct sfs_dirent*)bh->data;
+        }
+        if (ofs >= dir->i_size || dirent->inum == 0) {
             // Free/new directory entry
             if (ofs >= dir->i_size) {
                 // Update dir inode size
@@ -603,10 +1142,17 @@ static err_t
 free_dirent(struct inode *dir, const char *name)
 {
     struct sfs_dirent *dirent;
-    struct blk_header *bh;
+    struct blk_header *bh, *hdr_bh;
     offset_t ofs;
     err_t err;
 
+    if ((err = dx_get_header(dir, &hdr_bh)) != ERR_NOTEXIST) {
+        if (err == ERR_OK) {
+            err = dx_free_dirent(dir, hdr_bh, name);
+            bdev_release_blk(hdr_bh);
+        }
+        return err;
+    }
     // Iterate through all blocks in the dir inode. If the target directory
     // entry is found, remove it.
     for (ofs = 0, bh = NULL; ofs < dir->i_size; ofs += sizeof(struct sfs_dirent), dirent++) {
@@ -677,10 +1223,24 @@ static inum_t
 search_dir(struct inode *dir, const char *name)
 {
     struct sfs_dirent *dirent;
-    struct blk_header *bh;
+    struct blk_header *bh, *hdr_bh;
     offset_t ofs;
+    uint32_t slot;
+    inum_t inum;
     err_t err;
 
+    // Indexed directories only look at the entries with a matching hash
+    if ((err = dx_get_header(dir, &hdr_bh)) != ERR_NOTEXIST) {
+        inum = 0;
+        if (err == ERR_OK) {
+            if (dx_lookup(dir, (struct sfs_dx_header*)hdr_bh->data, name, &slot, &bh) == ERR_OK) {
+                inum = ((struct sfs_dirent*)bh->data + slot % DIRENTS_PER_BLK)->inum;
+                bdev_release_blk(bh);
+            }
+            bdev_release_blk(hdr_bh);
+        }
+        return inum;
+    }
     // Iterate through all blocks in the dir inode to find a match
     for (ofs = 0, bh = NULL; ofs < dir->i_size; ofs += sizeof(struct sfs_dirent), dirent++) {
         if (ofs % BDEV_BLK_SIZE == 0) {
@@ -704,111 +1264,763 @@ search_dir(struct inode *dir, const char *name)
     return 0;
 }
 
+static uint32_t
+dx_hash(const char *name)
+{
+    uint32_t hash;
+    int i;
+
+    // FNV-1a
+    for (hash = 2166136261u, i = 0; i < SFS_DIRENT_NAMELEN - 1 && name[i] != 0; i++) {
+        hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+    }
+    return hash;
+}
+
 static err_t
-get_data_block(struct inode *inode, offset_t ofs, struct blk_header **bh, int alloc)
+dx_get_header(struct inode *dir, struct blk_header **bh)
 {
-    int blk_index, indir_blk_index, indir_blk_ofs;
-    blk_t blk, indir_blk;
-    struct blk_header *indir_bh, *inode_bh;
     err_t err;
 
-    kassert(ofs < SFS_MAX_FILE_SIZE);
+    if ((err = get_file_block(dir, DX_HEADER_LBLK, bh, False)) != ERR_OK) {
+        return err;
+    }
+    // An index that failed to build halfway does not count
+    if (((struct sfs_dx_header*)(*bh)->data)->dx_magic != SFS_DX_MAGIC) {
+        bdev_release_blk(*bh);
+        return ERR_NOTEXIST;
+    }
+    return ERR_OK;
+}
 
-    indir_bh = NULL;
-    // Acquire reference to the disk inode in case we need to update it.
-    if ((inode_bh = ACQUIRE_INODE_BH(inode)) == NULL) {
-        return ERR_NOMEM;
+static err_t
+dx_get_bucket(struct inode *dir, struct sfs_dx_header *hdr, uint32_t hash,
+              struct blk_header **bh, uint32_t *bucket)
+{
+    struct blk_header *table_bh;
+    uint32_t i;
+    err_t err;
+
+    i = hash & ((1 << hdr->dx_depth) - 1);
+    if ((err = get_file_block(dir, DX_TABLE_LBLK + i / DX_TABLE_PER_BLK, &table_bh, False)) != ERR_OK) {
+        return err;
     }
+    *bucket = ((uint32_t*)table_bh->data)[i % DX_TABLE_PER_BLK];
+    bdev_release_blk(table_bh);
+    return get_file_block(dir, DX_BUCKET_LBLK + *bucket, bh, False);
+}
 
-    blk_index = ofs / BDEV_BLK_SIZE;
-    if (blk_index < SFS_NDIRECT) {
-        // Direct block
-        blk = INODE_INFO(inode)->i_addrs[blk_index];
-        if (blk == 0) {
-            // Data block has not been allocated before -- allocate one.
-            if (!alloc) {
-                err = ERR_NOTEXIST;
-                goto fail;
+static err_t
+dx_lookup(struct inode *dir, struct sfs_dx_header *hdr, const char *name,
+          uint32_t *slot, struct blk_header **bh)
+{
+    struct blk_header *bucket_bh;
+    struct sfs_dx_bucket *bucket;
+    struct sfs_dirent *dirent;
+    uint32_t hash, b;
+    int i;
+    err_t err;
+
+    hash = dx_hash(name);
+    if ((err = dx_get_bucket(dir, hdr, hash, &bucket_bh, &b)) != ERR_OK) {
+        return err;
+    }
+    // Check the dirent of every entry with a matching hash
+    bucket = (struct sfs_dx_bucket*)bucket_bh->data;
+    for (i = 0; i < bucket->b_count; i++) {
+        if (bucket->b_entries[i].hash != hash) {
+            continue;
+        }
+        *slot = bucket->b_entries[i].slot;
+        if ((err = get_data_block(dir, (offset_t) *slot * sizeof(struct sfs_dirent), bh, False)) != ERR_OK) {
+            goto done;
+        }
+        dirent = (struct sfs_dirent*)(*bh)->data + *slot % DIRENTS_PER_BLK;
+        if (dirent->inum > 0 && strncmp(dirent->name, name, SFS_DIRENT_NAMELEN) == 0) {
+            err = ERR_OK;
+            goto done;
+        }
+        bdev_release_blk(*bh);
+    }
+    err = ERR_NOTEXIST;
+
+done:
+    bdev_release_blk(bucket_bh);
+    return err;
+}
+
+static err_t
+dx_split(struct inode *dir, struct blk_header *hdr_bh, uint32_t bucket,
+         struct blk_header *bucket_bh, uint32_t hash)
+{
+    struct sfs_dx_header *hdr;
+    struct sfs_dx_bucket *old, *new;
+    struct blk_header *new_bh, *table_bh, *src_bh;
+    uint32_t *table, bit, nb, n, i, tblk;
+    int j, count;
+    err_t err;
+
+    hdr = (struct sfs_dx_header*)hdr_bh->data;
+    old = (struct sfs_dx_bucket*)bucket_bh->data;
+    if (old->b_depth == hdr->dx_depth) {
+        if (hdr->dx_depth == DX_MAX_DEPTH) {
+            return ERR_NORES;
+        }
+        // Double the bucket table, the new upper half is a copy of the lower
+        // half. The copy isn't used until dx_depth grows.
+        n = 1 << hdr->dx_depth;
+        if (n < DX_TABLE_PER_BLK) {
+            if ((err = get_file_block(dir, DX_TABLE_LBLK, &table_bh, False)) != ERR_OK) {
+                return err;
             }
-            if ((err = alloc_data_block(inode->sb, &blk)) != ERR_OK) {
-                goto fail;
+            table = (uint32_t*)table_bh->data;
+            memmove(table + n, table, n * sizeof(uint32_t));
+            bdev_set_blk_dirty(table_bh, True);
+            jbd_write_blk(BH_JOURNAL(table_bh), table_bh);
+            bdev_release_blk(table_bh);
+        } else {
+            for (i = 0; i < n / DX_TABLE_PER_BLK; i++) {
+                if ((err = get_file_block(dir, DX_TABLE_LBLK + i, &src_bh, False)) != ERR_OK) {
+                    return err;
+                }
+                if ((err = get_file_block(dir, DX_TABLE_LBLK + n / DX_TABLE_PER_BLK + i, &table_bh, True)) != ERR_OK) {
+                    bdev_release_blk(src_bh);
+                    return err;
+                }
+                memmove(table_bh->data, src_bh->data, BDEV_BLK_SIZE);
+                bdev_set_blk_dirty(table_bh, True);
+                jbd_write_blk(BH_JOURNAL(table_bh), table_bh);
+                bdev_release_blk(table_bh);
+                bdev_release_blk(src_bh);
             }
-            // Update direct block with the newly allocated data block.
-            INODE_INFO(inode)->i_addrs[blk_index] = blk;
-            fs_set_inode_dirty(inode, True);
-            // sfs_write_inode should not fail because we acquired the disk
-            // inode reference
-            sfs_write_inode(inode);
         }
-    } else {
-        // Indirect block
-        indir_blk_index = SFS_NDIRECT + (blk_index - SFS_NDIRECT) / (BDEV_BLK_SIZE / sizeof(uint32_t));
-        kassert(indir_blk_index < SFS_NDIRECT + SFS_NINDIRECT);
-        // If indirect block doesn't exist yet, allocate one first.
-        if (INODE_INFO(inode)->i_addrs[indir_blk_index] == 0) {
-            if (!alloc) {
-                err = ERR_NOTEXIST;
-                goto fail;
+        hdr->dx_depth++;
+        bdev_set_blk_dirty(hdr_bh, True);
+        jbd_write_blk(BH_JOURNAL(hdr_bh), hdr_bh);
+    }
+
+    // Lookups check the dirent of each candidate, so an entry in a bucket the
+    // table no longer leads its hash to is harmless, while a missing entry is
+    // not. Copy the entries with the new bit set into the new bucket, point the
+    // table at it, and only then drop them from the old bucket.
+    nb = hdr->dx_nbuckets;
+    kassert(nb < (1 << DX_MAX_DEPTH));
+    if ((err = get_file_block(dir, DX_BUCKET_LBLK + nb, &new_bh, True)) != ERR_OK) {
+        return err;
+    }
+    bit = 1 << old->b_depth;
+    new = (struct sfs_dx_bucket*)new_bh->data;
+    new->b_count = 0;
+    new->b_depth = old->b_depth + 1;
+    for (j = 0; j < old->b_count; j++) {
+        if (old->b_entries[j].hash & bit) {
+            new->b_entries[new->b_count++] = old->b_entries[j];
+        }
+    }
+    bdev_set_blk_dirty(new_bh, True);
+    jbd_write_blk(BH_JOURNAL(new_bh), new_bh);
+    bdev_release_blk(new_bh);
+    hdr->dx_nbuckets++;
+    bdev_set_blk_dirty(hdr_bh, True);
+    jbd_write_blk(BH_JOURNAL(hdr_bh), hdr_bh);
+
+    // The table entries of the bucket are the ones agreeing with hash on the
+    // low b_depth bits; those with the new bit set now lead to the new bucket
+    for (i = (hash & (bit - 1)) | bit, table_bh = NULL; i < (1u << hdr->dx_depth); i += bit << 1) {
+        if (table_bh == NULL || i / DX_TABLE_PER_BLK != tblk) {
+            if (table_bh != NULL) {
+                bdev_release_blk(table_bh);
             }
-            if ((err = alloc_data_block(inode->sb, &indir_blk)) != ERR_OK) {
-                goto fail;
+            tblk = i / DX_TABLE_PER_BLK;
+            if ((err = get_file_block(dir, DX_TABLE_LBLK + tblk, &table_bh, False)) != ERR_OK) {
+                return err;
             }
-            INODE_INFO(inode)->i_addrs[indir_blk_index] = indir_blk;
-            fs_set_inode_dirty(inode, True);
-            // sfs_write_inode should not fail because we acquired the disk
-            // inode reference
-            sfs_write_inode(inode);
-        }
-        // Now the indirect block is guaranteed to exist. Read the block number
-        // from the indirect block.
-        kassert(INODE_INFO(inode)->i_addrs[indir_blk_index] > 0);
-        if ((indir_bh = bdev_get_blk(inode->sb->bdev, INODE_INFO(inode)->i_addrs[indir_blk_index])) == NULL) {
-            // Do not roll back indirect block allocation. Okay to have an empty
-            // indirect block. (Same reasoning applies to subsequent errors too)
-            err = ERR_NOMEM;
-            goto fail;
         }
-        indir_blk_ofs = (blk_index - SFS_NDIRECT) % (BDEV_BLK_SIZE / sizeof(uint32_t));
-        blk = ((blk_t*)indir_bh->data)[indir_blk_ofs];
-        if (blk == 0) {
-            // Data block has not been allocated before -- allocate one.
-            if (!alloc) {
-                err = ERR_NOTEXIST;
-                goto fail;
+        table = (uint32_t*)table_bh->data;
+        if (table[i % DX_TABLE_PER_BLK] == bucket) {
+            table[i % DX_TABLE_PER_BLK] = nb;
+            bdev_set_blk_dirty(table_bh, True);
+            jbd_write_blk(BH_JOURNAL(table_bh), table_bh);
+        }
+    }
+    if (table_bh != NULL) {
+        bdev_release_blk(table_bh);
+    }
+
+    for (j = 0, count = 0; j < old->b_count; j++) {
+        if ((old->b_entries[j].hash & bit) == 0) {
+            old->b_entries[count++] = old->b_entries[j];
+        }
+    }
+    old->b_count = count;
+    old->b_depth++;
+    bdev_set_blk_dirty(bucket_bh, True);
+    jbd_write_blk(BH_JOURNAL(bucket_bh), bucket_bh);
+    return ERR_OK;
+}
+
+static err_t
+dx_insert(struct inode *dir, struct blk_header *hdr_bh, uint32_t hash, uint32_t slot)
+{
+    struct sfs_dx_bucket *bucket;
+    struct blk_header *bh;
+    uint32_t b;
+    err_t err;
+
+    while (True) {
+        if ((err = dx_get_bucket(dir, (struct sfs_dx_header*)hdr_bh->data, hash, &bh, &b)) != ERR_OK) {
+            return err;
+        }
+        bucket = (struct sfs_dx_bucket*)bh->data;
+        if (bucket->b_count < DX_BUCKET_ENTRIES) {
+            bucket->b_entries[bucket->b_count].hash = hash;
+            bucket->b_entries[bucket->b_count].slot = slot;
+            bucket->b_count++;
+            bdev_set_blk_dirty(bh, True);
+            jbd_write_blk(BH_JOURNAL(bh), bh);
+            bdev_release_blk(bh);
+            return ERR_OK;
+        }
+        // Split the full bucket and try again
+        err = dx_split(dir, hdr_bh, b, bh, hash);
+        bdev_release_blk(bh);
+        if (err != ERR_OK) {
+            return err;
+        }
+    }
+}
+
+static err_t
+dx_remove(struct inode *dir, struct blk_header *hdr_bh, uint32_t hash, uint32_t slot)
+{
+    struct sfs_dx_bucket *bucket;
+    struct blk_header *bh;
+    uint32_t b;
+    int i;
+    err_t err;
+
+    if ((err = dx_get_bucket(dir, (struct sfs_dx_header*)hdr_bh->data, hash, &bh, &b)) != ERR_OK) {
+        return err;
+    }
+    bucket = (struct sfs_dx_bucket*)bh->data;
+    for (i = 0; i < bucket->b_count; i++) {
+        if (bucket->b_entries[i].hash == hash && bucket->b_entries[i].slot == slot) {
+            // Fill the hole with the last entry
+            bucket->b_entries[i] = bucket->b_entries[--bucket->b_count];
+            bdev_set_blk_dirty(bh, True);
+            jbd_write_blk(BH_JOURNAL(bh), bh);
+            bdev_release_blk(bh);
+            return ERR_OK;
+        }
+    }
+    bdev_release_blk(bh);
+    return ERR_NOTEXIST;
+}
+
+static err_t
+dx_push_free(struct inode *dir, struct blk_header *hdr_bh, uint32_t slot)
+{
+    struct sfs_dx_header *hdr;
+    struct blk_header *bh;
+    err_t err;
+
+    hdr = (struct sfs_dx_header*)hdr_bh->data;
+    if ((err = get_file_block(dir, DX_FREE_LBLK + hdr->dx_nfree / DX_FREE_PER_BLK, &bh, True)) != ERR_OK) {
+        return err;
+    }
+    ((uint32_t*)bh->data)[hdr->dx_nfree % DX_FREE_PER_BLK] = slot;
+    bdev_set_blk_dirty(bh, True);
+    jbd_write_blk(BH_JOURNAL(bh), bh);
+    bdev_release_blk(bh);
+    hdr->dx_nfree++;
+    bdev_set_blk_dirty(hdr_bh, True);
+    jbd_write_blk(BH_JOURNAL(hdr_bh), hdr_bh);
+    return ERR_OK;
+}
+
+static err_t
+dx_build(struct inode *dir, struct blk_header **hdr_bh)
+{
+    struct sfs_dx_header *hdr;
+    struct sfs_dx_bucket *bucket;
+    struct sfs_dirent *dirent;
+    struct blk_header *bh;
+    uint32_t slot;
+    err_t err;
+
+    // Start with one empty bucket. Blocks left over from a failed attempt are
+    // reused.
+    if ((err = get_file_block(dir, DX_HEADER_LBLK, hdr_bh, True)) != ERR_OK) {
+        return err;
+    }
+    hdr = (struct sfs_dx_header*)(*hdr_bh)->data;
+    hdr->dx_magic = 0;
+    hdr->dx_depth = 0;
+    hdr->dx_nbuckets = 1;
+    hdr->dx_nfree = 0;
+    bdev_set_blk_dirty(*hdr_bh, True);
+    jbd_write_blk(BH_JOURNAL((*hdr_bh)), *hdr_bh);
+    if ((err = get_file_block(dir, DX_TABLE_LBLK, &bh, True)) != ERR_OK) {
+        goto fail;
+    }
+    ((uint32_t*)bh->data)[0] = 0;
+    bdev_set_blk_dirty(bh, True);
+    jbd_write_blk(BH_JOURNAL(bh), bh);
+    bdev_release_blk(bh);
+    if ((err = get_file_block(dir, DX_BUCKET_LBLK, &bh, True)) != ERR_OK) {
+        goto fail;
+    }
+    bucket = (struct sfs_dx_bucket*)bh->data;
+    bucket->b_count = 0;
+    bucket->b_depth = 0;
+    bdev_set_blk_dirty(bh, True);
+    jbd_write_blk(BH_JOURNAL(bh), bh);
+    bdev_release_blk(bh);
+
+    // Index every directory entry, and stack up the free ones
+    for (slot = 0, bh = NULL; slot < dir->i_size / sizeof(struct sfs_dirent); slot++) {
+        if (slot % DIRENTS_PER_BLK == 0) {
+            if (bh != NULL) {
+                bdev_release_blk(bh);
             }
-            if ((err = alloc_data_block(inode->sb, &blk)) != ERR_OK) {
+            if ((err = get_data_block(dir, (offset_t) slot * sizeof(struct sfs_dirent), &bh, False)) != ERR_OK) {
+                bh = NULL;
                 goto fail;
             }
-            // Write newly allocate data block to the indirect block.
-            ((blk_t*)indir_bh->data)[indir_blk_ofs] = blk;
-            bdev_set_blk_dirty(indir_bh, True);
-            jbd_write_blk(BH_JOURNAL(indir_bh), indir_bh);
         }
-        bdev_release_blk(indir_bh);
+        dirent = (struct sfs_dirent*)bh->data + slot % DIRENTS_PER_BLK;
+        if (dirent->inum > 0) {
+            err = dx_insert(dir, *hdr_bh, dx_hash(dirent->name), slot);
+        } else {
+            err = dx_push_free(dir, *hdr_bh, slot);
+        }
+        if (err != ERR_OK) {
+            goto fail;
+        }
+    }
+    if (bh != NULL) {
+        bdev_release_blk(bh);
     }
+    // The index is complete and takes over from the linear search
+    hdr->dx_magic = SFS_DX_MAGIC;
+    bdev_set_blk_dirty(*hdr_bh, True);
+    jbd_write_blk(BH_JOURNAL((*hdr_bh)), *hdr_bh);
+    return ERR_OK;
 
-    kassert(blk > 0);
-    // Now read the data block.
-    if ((*bh = bdev_get_blk(inode->sb->bdev, blk)) == NULL) {
-        // Do not roll back data block allocation (or indirect block
-        // allocation). sfs_delete_inode will free them correctly.
-        err = ERR_NOMEM;
-        goto fail;
+fail:
+    if (bh != NULL) {
+        bdev_release_blk(bh);
     }
+    bdev_release_blk(*hdr_bh);
+    return err;
+}
 
-    bdev_release_blk_unlocked(inode_bh);
+static err_t
+dx_alloc_dirent(struct inode *dir, struct blk_header *hdr_bh, const char *name, inum_t inum)
+{
+    struct sfs_dx_header *hdr;
+    struct sfs_dirent *dirent;
+    struct blk_header *bh;
+    uint32_t slot;
+    bool reuse;
+    err_t err;
+
+    // Reuse the most recently freed slot, or append a new one
+    hdr = (struct sfs_dx_header*)hdr_bh->data;
+    if ((reuse = hdr->dx_nfree > 0)) {
+        if ((err = get_file_block(dir, DX_FREE_LBLK + (hdr->dx_nfree - 1) / DX_FREE_PER_BLK, &bh, False)) != ERR_OK) {
+            return err;
+        }
+        slot = ((uint32_t*)bh->data)[(hdr->dx_nfree - 1) % DX_FREE_PER_BLK];
+        bdev_release_blk(bh);
+    } else {
+        slot = dir->i_size / sizeof(struct sfs_dirent);
+        if ((offset_t) slot * sizeof(struct sfs_dirent) >= SFS_MAX_FILE_SIZE) {
+            return ERR_NORES;
+        }
+    }
+    if ((err = get_data_block(dir, (offset_t) slot * sizeof(struct sfs_dirent), &bh, True)) != ERR_OK) {
+        return err;
+    }
+    // Index the slot first, nothing has changed yet if that fails
+    if ((err = dx_insert(dir, hdr_bh, dx_hash(name), slot)) != ERR_OK) {
+        bdev_release_blk(bh);
+        return err;
+    }
+    dirent = (struct sfs_dirent*)bh->data + slot % DIRENTS_PER_BLK;
+    dirent->inum = inum;
+    strncpy(dirent->name, name, SFS_DIRENT_NAMELEN);
+    // Make sure name ends with null
+    dirent->name[SFS_DIRENT_NAMELEN-1] = 0;
+    bdev_set_blk_dirty(bh, True);
+    jbd_write_blk(BH_JOURNAL(bh), bh);
+    bdev_release_blk(bh);
+
+    if (reuse) {
+        hdr->dx_nfree--;
+        bdev_set_blk_dirty(hdr_bh, True);
+        jbd_write_blk(BH_JOURNAL(hdr_bh), hdr_bh);
+    } else {
+        // Update dir inode size. sfs_write_inode should never fail because
+        // the caller acquired the disk inode reference
+        dir->i_size = (slot + 1) * sizeof(struct sfs_dirent);
+        fs_set_inode_dirty(dir, True);
+        sfs_write_inode(dir);
+    }
     return ERR_OK;
+}
 
-fail:
-    if (indir_bh != NULL) {
-        bdev_release_blk(indir_bh);
+static err_t
+dx_free_dirent(struct inode *dir, struct blk_header *hdr_bh, const char *name)
+{
+    struct blk_header *bh;
+    uint32_t slot;
+    err_t err;
+
+    if ((err = dx_lookup(dir, (struct sfs_dx_header*)hdr_bh->data, name, &slot, &bh)) != ERR_OK) {
+        return err;
     }
-    if (inode_bh != NULL) {
-        bdev_release_blk_unlocked(inode_bh);
+    // Unindex the entry first, nothing has changed yet if that fails
+    if ((err = dx_remove(dir, hdr_bh, dx_hash(name), slot)) == ERR_OK) {
+        ((struct sfs_dirent*)bh->data + slot % DIRENTS_PER_BLK)->inum = 0;
+        bdev_set_blk_dirty(bh, True);
+        jbd_write_blk(BH_JOURNAL(bh), bh);
+        // Failing to stack up the slot only keeps it from being reused
+        dx_push_free(dir, hdr_bh, slot);
+        // Do not update dir inode size here.
+    }
+    bdev_release_blk(bh);
+    return err;
+}
+
+static int
+search_node(struct sfs_extent_header *eh, blk_t lblk)
+{
+    struct sfs_extent *ents;
+    int lo, hi, mid;
+
+    // Binary search for the last entry with e_lblk <= lblk
+    for (ents = EXTENTS(eh), lo = 0, hi = eh->eh_entries - 1; lo <= hi;) {
+        mid = (lo + hi) / 2;
+        if (ents[mid].e_lblk <= lblk) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return hi;
+}
+
+static void
+set_node_dirty(struct inode *inode, struct blk_header *bh)
+{
+    if (bh == NULL) {
+        fs_set_inode_dirty(inode, True);
+        // sfs_write_inode should not fail because the caller holds the disk
+        // inode reference
+        sfs_write_inode(inode);
+    } else {
+        bdev_set_blk_dirty(bh, True);
+        jbd_write_blk(BH_JOURNAL(bh), bh);
+    }
+}
+
+static err_t
+find_leaf(struct inode *inode, blk_t lblk, struct sfs_extent_header **eh, struct blk_header **bh)
+{
+    int i;
+
+    *eh = &INODE_INFO(inode)->i_eh;
+    *bh = NULL;
+    while ((*eh)->eh_depth > 0) {
+        // A block before the first child's range belongs to no leaf, stop at
+        // the first one
+        if ((i = search_node(*eh, lblk)) < 0) {
+            i = 0;
+        }
+        if (*bh != NULL) {
+            bdev_release_blk(*bh);
+        }
+        if ((*bh = bdev_get_blk(inode->sb->bdev, EXTENTS(*eh)[i].e_start)) == NULL) {
+            return ERR_NOMEM;
+        }
+        *eh = (struct sfs_extent_header*)(*bh)->data;
+    }
+    return ERR_OK;
+}
+
+static err_t
+lookup_extent(struct inode *inode, blk_t lblk, struct sfs_extent *ext)
+{
+    struct sfs_extent_header *eh;
+    struct sfs_extent *cache;
+    struct blk_header *bh;
+    int i;
+    err_t err;
+
+    // Sequential accesses keep hitting the extent looked up last
+    cache = &INODE_INFO(inode)->i_cache;
+    if (lblk >= cache->e_lblk && lblk - cache->e_lblk < cache->e_len) {
+        *ext = *cache;
+        return ERR_OK;
+    }
+    if ((err = find_leaf(inode, lblk, &eh, &bh)) != ERR_OK) {
+        return err;
+    }
+    err = ERR_NOTEXIST;
+    if ((i = search_node(eh, lblk)) >= 0 && lblk - EXTENTS(eh)[i].e_lblk < EXTENTS(eh)[i].e_len) {
+        *ext = *cache = EXTENTS(eh)[i];
+        err = ERR_OK;
+    }
+    if (bh != NULL) {
+        bdev_release_blk(bh);
+    }
+    return err;
+}
+
+static err_t
+grow_tree(struct inode *inode)
+{
+    struct sfs_extent_header *root, *eh;
+    struct blk_header *bh;
+    blk_t blk;
+    err_t err;
+
+    root = &INODE_INFO(inode)->i_eh;
+    kassert(root->eh_entries == root->eh_max);
+    if ((err = alloc_data_block(inode->sb, 0, NULL, &blk)) != ERR_OK) {
+        return err;
+    }
+    if ((bh = bdev_get_blk(inode->sb->bdev, blk)) == NULL) {
+        free_data_blocks(inode->sb, blk, 1);
+        return ERR_NOMEM;
+    }
+    eh = (struct sfs_extent_header*)bh->data;
+    eh->eh_entries = root->eh_entries;
+    eh->eh_max = SFS_BLK_EXTENTS;
+    eh->eh_depth = root->eh_depth;
+    memmove(EXTENTS(eh), EXTENTS(root), root->eh_entries * sizeof(struct sfs_extent));
+    set_node_dirty(inode, bh);
+    bdev_release_blk(bh);
+
+    // The first entry keeps its e_lblk, which is where the new child starts
+    root->eh_entries = 1;
+    root->eh_depth++;
+    EXTENTS(root)[0].e_start = blk;
+    EXTENTS(root)[0].e_len = 0;
+    set_node_dirty(inode, NULL);
+    return ERR_OK;
+}
+
+static err_t
+split_node(struct inode *inode, struct sfs_extent_header *parent, struct blk_header *parent_bh,
+           int i, struct blk_header *child_bh, struct blk_header **sibling_bh)
+{
+    struct sfs_extent_header *child, *sibling;
+    struct sfs_extent *ents;
+    blk_t blk;
+    int half;
+    err_t err;
+
+    kassert(parent->eh_entries < parent->eh_max);
+    if ((err = alloc_data_block(inode->sb, 0, NULL, &blk)) != ERR_OK) {
+        return err;
+    }
+    if ((*sibling_bh = bdev_get_blk(inode->sb->bdev, blk)) == NULL) {
+        free_data_blocks(inode->sb, blk, 1);
+        return ERR_NOMEM;
+    }
+    // Move the upper half of the child's entries into the sibling
+    child = (struct sfs_extent_header*)child_bh->data;
+    sibling = (struct sfs_extent_header*)(*sibling_bh)->data;
+    half = child->eh_entries / 2;
+    sibling->eh_entries = child->eh_entries - half;
+    sibling->eh_max = SFS_BLK_EXTENTS;
+    sibling->eh_depth = child->eh_depth;
+    memmove(EXTENTS(sibling), EXTENTS(child) + half, sibling->eh_entries * sizeof(struct sfs_extent));
+    child->eh_entries = half;
+    set_node_dirty(inode, child_bh);
+    set_node_dirty(inode, *sibling_bh);
+
+    // Link the sibling into the parent
+    ents = EXTENTS(parent);
+    memmove(&ents[i + 2], &ents[i + 1], (parent->eh_entries - i - 1) * sizeof(struct sfs_extent));
+    ents[i + 1].e_lblk = EXTENTS(sibling)[0].e_lblk;
+    ents[i + 1].e_start = blk;
+    ents[i + 1].e_len = 0;
+    parent->eh_entries++;
+    set_node_dirty(inode, parent_bh);
+    return ERR_OK;
+}
+
+static err_t
+insert_extent(struct inode *inode, blk_t lblk, blk_t blk)
+{
+    struct sfs_extent_header *eh, *child;
+    struct sfs_extent *ents;
+    struct blk_header *bh, *child_bh, *sibling_bh;
+    int i;
+    err_t err;
+
+    INODE_INFO(inode)->i_cache.e_len = 0;
+
+    // Appending right after an extent on disk only makes it longer
+    if ((err = find_leaf(inode, lblk, &eh, &bh)) != ERR_OK) {
+        return err;
+    }
+    ents = EXTENTS(eh);
+    if ((i = search_node(eh, lblk)) >= 0 && ents[i].e_lblk + ents[i].e_len == lblk &&
+        ents[i].e_start + ents[i].e_len == blk) {
+        ents[i].e_len++;
+        set_node_dirty(inode, bh);
+        if (bh != NULL) {
+            bdev_release_blk(bh);
+        }
+        return ERR_OK;
+    }
+    if (bh != NULL) {
+        bdev_release_blk(bh);
+    }
+
+    // Otherwise the leaf takes a new entry. Split full nodes on the way down,
+    // so that every parent has room for a new child.
+    eh = &INODE_INFO(inode)->i_eh;
+    if (eh->eh_entries == eh->eh_max && (err = grow_tree(inode)) != ERR_OK) {
+        return err;
+    }
+    for (bh = NULL; eh->eh_depth > 0; bh = child_bh, eh = child) {
+        ents = EXTENTS(eh);
+        if ((i = search_node(eh, lblk)) < 0) {
+            // lblk comes before the whole subtree, the first child takes it
+            i = 0;
+            ents[0].e_lblk = lblk;
+            set_node_dirty(inode, bh);
+        }
+        if ((child_bh = bdev_get_blk(inode->sb->bdev, ents[i].e_start)) == NULL) {
+            err = ERR_NOMEM;
+            goto done;
+        }
+        child = (struct sfs_extent_header*)child_bh->data;
+        if (child->eh_entries == child->eh_max) {
+            if ((err = split_node(inode, eh, bh, i, child_bh, &sibling_bh)) != ERR_OK) {
+                bdev_release_blk(child_bh);
+                goto done;
+            }
+            if (lblk >= ents[i + 1].e_lblk) {
+                bdev_release_blk(child_bh);
+                child_bh = sibling_bh;
+                child = (struct sfs_extent_header*)child_bh->data;
+            } else {
+                bdev_release_blk(sibling_bh);
+            }
+        }
+        if (bh != NULL) {
+            bdev_release_blk(bh);
+        }
+    }
+    // Insert the new extent after the last one that starts before lblk
+    kassert(eh->eh_entries < eh->eh_max);
+    ents = EXTENTS(eh);
+    i = search_node(eh, lblk) + 1;
+    memmove(&ents[i + 1], &ents[i], (eh->eh_entries - i) * sizeof(struct sfs_extent));
+    ents[i].e_lblk = lblk;
+    ents[i].e_start = blk;
+    ents[i].e_len = 1;
+    eh->eh_entries++;
+    set_node_dirty(inode, bh);
+    err = ERR_OK;
+
+done:
+    if (bh != NULL) {
+        bdev_release_blk(bh);
     }
     return err;
 }
 
+static err_t
+free_extent_tree(struct inode *inode, struct sfs_extent_header *eh, struct blk_header *bh)
+{
+    struct sfs_extent *ext;
+    struct blk_header *child_bh;
+    err_t err;
+
+    // Free entries from the back, dropping each once its blocks are freed
+    while (eh->eh_entries > 0) {
+        ext = &EXTENTS(eh)[eh->eh_entries - 1];
+        kassert(ext->e_start >= SB_INFO(inode->sb)->s_data_start);
+        if (eh->eh_depth > 0) {
+            if ((child_bh = bdev_get_blk(inode->sb->bdev, ext->e_start)) == NULL) {
+                return ERR_NOMEM;
+            }
+            err = free_extent_tree(inode, (struct sfs_extent_header*)child_bh->data, child_bh);
+            bdev_release_blk(child_bh);
+            if (err != ERR_OK || (err = free_data_blocks(inode->sb, ext->e_start, 1)) != ERR_OK) {
+                return err;
+            }
+        } else if ((err = free_data_blocks(inode->sb, ext->e_start, ext->e_len)) != ERR_OK) {
+            return err;
+        }
+        eh->eh_entries--;
+        if (bh != NULL) {
+            bdev_set_blk_dirty(bh, True);
+            jbd_write_blk(BH_JOURNAL(bh), bh);
+        }
+    }
+    return ERR_OK;
+}
+
+static err_t
+get_file_block(struct inode *inode, blk_t lblk, struct blk_header **bh, int alloc)
+{
+    struct sfs_extent ext;
+    struct blk_header *inode_bh;
+    blk_t blk, goal;
+    err_t err;
+
+    if ((err = lookup_extent(inode, lblk, &ext)) == ERR_OK) {
+        blk = ext.e_start + (lblk - ext.e_lblk);
+    } else {
+        // Data block has not been allocated before -- allocate one.
+        if (err != ERR_NOTEXIST || !alloc) {
+            return err;
+        }
+        // Acquire reference to the disk inode in case we need to update it.
+        if ((inode_bh = ACQUIRE_INODE_BH(inode)) == NULL) {
+            return ERR_NOMEM;
+        }
+        // Place the block right after the previous block of the file, or at
+        // the reservation window otherwise
+        goal = INODE_INFO(inode)->i_rsv.r_start;
+        if (lblk > 0 && lookup_extent(inode, lblk - 1, &ext) == ERR_OK) {
+            goal = ext.e_start + (lblk - ext.e_lblk);
+        }
+        if ((err = alloc_data_block(inode->sb, goal, &INODE_INFO(inode)->i_rsv, &blk)) == ERR_OK &&
+            (err = insert_extent(inode, lblk, blk)) != ERR_OK) {
+            free_data_blocks(inode->sb, blk, 1);
+        }
+        bdev_release_blk_unlocked(inode_bh);
+        if (err != ERR_OK) {
+            return err;
+        }
+    }
+
+    kassert(blk > 0);
+    // Now read the data block.
+    if ((*bh = bdev_get_blk(inode->sb->bdev, blk)) == NULL) {
+        // Do not roll back data block allocation. sfs_delete_inode will free
+        // it correctly.
+        return ERR_NOMEM;
+    }
+    return ERR_OK;
+}
+
+static err_t
+get_data_block(struct inode *inode, offset_t ofs, struct blk_header **bh, int alloc)
+{
+    kassert(ofs < SFS_MAX_FILE_SIZE);
+    return get_file_block(inode, ofs / BDEV_BLK_SIZE, bh, alloc);
+}
+
 static ssize_t
 read_data(struct inode *inode, void *buf, size_t count, offset_t ofs)
 {
@@ -841,7 +2053,7 @@ write_data(struct inode *inode, const void *buf, size_t count, offset_t ofs)
     kassert(buf);
 
     src_buf = (uint8_t*)buf;
-    for (total = 0; total < count; ofs += s, src_buf += s, total += s) {
+    for (total = 0; total < count && ofs < SFS_MAX_FILE_SIZE; ofs += s, src_buf += s, total += s) {
         // Allocate new data block if not exist
         if (get_data_block(inode, ofs, &bh, True) != ERR_OK) {
             break;
@@ -887,6 +2099,9 @@ sfs_get_sb(struct bdev *bdev, struct fs_type *fs_type)
     info->s_data_bmap_start = sfs_sb->s_data_bmap_start;
     info->s_journal_start = sfs_sb->s_journal_start;
     info->s_data_start = sfs_sb->s_data_start;
+    info->s_alloc_goal = info->s_data_start;
+    list_init(&info->s_rsv_list);
+    spinlock_init(&info->s_rsv_lock);
     if ((info->journal = jbd_alloc_journal(sb)) == NULL) {
         goto fail;
     }
@@ -895,6 +2110,10 @@ sfs_get_sb(struct bdev *bdev, struct fs_type *fs_type)
     sb->s_fs_info = info;
     sb->s_ops = &sfs_super_operations;
     bdev_release_blk(bh);
+    if (count_free_blocks(bdev, info) != ERR_OK) {
+        jbd_free_journal(info->journal);
+        goto fail;
+    }
     return sb;
 
 fail:
@@ -910,6 +2129,7 @@ fail:
 static void
 sfs_free_sb(struct super_block *sb)
 {
+    kfree(SB_INFO(sb)->s_bmap_free);
     kmem_cache_free(sfs_sb_allocator, sb->s_fs_info);
     fs_free_sb(sb);
 }
@@ -983,6 +2203,7 @@ sfs_alloc_inode(struct super_block *sb)
 static void
 sfs_free_inode(struct inode *inode)
 {
+    rsv_set(inode->sb, &INODE_INFO(inode)->i_rsv, 0, 0);
     kmem_cache_free(sfs_inode_allocator, inode->i_fs_info);
     fs_free_inode(inode);
 }
@@ -1007,7 +2228,9 @@ sfs_read_inode(struct inode *inode)
     inode->i_mode = sfs_inode->i_mode;
     inode->i_nlink = sfs_inode->i_nlink;
     inode->i_size = sfs_inode->i_size;
-    memmove(INODE_INFO(inode)->i_addrs, sfs_inode->i_addrs, sizeof(INODE_INFO(inode)->i_addrs));
+    INODE_INFO(inode)->i_eh = sfs_inode->i_eh;
+    memmove(INODE_INFO(inode)->i_extents, sfs_inode->i_extents, sizeof(INODE_INFO(inode)->i_extents));
+    INODE_INFO(inode)->i_cache.e_len = 0;
     fs_set_inode_valid(inode, True);
     bdev_release_blk(bh);
 
@@ -1033,7 +2256,8 @@ sfs_write_inode(struct inode *inode)
     sfs_inode->i_mode = inode->i_mode;
     sfs_inode->i_nlink = inode->i_nlink;
     sfs_inode->i_size = inode->i_size;
-    memmove(sfs_inode->i_addrs, INODE_INFO(inode)->i_addrs, sizeof(sfs_inode->i_addrs));
+    sfs_inode->i_eh = INODE_INFO(inode)->i_eh;
+    memmove(sfs_inode->i_extents, INODE_INFO(inode)->i_extents, sizeof(sfs_inode->i_extents));
     bdev_set_blk_dirty(bh, True);
     jbd_write_blk(BH_JOURNAL(bh), bh);
     fs_set_inode_dirty(inode, False);
@@ -1045,54 +2269,18 @@ sfs_write_inode(struct inode *inode)
 static err_t
 sfs_delete_inode(struct inode *inode)
 {
-    size_t size;
-    int index, indir_index, is_journaled;
-    blk_t blk;
-    struct blk_header *bh;
     err_t err;
 
     kassert(inode->i_inum > 0);
     kassert(inode->i_nlink == 0);
 
-    // Free all data blocks
-    for (size = 0, index = 0; size < inode->i_size; index++) {
-        blk = INODE_INFO(inode)->i_addrs[index];
-        if (blk == 0) {
-            // Already freed
-            continue;
-        }
-        kassert(blk >= SB_INFO(inode->sb)->s_data_start);
-        if (index < SFS_NDIRECT) {
-            // Direct block
-            size += BDEV_BLK_SIZE;
-        } else {
-            // Indirect block
-            if ((bh = bdev_get_blk(inode->sb->bdev, blk)) == NULL) {
-                return ERR_NOMEM;
-            }
-            for (indir_index = 0, is_journaled = False; size < inode->i_size; indir_index++, size += BDEV_BLK_SIZE) {
-                if (((blk_t*)bh->data)[indir_index] == 0) {
-                    // Already freed
-                    continue;
-                }
-                kassert(((blk_t*)bh->data)[indir_index] >= SB_INFO(inode->sb)->s_data_start);
-                if ((err = free_data_block(inode->sb, ((blk_t*)bh->data)[indir_index])) != ERR_OK) {
-                    return err;
-                }
-                ((blk_t*)bh->data)[indir_index] = 0;
-                if (!is_journaled) {
-                    bdev_set_blk_dirty(bh, True);
-                    jbd_write_blk(BH_JOURNAL(bh), bh);
-                    is_journaled = True;
-                }
-            }
-            bdev_release_blk(bh);
-        }
-        if ((err = free_data_block(inode->sb, blk)) != ERR_OK) {
-            return err;
-        }
-        INODE_INFO(inode)->i_addrs[index] = 0;
+    // Free all data blocks and extent tree blocks
+    if ((err = free_extent_tree(inode, &INODE_INFO(inode)->i_eh, NULL)) != ERR_OK) {
+        return err;
     }
+    INODE_INFO(inode)->i_eh.eh_depth = 0;
+    INODE_INFO(inode)->i_cache.e_len = 0;
+    rsv_set(inode->sb, &INODE_INFO(inode)->i_rsv, 0, 0);
 
     // Free the on-disk inode
     if ((err = free_disk_inode(inode->sb, inode->i_inum)) != ERR_OK) {
@@ -1141,12 +2329,17 @@ static err_t
 sfs_fillpage(struct inode *inode, offset_t ofs, struct page *page)
 {
     void *buf;
+    ssize_t rs;
 
     kassert(inode);
     buf = (void*)kmap_p2v(page_to_paddr(page));
-    if (read_data(inode, buf, pg_size, ofs) < pg_size) {
+    rs = read_data(inode, buf, pg_size, ofs);
+    // Only a short read that stops before end of file is an error, the part
+    // of the page past end of file reads as zeros.
+    if (rs < pg_size && ofs + rs < inode->i_size) {
         return ERR_INCOMP;
     }
+    memset((uint8_t*)buf + rs, 0, pg_size - rs);
     return ERR_OK;
 }
 
@@ -1189,27 +2382,57 @@ sfs_unlink(struct inode *dir, const char *name)
 static ssize_t
 sfs_read(struct file *file, void *buf, size_t count, offset_t *ofs)
 {
-    ssize_t rs;
+    ssize_t total, rs, s;
+    void *bounce;
 
-    sleeplock_acquire(&file->f_inode->i_lock);
-    if ((rs = read_data(file->f_inode, buf, count, *ofs)) > 0) {
-        *ofs += rs;
+    // buf may be an unfaulted mapping of this file, whose fillpage needs
+    // i_lock. Copy through a kernel buffer so i_lock is never held across a
+    // fault on buf.
+    if ((bounce = kmalloc(SFS_BOUNCE_SIZE)) == NULL) {
+        return ERR_NOMEM;
+    }
+    for (total = 0; total < count; total += rs) {
+        s = min(count - total, SFS_BOUNCE_SIZE);
+        sleeplock_acquire(&file->f_inode->i_lock);
+        if ((rs = read_data(file->f_inode, bounce, s, *ofs)) > 0) {
+            *ofs += rs;
+        }
+        sleeplock_release(&file->f_inode->i_lock);
+        memmove((uint8_t*)buf + total, bounce, rs);
+        if (rs < s) {
+            total += rs;
+            break;
+        }
     }
-    sleeplock_release(&file->f_inode->i_lock);
-    return rs;
+    kfree(bounce);
+    return total;
 }
 
 static ssize_t
 sfs_write(struct file *file, const void *buf, size_t count, offset_t *ofs)
 {
-    ssize_t ws;
+    ssize_t total, ws, s;
+    void *bounce;
 
-    sleeplock_acquire(&file->f_inode->i_lock);
-    if ((ws = write_data(file->f_inode, buf, count, *ofs)) > 0) {
-        *ofs += ws;
+    // Same as sfs_read, buf may fault into this file's fillpage
+    if ((bounce = kmalloc(SFS_BOUNCE_SIZE)) == NULL) {
+        return ERR_NOMEM;
     }
-    sleeplock_release(&file->f_inode->i_lock);
-    return ws;
+    for (total = 0; total < count; total += ws) {
+        s = min(count - total, SFS_BOUNCE_SIZE);
+        memmove(bounce, (const uint8_t*)buf + total, s);
+        sleeplock_acquire(&file->f_inode->i_lock);
+        if ((ws = write_data(file->f_inode, bounce, s, *ofs)) > 0) {
+            *ofs += ws;
+        }
+        sleeplock_release(&file->f_inode->i_lock);
+        if (ws < s) {
+            total += ws;
+            break;
+        }
+    }
+    kfree(bounce);
+    return total;
 }
 
 static err_t
@@ -1,4 +1,5 @@
 #include <kernel/vm.h>
+#include <kernel/list.h>
 #include <kernel/pmem.h>
 #include <kernel/vpmap.h>
 #include <kernel/shmms.h>
@@ -14,10 +15,40 @@
 static err_t fillpage(struct memstore *store, offset_t ofs, struct page *page);
 
 /*
- * Shared memory memstore write function.
+ * Shared memory memstore write function. Shared memory has no backing storage,
+ * the store is unevictable so the page cache never calls it.
  */
 static err_t write(struct memstore *store, paddr_t paddr, offset_t ofs);
 
+/*
+ * Shared memory memstore reference functions.
+ */
+static void ref(struct memstore *store);
+static void unref(struct memstore *store);
+
+/*
+ * Find the named segment called name. shm_lock must be held.
+ */
+static struct memstore *shm_find(const char *name);
+
+static struct kmem_cache *shmms_allocator = NULL;
+
+/*
+ * Named segments. A named segment's reference count only drops to 0 with
+ * shm_lock held, at which point it is removed from shm_segments, so a lookup
+ * can't hand out a segment that is being freed.
+ */
+static List shm_segments;
+static struct spinlock shm_lock;
+
+struct shmms_info {
+    int ref;                    // number of references (mappings) to the store
+    size_t size;                // size of the shared memory in bytes
+    bool named;                 // is the store a named segment in shm_segments
+    struct memstore *store;     // store this info belongs to, set for named segments
+    char name[SHM_NAME_LEN];    // name of the segment
+    Node node;                  // list node for shm_segments
+};
 
 static err_t
 fillpage(struct memstore *store, offset_t ofs, struct page *page)
@@ -33,26 +64,148 @@ fillpage(struct memstore *store, offset_t ofs, struct page *page)
 static err_t
 write(struct memstore *store, paddr_t paddr, offset_t ofs)
 {
-    // TODO
-    return ERR_OK;
+    panic("shmms: shared memory page written back");
+}
+
+static void
+ref(struct memstore *store)
+{
+    kassert(store && store->info);
+    __sync_add_and_fetch(&((struct shmms_info*)store->info)->ref, 1);
+}
+
+static void
+unref(struct memstore *store)
+{
+    struct shmms_info *info;
+    int ref;
+
+    kassert(store && store->info);
+    info = (struct shmms_info*)store->info;
+    if (info->named) {
+        spinlock_acquire(&shm_lock);
+        if ((ref = __sync_sub_and_fetch(&info->ref, 1)) == 0) {
+            list_remove(&info->node);
+        }
+        spinlock_release(&shm_lock);
+    } else {
+        ref = __sync_sub_and_fetch(&info->ref, 1);
+    }
+    if (ref == 0) {
+        sleeplock_acquire(&store->pgcache_lock);
+        pgcache_remove_pages(store);
+        sleeplock_release(&store->pgcache_lock);
+        shmms_free(store);
+    }
 }
 
 struct memstore*
-shmms_alloc(void)
+shmms_alloc(size_t size)
 {
     struct memstore *store;
+    struct shmms_info *info;
 
     if ((store = memstore_alloc()) != NULL) {
-        // TODO: initialize shared memory specific metadata
-        store->fillpage = fillpage;
-        store->write = write;
+        if ((info = kmem_cache_alloc(shmms_allocator)) != NULL) {
+            info->ref = 0;
+            info->size = size;
+            info->named = False;
+            store->info = info;
+            store->fillpage = fillpage;
+            store->write = write;
+            store->ref = ref;
+            store->unref = unref;
+            store->unevictable = True;
+        } else {
+            memstore_free(store);
+            store = NULL;
+        }
+    }
+    return store;
+}
+
+static struct memstore*
+shm_find(const char *name)
+{
+    for (Node *n = list_begin(&shm_segments); n != list_end(&shm_segments); n = list_next(n)) {
+        struct shmms_info *info = list_entry(n, struct shmms_info, node);
+        if (strcmp(info->name, name) == 0) {
+            return info->store;
+        }
     }
+    return NULL;
+}
+
+void
+shmms_init(void)
+{
+    kassert((shmms_allocator = kmem_cache_create(sizeof(struct shmms_info))) != NULL);
+    list_init(&shm_segments);
+    spinlock_init(&shm_lock);
+}
+
+err_t
+shmms_create(const char *name, size_t size, struct memstore **store)
+{
+    struct shmms_info *info;
+    struct memstore *s;
+
+    kassert(name && store);
+    if ((s = shmms_alloc(size)) == NULL) {
+        return ERR_NOMEM;
+    }
+    info = (struct shmms_info*)s->info;
+    info->store = s;
+    info->named = True;
+    // the caller's reference
+    info->ref = 1;
+    strncpy(info->name, name, SHM_NAME_LEN);
+    info->name[SHM_NAME_LEN - 1] = 0;
+
+    spinlock_acquire(&shm_lock);
+    if (shm_find(info->name) != NULL) {
+        spinlock_release(&shm_lock);
+        shmms_free(s);
+        return ERR_EXIST;
+    }
+    list_append(&shm_segments, &info->node);
+    spinlock_release(&shm_lock);
+    *store = s;
+    return ERR_OK;
+}
+
+struct memstore*
+shmms_lookup(const char *name)
+{
+    struct memstore *store;
+
+    kassert(name);
+    spinlock_acquire(&shm_lock);
+    if ((store = shm_find(name)) != NULL) {
+        __sync_add_and_fetch(&((struct shmms_info*)store->info)->ref, 1);
+    }
+    spinlock_release(&shm_lock);
     return store;
 }
 
+bool
+shmms_is_segment(struct memstore *store)
+{
+    return store && store->fillpage == fillpage && ((struct shmms_info*)store->info)->named;
+}
+
+size_t
+shmms_size(struct memstore *store)
+{
+    kassert(store && store->fillpage == fillpage);
+    return ((struct shmms_info*)store->info)->size;
+}
+
 void
 shmms_free(struct memstore *store)
 {
     kassert(store);
+    kassert(store->info);
+    kmem_cache_free(shmms_allocator, store->info);
     memstore_free(store);
 }
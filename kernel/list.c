@@ -52,6 +52,16 @@ list_append_ordered(List *list, Node *node, comparator *compare, void *aux)
     list_append(list, node);
 }
 
+void
+list_insert(Node *before, Node *node)
+{
+    kassert(before && node);
+    node->prev = before->prev;
+    node->next = before;
+    before->prev->next = node;
+    before->prev = node;
+}
+
 Node*
 list_remove(Node* node)
 {
@@ -8,7 +8,10 @@
 #include <kernel/sched.h>
 #include <kernel/trap.h>
 #include <kernel/bdev.h>
+#include <kernel/pgcache.h>
 #include <kernel/fs.h>
+#include <kernel/shmms.h>
+#include <kernel/swap.h>
 #include <kernel/vpmap.h>
 #include <kernel/pmem.h>
 #include <lib/errcode.h>
@@ -18,8 +21,11 @@ int kernel_init(void *args);
 int
 kernel_init(void *args)
 {
+    pgcache_init();
     bdev_init();
     fs_init();
+    shmms_init();
+    swap_init();
     mp_start_ap();
     kprintf("OSV initialization...Done\n\n");
 
@@ -38,6 +44,8 @@ main(void)
     // thread needs to be initialized before other sub systems can use locks
     thread_sys_init();
     synch_init();
+    pmem_pcp_init();
+    kmalloc_mag_init();
     proc_sys_init();
     trap_sys_init();
     console_init();
@@ -50,7 +58,10 @@ main(void)
     struct thread *t = thread_create("init/testing thread", NULL, DEFAULT_PRI);
     kassert(t);
     thread_start_context(t, kernel_init, NULL);
-    for (;;) { }
+    // idle: zero pages while there's nothing to run
+    for (;;) {
+        pmem_zero_idle();
+    }
 }
 
 // Other CPUs jump here from entry_ap.S.
@@ -61,5 +72,8 @@ main_ap(void)
     arch_init_ap();
     // start scheduling: create an idle thread for this cpu and turn on interrupt
     sched_start_ap();
-    for (;;) { } // loop bc we are idle
+    // loop bc we are idle, zero pages while there's nothing to run
+    for (;;) {
+        pmem_zero_idle();
+    }
 }
@@ -3,6 +3,8 @@
 #include <kernel/vpmap.h>
 #include <kernel/console.h>
 #include <kernel/util.h>
+#include <kernel/trap.h>
+#include <kernel/thread.h>
 #include <lib/string.h>
 #include <lib/errcode.h>
 #include <lib/stddef.h>
@@ -12,6 +14,15 @@
  * allocator dynamically allocates slabs to store fixed-size objects.
  * Each slab is divided into object-sized slots, and a linked list is used to
  * track free slots. The linked list is stored in the beginning of the slab.
+ *
+ * In front of the slabs, each cpu caches recently freed objects in magazines
+ * [Bonwick & Adams]. A cpu has a loaded and a previous magazine, and only
+ * goes to the cache's depot of full and empty magazines (under the cache
+ * lock) when both are exhausted, so most alloc/free pairs stay on the cpu.
+ *
+ * A cache keeps at most MAX_EMPTY_SLABS empty slabs, further slabs are given
+ * back to pmem as soon as they empty out. Under memory pressure pmem calls
+ * kmem_shrink, which flushes the magazine depots and frees all empty slabs.
  */
 
 /*
@@ -19,6 +30,20 @@
  */
 static struct kmem_cache allocator_cache;
 
+/*
+ * Allocator for magazines. It does not use magazines itself.
+ */
+static struct kmem_cache *magazine_cache;
+static bool mag_enabled;
+
+/*
+ * All object allocators, for the shrinker.
+ */
+#define MAX_EMPTY_SLABS 2
+static struct spinlock kmem_caches_lock;
+static List kmem_caches;
+static struct shrinker kmem_shrinker;
+
 /*
  * kmalloc allocators
  */
@@ -60,6 +85,58 @@ static void slab_destroy(struct slab *slab);
  */
 static void slab_list_destroy(List *list);
 
+/*
+ * Initialize an object allocator.
+ */
+static void kmem_cache_init(struct kmem_cache *kmem_cache, size_t size);
+
+/*
+ * Allocate an object from/free an object to the slabs of an allocator.
+ *
+ * Precondition:
+ * Caller must hold kmem_cache->lock.
+ */
+static void *slab_alloc_obj(struct kmem_cache *kmem_cache);
+static void slab_free_obj(struct kmem_cache *kmem_cache, void *obj);
+
+/*
+ * Allocate an object from/free an object to the current cpu's magazines.
+ * Return NULL/False if the magazine layer can't serve the request and the
+ * caller has to go to the slabs.
+ *
+ * Precondition:
+ * Interrupts must be off.
+ */
+static void *mag_alloc(struct kmem_cache *kmem_cache);
+static bool mag_free(struct kmem_cache *kmem_cache, void *obj);
+
+/*
+ * Return all objects in a magazine to the slabs and free the magazine.
+ *
+ * Precondition:
+ * Caller must hold kmem_cache->lock.
+ */
+static void mag_destroy(struct kmem_cache *kmem_cache, struct magazine *mag);
+
+/*
+ * Destroy all magazines in the linked list.
+ *
+ * Precondition:
+ * Caller must hold kmem_cache->lock.
+ */
+static void mag_list_destroy(struct kmem_cache *kmem_cache, List *list);
+
+/*
+ * Shrinker for all object allocators. Only try-acquires locks, since pmem may
+ * call it while an allocator lock is held by the allocating thread.
+ */
+static size_t kmem_shrink(struct shrinker *shrinker);
+
+/*
+ * Try to acquire an allocator lock that the current thread may already hold.
+ */
+static err_t kmem_try_lock(struct spinlock *lock);
+
 static struct slab*
 slab_create(struct kmem_cache *kmem_cache)
 {
@@ -87,6 +164,7 @@ slab_create(struct kmem_cache *kmem_cache)
     kassert(slab);
     slab->objs = &SLAB_FREEARR(slab)[n_objs]; // objects placed after free index array
     slab->free = 0;
+    slab->n_used = 0;
     slab->n_pages = n_pages;
 
     // Link allocator and slab into each allocated page's page structure. The
@@ -105,7 +183,8 @@ slab_create(struct kmem_cache *kmem_cache)
     SLAB_FREEARR(slab)[n_objs - 1] = -1; // end marker
 
     // Add slab to the allocator
-    list_append(&kmem_cache->free, &slab->node);
+    list_append(&kmem_cache->empty, &slab->node);
+    kmem_cache->n_empty++;
 
     return slab;
 }
@@ -131,16 +210,255 @@ slab_list_destroy(List *list)
     }
 }
 
+static void
+kmem_cache_init(struct kmem_cache *kmem_cache, size_t size)
+{
+    list_init(&kmem_cache->full);
+    list_init(&kmem_cache->free);
+    list_init(&kmem_cache->empty);
+    kmem_cache->n_empty = 0;
+    list_init(&kmem_cache->full_mags);
+    list_init(&kmem_cache->empty_mags);
+    spinlock_init(&kmem_cache->lock);
+    kmem_cache->obj_size = size;
+    memset(kmem_cache->cpu_caches, 0, sizeof(kmem_cache->cpu_caches));
+
+    spinlock_acquire(&kmem_caches_lock);
+    list_append(&kmem_caches, &kmem_cache->node);
+    spinlock_release(&kmem_caches_lock);
+}
+
+static void*
+slab_alloc_obj(struct kmem_cache *kmem_cache)
+{
+    struct slab *slab;
+    void *obj;
+
+    // Find a slab that still have free slots, preferring partially allocated
+    // slabs so empty ones can be reclaimed. Allocate a new slab if no free
+    // slab is found.
+    if (!list_empty(&kmem_cache->free)) {
+        slab = list_entry(list_begin(&kmem_cache->free), struct slab, node);
+    } else {
+        if (list_empty(&kmem_cache->empty) && slab_create(kmem_cache) == NULL) {
+            return NULL;
+        }
+        slab = list_entry(list_begin(&kmem_cache->empty), struct slab, node);
+        list_remove(&slab->node);
+        list_append(&kmem_cache->free, &slab->node);
+        kmem_cache->n_empty--;
+    }
+
+    // Allocate an object from the slab.
+    kassert(slab);
+    kassert(slab->free != -1);
+    obj = (void*)((vaddr_t)slab->objs + kmem_cache->obj_size * slab->free);
+    slab->free = SLAB_FREEARR(slab)[slab->free];
+    slab->n_used++;
+
+    if (slab->free == -1) {
+        // slab is full
+        list_remove(&slab->node);
+        list_append(&kmem_cache->full, &slab->node);
+    }
+    return obj;
+}
+
+static void
+slab_free_obj(struct kmem_cache *kmem_cache, void *obj)
+{
+    struct slab *slab;
+    struct page *page;
+    paddr_t paddr;
+    int index, full;
+
+    // Find the slab the object belongs to
+    paddr = kmap_v2p((vaddr_t)obj);
+    page = paddr_to_page(paddr);
+    kassert(page);
+    slab = page->slab;
+    kassert(slab);
+    full = slab->free == -1;
+
+    // Add object to the free list
+    index = ((vaddr_t)obj - (vaddr_t)slab->objs) / kmem_cache->obj_size;
+    SLAB_FREEARR(slab)[index] = slab->free;
+    slab->free = index;
+    slab->n_used--;
+
+    if (slab->n_used == 0) {
+        // Slab is empty, keep a few around for future allocations
+        list_remove(&slab->node);
+        if (kmem_cache->n_empty < MAX_EMPTY_SLABS) {
+            list_append(&kmem_cache->empty, &slab->node);
+            kmem_cache->n_empty++;
+        } else {
+            slab_destroy(slab);
+        }
+    } else if (full) {
+        // If slab was full, move it to the free slabs list
+        list_remove(&slab->node);
+        list_append(&kmem_cache->free, &slab->node);
+    }
+}
+
+static void*
+mag_alloc(struct kmem_cache *kmem_cache)
+{
+    struct kmem_cpu_cache *cc;
+    struct magazine *mag;
+
+    cc = &kmem_cache->cpu_caches[cpu_id(mycpu())];
+    if (cc->loaded == NULL || cc->loaded->rounds == 0) {
+        if (cc->prev != NULL && cc->prev->rounds > 0) {
+            // previous magazine is full, swap it in
+            mag = cc->loaded;
+            cc->loaded = cc->prev;
+            cc->prev = mag;
+        } else {
+            // exchange the empty previous magazine for a full one from the depot
+            spinlock_acquire(&kmem_cache->lock);
+            if (list_empty(&kmem_cache->full_mags)) {
+                spinlock_release(&kmem_cache->lock);
+                return NULL;
+            }
+            if (cc->prev != NULL) {
+                list_append(&kmem_cache->empty_mags, &cc->prev->node);
+            }
+            cc->prev = cc->loaded;
+            cc->loaded = list_entry(list_remove(list_begin(&kmem_cache->full_mags)), struct magazine, node);
+            spinlock_release(&kmem_cache->lock);
+        }
+    }
+    return cc->loaded->objs[--cc->loaded->rounds];
+}
+
+static bool
+mag_free(struct kmem_cache *kmem_cache, void *obj)
+{
+    struct kmem_cpu_cache *cc;
+    struct magazine *mag;
+
+    cc = &kmem_cache->cpu_caches[cpu_id(mycpu())];
+    if (cc->loaded == NULL || cc->loaded->rounds == MAG_SIZE) {
+        if (cc->prev != NULL && cc->prev->rounds == 0) {
+            // previous magazine is empty, swap it in
+            mag = cc->loaded;
+            cc->loaded = cc->prev;
+            cc->prev = mag;
+        } else {
+            // exchange the full previous magazine for an empty one from the depot
+            spinlock_acquire(&kmem_cache->lock);
+            if (!list_empty(&kmem_cache->empty_mags)) {
+                mag = list_entry(list_remove(list_begin(&kmem_cache->empty_mags)), struct magazine, node);
+            } else if ((mag = kmem_cache_alloc(magazine_cache)) != NULL) {
+                mag->rounds = 0;
+            } else {
+                spinlock_release(&kmem_cache->lock);
+                return False;
+            }
+            if (cc->prev != NULL) {
+                list_append(&kmem_cache->full_mags, &cc->prev->node);
+            }
+            cc->prev = cc->loaded;
+            cc->loaded = mag;
+            spinlock_release(&kmem_cache->lock);
+        }
+    }
+    cc->loaded->objs[cc->loaded->rounds++] = obj;
+    return True;
+}
+
+static void
+mag_destroy(struct kmem_cache *kmem_cache, struct magazine *mag)
+{
+    while (mag->rounds > 0) {
+        slab_free_obj(kmem_cache, mag->objs[--mag->rounds]);
+    }
+    kmem_cache_free(magazine_cache, mag);
+}
+
+static void
+mag_list_destroy(struct kmem_cache *kmem_cache, List *list)
+{
+    while (!list_empty(list)) {
+        mag_destroy(kmem_cache, list_entry(list_remove(list_begin(list)), struct magazine, node));
+    }
+}
+
+static err_t
+kmem_try_lock(struct spinlock *lock)
+{
+    if (lock->holder != NULL && lock->holder == thread_current()) {
+        return ERR_LOCK_BUSY;
+    }
+    return spinlock_try_acquire(lock);
+}
+
+static size_t
+kmem_shrink(struct shrinker *shrinker)
+{
+    struct kmem_cache *kmem_cache;
+    struct slab *slab;
+    bool mags;
+    size_t freed = 0;
+
+    if (kmem_try_lock(&kmem_caches_lock) != ERR_OK) {
+        return 0;
+    }
+    // freeing magazines takes magazine_cache's lock, only flush the depots
+    // if we can get it
+    mags = magazine_cache != NULL && kmem_try_lock(&magazine_cache->lock) == ERR_OK;
+    for (Node *n = list_begin(&kmem_caches); n != list_end(&kmem_caches); n = list_next(n)) {
+        kmem_cache = list_entry(n, struct kmem_cache, node);
+        if (kmem_cache == magazine_cache || kmem_try_lock(&kmem_cache->lock) != ERR_OK) {
+            continue;
+        }
+        if (mags) {
+            // Return depot objects to their slabs, magazines go straight
+            // back to magazine_cache's slabs since we hold its lock
+            List *lists[] = { &kmem_cache->full_mags, &kmem_cache->empty_mags };
+            for (int i = 0; i < N_ELEM(lists); i++) {
+                while (!list_empty(lists[i])) {
+                    struct magazine *mag = list_entry(list_remove(list_begin(lists[i])), struct magazine, node);
+                    while (mag->rounds > 0) {
+                        slab_free_obj(kmem_cache, mag->objs[--mag->rounds]);
+                    }
+                    slab_free_obj(magazine_cache, mag);
+                }
+            }
+        }
+        while (!list_empty(&kmem_cache->empty)) {
+            slab = list_entry(list_remove(list_begin(&kmem_cache->empty)), struct slab, node);
+            freed += slab->n_pages;
+            slab_destroy(slab);
+        }
+        kmem_cache->n_empty = 0;
+        spinlock_release(&kmem_cache->lock);
+    }
+    if (mags) {
+        while (!list_empty(&magazine_cache->empty)) {
+            slab = list_entry(list_remove(list_begin(&magazine_cache->empty)), struct slab, node);
+            freed += slab->n_pages;
+            slab_destroy(slab);
+        }
+        magazine_cache->n_empty = 0;
+        spinlock_release(&magazine_cache->lock);
+    }
+    spinlock_release(&kmem_caches_lock);
+    return freed;
+}
+
 void
 kmalloc_init(void)
 {
     struct kmalloc_allocator *ka;
 
+    spinlock_init(&kmem_caches_lock);
+    list_init(&kmem_caches);
+
     // Initialize allocator cache
-    list_init(&allocator_cache.full);
-    list_init(&allocator_cache.free);
-    spinlock_init(&allocator_cache.lock);
-    allocator_cache.obj_size = sizeof(struct kmem_cache);
+    kmem_cache_init(&allocator_cache, sizeof(struct kmem_cache));
 
     // Initialize kmalloc allocators
     for (ka = kmalloc_allocators; ka < &kmalloc_allocators[N_ELEM(kmalloc_allocators)]; ka++) {
@@ -148,6 +466,18 @@ kmalloc_init(void)
             panic("Failed to allocate kmalloc allocator");
         }
     }
+
+    kmem_shrinker.shrink = kmem_shrink;
+    pmem_register_shrinker(&kmem_shrinker);
+}
+
+void
+kmalloc_mag_init(void)
+{
+    if ((magazine_cache = kmem_cache_create(sizeof(struct magazine))) == NULL) {
+        panic("Failed to allocate magazine allocator");
+    }
+    mag_enabled = True;
 }
 
 struct kmem_cache*
@@ -158,23 +488,41 @@ kmem_cache_create(size_t size)
     if ((kmem_cache = kmem_cache_alloc(&allocator_cache)) == NULL) {
         return NULL;
     }
-
-    list_init(&kmem_cache->full);
-    list_init(&kmem_cache->free);
-    spinlock_init(&kmem_cache->lock);
-    kmem_cache->obj_size = size;
-
+    kmem_cache_init(kmem_cache, size);
     return kmem_cache;
 }
 
 void
 kmem_cache_destroy(struct kmem_cache *kmem_cache)
 {
+    struct kmem_cpu_cache *cc;
+
     kassert(kmem_cache);
 
+    spinlock_acquire(&kmem_caches_lock);
+    list_remove(&kmem_cache->node);
+    spinlock_release(&kmem_caches_lock);
+
+    // Return all cached objects to their slabs, the cache must no longer be
+    // in use on any cpu
+    spinlock_acquire(&kmem_cache->lock);
+    for (cc = kmem_cache->cpu_caches; cc < &kmem_cache->cpu_caches[MAX_NCPU]; cc++) {
+        if (cc->loaded != NULL) {
+            mag_destroy(kmem_cache, cc->loaded);
+        }
+        if (cc->prev != NULL) {
+            mag_destroy(kmem_cache, cc->prev);
+        }
+        cc->loaded = cc->prev = NULL;
+    }
+    mag_list_destroy(kmem_cache, &kmem_cache->full_mags);
+    mag_list_destroy(kmem_cache, &kmem_cache->empty_mags);
+    spinlock_release(&kmem_cache->lock);
+
     // Destroy all slabs
     slab_list_destroy(&kmem_cache->free);
     slab_list_destroy(&kmem_cache->full);
+    slab_list_destroy(&kmem_cache->empty);
 
     // Free the object allocator
     kmem_cache_free(&allocator_cache, kmem_cache);
@@ -183,88 +531,66 @@ kmem_cache_destroy(struct kmem_cache *kmem_cache)
 void*
 kmem_cache_alloc(struct kmem_cache *kmem_cache)
 {
-    struct slab *slab;
-    void *obj;
+    void *obj = NULL;
 
     kassert(kmem_cache);
 
-    spinlock_acquire(&kmem_cache->lock);
-    // Find a slab that still have free slots. Allocate a new slab if no free
-    // slab is found.
-    if (list_empty(&kmem_cache->free)) {
-        if ((slab = slab_create(kmem_cache)) == NULL) {
-            goto fail;
-        }
-    } else {
-        slab = list_entry(list_begin(&kmem_cache->free), struct slab, node);
+    if (mag_enabled && kmem_cache != magazine_cache) {
+        intr_set_level(INTR_OFF);
+        obj = mag_alloc(kmem_cache);
+        intr_set_level(INTR_ON);
     }
-
-    // Allocate an object from the slab.
-    kassert(slab);
-    kassert(slab->free != -1);
-    obj = (void*)((vaddr_t)slab->objs + kmem_cache->obj_size * slab->free);
-    slab->free = SLAB_FREEARR(slab)[slab->free];
-
-    if (slab->free == -1) {
-        // slab is full
-        list_remove(&slab->node);
-        list_append(&kmem_cache->full, &slab->node);
+    if (obj == NULL) {
+        spinlock_acquire(&kmem_cache->lock);
+        obj = slab_alloc_obj(kmem_cache);
+        spinlock_release(&kmem_cache->lock);
+        if (obj == NULL) {
+            return NULL;
+        }
     }
-    spinlock_release(&kmem_cache->lock);
     memset(obj, 0x2b, kmem_cache->obj_size);
     return obj;
-
-fail:
-    spinlock_release(&kmem_cache->lock);
-    return NULL;
 }
 
 void
 kmem_cache_free(struct kmem_cache *kmem_cache, void *obj)
 {
-    struct slab *slab;
-    struct page *page;
-    paddr_t paddr;
-    int index, full;
+    bool cached = False;
 
     kassert(kmem_cache);
 
-    spinlock_acquire(&kmem_cache->lock);
     // memset freed object to 0x2b to detect uses of freed memory
     memset(obj, 0x2b, kmem_cache->obj_size);
-    // Find the slab the object belongs to
-    paddr = kmap_v2p((vaddr_t)obj);
-    page = paddr_to_page(paddr);
-    kassert(page);
-    slab = page->slab;
-    kassert(slab);
-    full = slab->free == -1;
-
-    // Add object to the free list
-    index = ((vaddr_t)obj - (vaddr_t)slab->objs) / kmem_cache->obj_size;
-    SLAB_FREEARR(slab)[index] = slab->free;
-    slab->free = index;
-
-    // If slab was full, move it to the free slabs list
-    if (full) {
-        list_remove(&slab->node);
-        list_append(&kmem_cache->free, &slab->node);
+    if (mag_enabled && kmem_cache != magazine_cache) {
+        intr_set_level(INTR_OFF);
+        cached = mag_free(kmem_cache, obj);
+        intr_set_level(INTR_ON);
+    }
+    if (!cached) {
+        spinlock_acquire(&kmem_cache->lock);
+        slab_free_obj(kmem_cache, obj);
+        spinlock_release(&kmem_cache->lock);
     }
-    spinlock_release(&kmem_cache->lock);
 }
 
 void*
 kmalloc(size_t size)
 {
     struct kmalloc_allocator *alloc;
+    paddr_t paddr;
 
     if (size == 0) {
         return NULL;
     }
 
     if (size > kmalloc_allocators[N_ELEM(kmalloc_allocators) - 1].size) {
-        // We don't have an allocator capable of allocating ``size`` bytes
-        return NULL;
+        // Too big for any allocator, take a block straight from pmem. The
+        // block's order is kept in its first page, and the page is not
+        // linked to a kmem_cache, which is how kfree tells them apart.
+        if (pmem_nalloc(&paddr, pg_round_up(size) / pg_size) != ERR_OK) {
+            return NULL;
+        }
+        return (void*)kmap_p2v(paddr);
     }
 
     // Find kmalloc allocator with a big enough size
@@ -289,7 +615,12 @@ kfree(void *ptr)
     page = paddr_to_page(paddr);
     kassert(page);
     kmem_cache = page->kmem_cache;
-    kassert(kmem_cache);
+    if (kmem_cache == NULL) {
+        // large allocation
+        kassert(pg_aligned(paddr));
+        pmem_nfree(paddr, 1 << page->order);
+        return;
+    }
 
     kmem_cache_free(kmem_cache, ptr);
 }
@@ -20,6 +20,15 @@ memstore_alloc(void)
         rmap_construct(&store->rmap);
         sleeplock_init(&store->pgcache_lock);
         radix_tree_construct(&store->cached_pages);
+        store->ra_next = 0;
+        store->ra_ahead = 0;
+        store->ra_window = 0;
+        store->unevictable = False;
+        store->fillpages = NULL;
+        store->releasepage = NULL;
+        store->size = NULL;
+        store->ref = NULL;
+        store->unref = NULL;
     }
     return store;
 }
@@ -30,6 +39,8 @@ void
 memstore_free(struct memstore *store)
 {
     kassert(store);
+    // pgcache_remove_pages must have dropped the cached pages
+    kassert(radix_tree_empty(&store->cached_pages));
     rmap_destroy(&store->rmap);
     kmem_cache_free(memstore_allocator, store);
 }
@@ -5,43 +5,537 @@
 #include <kernel/radix_tree.h>
 #include <kernel/memstore.h>
 #include <kernel/pmem.h>
+#include <kernel/synch.h>
+#include <kernel/thread.h>
 #include <lib/errcode.h>
+#include <lib/stddef.h>
 
-struct page*
-pgcache_get_page(struct memstore *store, offset_t ofs)
+// Number of pages reclaimed at once when the cache is full
+#define PGCACHE_RECLAIM_BATCH 32
+
+// Readahead window bounds, in pages
+#define RA_MIN_PAGES 4
+#define RA_MAX_PAGES 32
+// Pages the readahead daemon reads at once from stores that implement fillpages
+#define RA_BATCH 8
+
+// LRU list a cached page is on
+#define LRU_NONE 0
+#define LRU_INACTIVE 1
+#define LRU_ACTIVE 2
+
+/*
+ * Global page cache LRU, least recently used pages at the front. Pages are
+ * linked through page->node. A page is only added to or removed from the LRU
+ * with its store's pgcache_lock held, lru_lock orders the list operations.
+ */
+static List lru_inactive;
+static List lru_active;
+static size_t ninactive;
+static size_t nactive;
+static struct spinlock lru_lock;
+
+/*
+ * Readahead requests, served in order by the readahead daemon. A request holds
+ * a reference on its store.
+ */
+struct ra_request {
+    Node node;
+    struct memstore *store;
+    int start;      // first page index to read
+    int npages;     // number of pages to read
+};
+static struct kmem_cache *ra_allocator;
+static List ra_queue;
+static struct spinlock ra_lock;
+static struct condvar ra_cv;
+
+/*
+ * Append a page to the back of an LRU list.
+ *
+ * Precondition:
+ * Caller must hold lru_lock.
+ * The page is not on an LRU list.
+ */
+static void lru_append(struct page *page, int lru);
+
+/*
+ * Remove a page from its LRU list.
+ *
+ * Precondition:
+ * Caller must hold lru_lock.
+ */
+static void lru_del(struct page *page);
+
+/*
+ * Move pages from the front of the active list to the back of the inactive
+ * list until the active list is no larger than the inactive one.
+ *
+ * Precondition:
+ * Caller must hold lru_lock.
+ */
+static void lru_balance(void);
+
+/*
+ * Evict a page from a store's page cache: write it back if it is dirty, let
+ * the store drop its private data, and free the page.
+ *
+ * Precondition:
+ * Caller must hold store->pgcache_lock.
+ * The page is not on an LRU list.
+ *
+ * Return:
+ * ERR_OK - Page evicted and freed.
+ * ERR_LOCK_BUSY - Page is in use.
+ * Other errors - Write back failed.
+ */
+static err_t evict_page(struct memstore *store, struct page *page);
+
+/*
+ * Allocate a page for offset ofs of a store, reclaiming cached pages if the
+ * cache is full or memory runs out. Return NULL if failed to allocate.
+ *
+ * Precondition:
+ * Caller must hold store->pgcache_lock.
+ */
+static struct page *alloc_page(struct memstore *store, offset_t ofs);
+
+/*
+ * Add a filled page to a store's page cache, at the back of the inactive list
+ * unless the store is unevictable. The page is freed if failed to add it.
+ *
+ * Precondition:
+ * Caller must hold store->pgcache_lock.
+ *
+ * Return:
+ * ERR_OK - Page added.
+ * ERR_NOMEM - Failed to allocate memory.
+ */
+static err_t insert_page(struct memstore *store, struct page *page);
+
+/*
+ * Read a page into a store's page cache if it isn't cached yet, without
+ * touching the LRU or readahead state. Return NULL if failed to read the page.
+ *
+ * Precondition:
+ * Caller must hold store->pgcache_lock.
+ */
+static struct page *fill_page(struct memstore *store, offset_t ofs);
+
+/*
+ * Read the pages in [start, start + npages) that aren't cached yet into a
+ * store's page cache, with a single fillpages call if the store implements it
+ * (npages is at most RA_BATCH then). Return False if failed to read any.
+ *
+ * Precondition:
+ * Caller must hold store->pgcache_lock.
+ */
+static bool fill_pages(struct memstore *store, int start, int npages);
+
+/*
+ * Record an access to page index of a store. While accesses stay sequential,
+ * queue reads of a growing window of the following pages, one window ahead of
+ * the reader. Stores without size only have their last accessed page tracked.
+ *
+ * Precondition:
+ * Caller must hold store->pgcache_lock.
+ */
+static void readahead(struct memstore *store, int index);
+
+/*
+ * Readahead daemon thread function.
+ */
+static int ra_daemon(void *aux);
+
+static void
+lru_append(struct page *page, int lru)
+{
+    kassert(page->lru == LRU_NONE);
+    if (lru == LRU_ACTIVE) {
+        list_append(&lru_active, &page->node);
+        nactive++;
+    } else {
+        list_append(&lru_inactive, &page->node);
+        ninactive++;
+    }
+    page->lru = lru;
+}
+
+static void
+lru_del(struct page *page)
+{
+    kassert(page->lru != LRU_NONE);
+    list_remove(&page->node);
+    if (page->lru == LRU_ACTIVE) {
+        nactive--;
+    } else {
+        ninactive--;
+    }
+    page->lru = LRU_NONE;
+}
+
+static void
+lru_balance(void)
 {
     struct page *page;
+
+    while (nactive > ninactive) {
+        page = list_entry(list_begin(&lru_active), struct page, node);
+        lru_del(page);
+        lru_append(page, LRU_INACTIVE);
+    }
+}
+
+static err_t
+evict_page(struct memstore *store, struct page *page)
+{
     paddr_t paddr;
+    err_t err;
 
-    kassert(store);
-    paddr = PADDR_NONE;
+    paddr = page_to_paddr(page);
+    // only the cache's reference is left, and nobody can take another one
+    // without store->pgcache_lock
+    if (pmem_get_refcnt(paddr) != 1) {
+        return ERR_LOCK_BUSY;
+    }
+    sleeplock_acquire(&page->lock);
+    if (pmem_is_page_dirty(page)) {
+        if ((err = store->write(store, paddr, page->ofs)) != ERR_OK) {
+            sleeplock_release(&page->lock);
+            return err;
+        }
+        pmem_set_page_dirty(page, False);
+    }
+    sleeplock_release(&page->lock);
+    if (store->releasepage) {
+        store->releasepage(store, page);
+    }
+    radix_tree_remove(&store->cached_pages, page->ofs / pg_size);
+    page->store = NULL;
+    pmem_dec_refcnt(paddr);
+    return ERR_OK;
+}
+
+static struct page*
+alloc_page(struct memstore *store, offset_t ofs)
+{
+    struct page *page;
+    paddr_t paddr;
 
-    if ((page = radix_tree_lookup(&store->cached_pages, ofs / pg_size)) == NULL) {
-        // Page not found in cache -- allocate a new page, and update the page
-        // with data read from the backing store
-        if (pmem_alloc(&paddr) != ERR_OK) {
+    paddr = PADDR_NONE;
+    // Racy peek, the limit is only a target.
+    if (nactive + ninactive >= PGCACHE_MAX_PAGES) {
+        pgcache_reclaim(store, PGCACHE_RECLAIM_BATCH);
+    }
+    if (pmem_alloc(&paddr) != ERR_OK) {
+        if (pgcache_reclaim(store, PGCACHE_RECLAIM_BATCH) == 0 || pmem_alloc(&paddr) != ERR_OK) {
             return NULL;
         }
-        page = paddr_to_page(paddr);
-        if (store->fillpage(store, ofs, page) != ERR_OK) {
-            pmem_free(paddr);
-            return NULL;
+    }
+    page = paddr_to_page(paddr);
+    page->rmap = &store->rmap;
+    page->ofs = pg_round_down(ofs);
+    page->lru = LRU_NONE;
+    return page;
+}
+
+static err_t
+insert_page(struct memstore *store, struct page *page)
+{
+    switch (radix_tree_insert(&store->cached_pages, page->ofs / pg_size, page)) {
+        case ERR_RADIX_TREE_ALLOC:
+            pmem_free(page_to_paddr(page));
+            return ERR_NOMEM;
+        case ERR_RADIX_TREE_NODE_EXIST:
+            panic("node should not exist");
+    }
+    page->store = store;
+    page->referenced = False;
+    if (store->unevictable) {
+        return ERR_OK;
+    }
+    spinlock_acquire(&lru_lock);
+    lru_append(page, LRU_INACTIVE);
+    spinlock_release(&lru_lock);
+    return ERR_OK;
+}
+
+static struct page*
+fill_page(struct memstore *store, offset_t ofs)
+{
+    struct page *page;
+
+    if ((page = radix_tree_lookup(&store->cached_pages, ofs / pg_size)) != NULL) {
+        return page;
+    }
+
+    // Page not found in cache -- make room if the cache is full, allocate a
+    // new page, and update the page with data read from the backing store.
+    if ((page = alloc_page(store, ofs)) == NULL) {
+        return NULL;
+    }
+    if (store->fillpage(store, ofs, page) != ERR_OK) {
+        pmem_free(page_to_paddr(page));
+        return NULL;
+    }
+    return insert_page(store, page) == ERR_OK ? page : NULL;
+}
+
+static bool
+fill_pages(struct memstore *store, int start, int npages)
+{
+    struct page *pages[RA_BATCH];
+    int i, n;
+    bool ok = True;
+
+    if (store->fillpages == NULL) {
+        for (i = start; i < start + npages; i++) {
+            if (fill_page(store, (offset_t) i * pg_size) == NULL) {
+                return False;
+            }
+        }
+        return True;
+    }
+    kassert(npages <= RA_BATCH);
+    for (i = start, n = 0; i < start + npages; i++) {
+        if (radix_tree_lookup(&store->cached_pages, i) != NULL) {
+            continue;
+        }
+        if ((pages[n] = alloc_page(store, (offset_t) i * pg_size)) == NULL) {
+            ok = False;
+            break;
         }
-        switch (radix_tree_insert(&store->cached_pages, ofs / pg_size, page)) {
-            case ERR_RADIX_TREE_ALLOC:
-                pmem_free(paddr);
-                return NULL;
-            case ERR_RADIX_TREE_NODE_EXIST:
-                panic("node should not exist");
+        n++;
+    }
+    if (n > 0 && store->fillpages(store, pages, n) != ERR_OK) {
+        for (i = 0; i < n; i++) {
+            pmem_free(page_to_paddr(pages[i]));
+        }
+        return False;
+    }
+    for (i = 0; i < n; i++) {
+        if (insert_page(store, pages[i]) != ERR_OK) {
+            ok = False;
         }
     }
+    return ok;
+}
+
+static void
+readahead(struct memstore *store, int index)
+{
+    struct ra_request *req;
+    offset_t end, npages;
+
+    // repeated accesses to the same page (e.g. its bdev blocks) don't count
+    if (index == store->ra_next - 1) {
+        return;
+    }
+    if (index != store->ra_next) {
+        // random access, start over
+        store->ra_next = index + 1;
+        store->ra_ahead = index + 1;
+        store->ra_window = 0;
+        return;
+    }
+    store->ra_next = index + 1;
+    if (store->ra_ahead < index + 1) {
+        store->ra_ahead = index + 1;
+    }
+    if (store->size == NULL) {
+        return;
+    }
+    // wait until the reader is into the second half of the last window
+    if (store->ra_window > 0 && store->ra_ahead - index > store->ra_window / 2) {
+        return;
+    }
+    store->ra_window = store->ra_window == 0 ? RA_MIN_PAGES : min(2 * store->ra_window, RA_MAX_PAGES);
+    // don't read past the end of the store
+    npages = pg_round_up(store->size(store)) / pg_size;
+    end = min((offset_t) store->ra_ahead + store->ra_window, npages);
+    if (end <= store->ra_ahead || (req = kmem_cache_alloc(ra_allocator)) == NULL) {
+        return;
+    }
+    req->store = store;
+    req->start = store->ra_ahead;
+    req->npages = end - store->ra_ahead;
+    store->ra_ahead = end;
+    if (store->ref) {
+        store->ref(store);
+    }
+    spinlock_acquire(&ra_lock);
+    list_append(&ra_queue, &req->node);
+    condvar_signal(&ra_cv);
+    spinlock_release(&ra_lock);
+}
+
+static int
+ra_daemon(void *aux)
+{
+    struct ra_request *req;
+    struct memstore *store;
+    Node *n;
+    int i, npages;
+    bool ok;
+
+    while (True) {
+        spinlock_acquire(&ra_lock);
+        while (list_empty(&ra_queue)) {
+            condvar_wait(&ra_cv, &ra_lock);
+        }
+        n = list_begin(&ra_queue);
+        list_remove(n);
+        spinlock_release(&ra_lock);
+        req = list_entry(n, struct ra_request, node);
+        store = req->store;
+        // lock a few pages at a time, so the reader can fault in pages the
+        // daemon hasn't reached yet. Stores that take several reads at once
+        // get them in batches.
+        for (i = 0; i < req->npages; i += npages) {
+            npages = store->fillpages ? min(RA_BATCH, req->npages - i) : 1;
+            sleeplock_acquire(&store->pgcache_lock);
+            ok = fill_pages(store, req->start + i, npages);
+            sleeplock_release(&store->pgcache_lock);
+            if (!ok) {
+                break;
+            }
+        }
+        if (store->unref) {
+            store->unref(store);
+        }
+        kmem_cache_free(ra_allocator, req);
+    }
+    return 0;
+}
+
+void
+pgcache_init(void)
+{
+    struct thread *t;
+
+    list_init(&lru_inactive);
+    list_init(&lru_active);
+    ninactive = 0;
+    nactive = 0;
+    spinlock_init(&lru_lock);
+
+    if ((ra_allocator = kmem_cache_create(sizeof(struct ra_request))) == NULL) {
+        panic("Failed to create ra_allocator");
+    }
+    list_init(&ra_queue);
+    spinlock_init(&ra_lock);
+    condvar_init(&ra_cv);
+    if ((t = thread_create("readahead daemon", NULL, DEFAULT_PRI)) == NULL) {
+        panic("Failed to create readahead daemon");
+    }
+    thread_start_context(t, ra_daemon, NULL);
+}
 
+struct page*
+pgcache_get_page(struct memstore *store, offset_t ofs)
+{
+    struct page *page;
+    bool cached, repeat;
+    int index;
+
+    kassert(store);
+    index = ofs / pg_size;
+    cached = radix_tree_lookup(&store->cached_pages, index) != NULL;
+    // another access to the page just looked up, e.g. the next block of a
+    // bdev page, is the same use
+    repeat = index == store->ra_next - 1;
+    if ((page = fill_page(store, ofs)) == NULL) {
+        return NULL;
+    }
+    if (!cached) {
+        page->referenced = True;
+    } else if (!repeat && page->lru != LRU_NONE) {
+        // The first use of a page read ahead only marks it referenced, a page
+        // used again is promoted to the active list
+        if (!page->referenced) {
+            page->referenced = True;
+        } else {
+            spinlock_acquire(&lru_lock);
+            lru_del(page);
+            lru_append(page, LRU_ACTIVE);
+            spinlock_release(&lru_lock);
+        }
+    }
+    readahead(store, index);
     return page;
 }
 
 void
 pgcache_remove_page(struct memstore *store, offset_t ofs)
 {
+    struct page *page;
+
+    kassert(store);
+    if ((page = radix_tree_remove(&store->cached_pages, ofs / pg_size)) != NULL) {
+        if (page->lru != LRU_NONE) {
+            spinlock_acquire(&lru_lock);
+            lru_del(page);
+            spinlock_release(&lru_lock);
+        }
+        page->store = NULL;
+        pmem_dec_refcnt(page_to_paddr(page));
+    }
+}
+
+void
+pgcache_remove_pages(struct memstore *store)
+{
+    struct page *page;
+    int index = 0;
+
     kassert(store);
-    radix_tree_remove(&store->cached_pages, ofs / pg_size);
+    while ((page = radix_tree_next(&store->cached_pages, &index)) != NULL) {
+        pgcache_remove_page(store, (offset_t) index * pg_size);
+    }
+}
+
+size_t
+pgcache_reclaim(struct memstore *locked, size_t npages)
+{
+    struct page *page;
+    struct memstore *store;
+    size_t freed = 0, nscan;
+    err_t err;
+
+    spinlock_acquire(&lru_lock);
+    // look at each cached page at most once
+    for (nscan = nactive + ninactive; freed < npages && nscan > 0; nscan--) {
+        lru_balance();
+        if (list_empty(&lru_inactive)) {
+            break;
+        }
+        page = list_entry(list_begin(&lru_inactive), struct page, node);
+        lru_del(page);
+        store = page->store;
+        // pages still in use get another round on the active list
+        if (pmem_get_refcnt(page_to_paddr(page)) != 1) {
+            lru_append(page, LRU_ACTIVE);
+            continue;
+        }
+        // lock order is pgcache_lock before lru_lock, so only try the lock
+        if (store != locked && sleeplock_try_acquire(&store->pgcache_lock) != ERR_OK) {
+            lru_append(page, LRU_INACTIVE);
+            continue;
+        }
+        // the store's lock keeps the page from being looked up or removed
+        // while it is written back
+        spinlock_release(&lru_lock);
+        err = evict_page(store, page);
+        spinlock_acquire(&lru_lock);
+        if (err == ERR_OK) {
+            freed++;
+        } else {
+            lru_append(page, LRU_ACTIVE);
+        }
+        if (store != locked) {
+            sleeplock_release(&store->pgcache_lock);
+        }
+    }
+    spinlock_release(&lru_lock);
+    return freed;
 }
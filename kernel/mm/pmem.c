@@ -1,5 +1,7 @@
+#include <arch/cpu.h>
 #include <kernel/pmem.h>
 #include <kernel/vm.h>
+#include <kernel/trap.h>
 #include <kernel/console.h>
 #include <kernel/vpmap.h>
 #include <lib/errcode.h>
@@ -23,6 +25,18 @@
  * them in the current free list and returns the other one. The two blocks are
  * called "buddies". When two buddy blocks are both freed, they merge into a
  * bigger block and is moved to the next free list.
+ *
+ * Single page allocations and frees go through a per-cpu cache of order 0
+ * pages in front of the buddy allocator. Each cpu refills its cache from, and
+ * drains it back to, the buddy allocator PCP_BATCH pages at a time, so most
+ * single page requests never touch pmem_lock.
+ *
+ * Idle cpus also keep a pool of pre-zeroed pages topped up, so callers that
+ * need zero-filled memory (anonymous pages, page tables) don't pay for the
+ * memset on their fault path.
+ *
+ * Other allocators that cache memory (e.g. kmem caches) register shrinkers,
+ * which pmem calls to get pages back when the free lists run low.
  */
 
 struct pmemconfig pmemconfig;
@@ -55,6 +69,42 @@ static bool pagemap_initialized;
  */
 #define MAX_ORDER 10
 static List freeblocks[MAX_ORDER+1];
+// number of pages in freeblocks
+static size_t nfree_pages;
+
+/*
+ * Registered shrinkers. They run when fewer than LOW_WATERMARK pages are left
+ * in freeblocks, one cpu at a time.
+ */
+#define LOW_WATERMARK 256
+static struct spinlock shrinker_lock;
+static List shrinkers;
+static int shrinking;
+
+/*
+ * Per-cpu page cache. Pages in a per-cpu cache keep a refcnt of 1, so to the
+ * buddy allocator they look allocated and are never merged with their
+ * buddies. A cpu's cache is only used with interrupts off, its lock is only
+ * contended when another cpu drains it under memory pressure.
+ */
+#define PCP_HIGH 64     // drain once a cache holds more pages than this
+#define PCP_BATCH 16    // number of pages moved per refill/drain
+struct pcp {
+    struct spinlock lock;
+    List pages;         // most recently freed (cache hot) pages at the tail
+    int count;
+};
+static struct pcp pcps[MAX_NCPU];
+static bool pcp_enabled;
+
+/*
+ * Pool of pre-zeroed pages. Pages in the pool are allocated (refcnt 1) and
+ * linked through page->node.
+ */
+#define ZERO_POOL_HIGH 128
+static struct spinlock zero_lock;
+static List zero_pool;
+static int zero_count;
 
 /*
  * Initialize bitmap for the boot memory allocator.
@@ -198,6 +248,46 @@ static void freeblocks_insert_range(paddr_t start, paddr_t end);
  */
 static void freeblocks_remove(struct page *page);
 
+/*
+ * Initialize struct page of a newly allocated block.
+ */
+static void page_init_alloc(struct page *page);
+
+/*
+ * Lock and return the current cpu's page cache. Interrupts stay off until
+ * the cache is released so we can't migrate to another cpu.
+ */
+static struct pcp *pcp_acquire(void);
+
+/*
+ * Allocate/free one page through the current cpu's page cache.
+ */
+static err_t pcp_alloc(paddr_t *paddr);
+static void pcp_free(paddr_t paddr);
+
+/*
+ * Return the n coldest pages of a per-cpu cache to the buddy allocator.
+ *
+ * Precondition:
+ * Caller must hold pcp->lock.
+ */
+static void pcp_drain(struct pcp *pcp, int n);
+
+/*
+ * Return all pages in all per-cpu caches to the buddy allocator.
+ */
+static void pcp_drain_all(void);
+
+/*
+ * Free all pages in the zeroed page pool.
+ */
+static void zero_pool_drain(void);
+
+/*
+ * Run all registered shrinkers. Return the number of pages freed.
+ */
+static size_t pmem_shrink(void);
+
 /*
  * Implementation of pmem_nalloc. Argument lock indicates if the function should
  * acquire/release pmem_lock.
@@ -510,6 +600,7 @@ freeblocks_insert(struct page *page)
 
     page->refcnt = 0;
     list_append(&freeblocks[page->order], &page->node);
+    nfree_pages += 1 << page->order;
 }
 
 static void
@@ -537,6 +628,7 @@ freeblocks_remove(struct page *page)
     kassert(page->order >= 0 && page->order <= MAX_ORDER);
 
     list_remove(&page->node);
+    nfree_pages -= 1 << page->order;
 }
 
 static err_t
@@ -558,18 +650,15 @@ pmem_nalloc_internal(paddr_t *paddr, size_t n, bool lock)
         *paddr = BITMAP_ITOP(index);
     } else {
         // Buddy allocator
+        if (n > 1 << MAX_ORDER) {
+            goto fail;
+        }
         order = get_min_page_order(n);
         if ((page = find_freeblock(order, False)) == NULL) {
             goto fail;
         }
-        sleeplock_init(&page->lock);
-        page->kmem_cache = NULL;
-        page->slab = NULL;
-        page->rmap = NULL;
-        pmem_set_page_dirty(page, False);
         kassert(page->refcnt == 0);
-        page->refcnt = 1;
-        list_init(&page->blk_headers);
+        page_init_alloc(page);
         *paddr = page_to_paddr(page);
         kassert(*paddr != NULL);
     }
@@ -616,6 +705,147 @@ pmem_nfree_internal(paddr_t paddr, size_t n, bool lock)
     }
 }
 
+static void
+page_init_alloc(struct page *page)
+{
+    sleeplock_init(&page->lock);
+    page->kmem_cache = NULL;
+    page->slab = NULL;
+    page->rmap = NULL;
+    page->store = NULL;
+    pmem_set_page_dirty(page, False);
+    page->refcnt = 1;
+    list_init(&page->blk_headers);
+}
+
+static struct pcp*
+pcp_acquire(void)
+{
+    struct pcp *pcp;
+
+    intr_set_level(INTR_OFF);
+    pcp = &pcps[cpu_id(mycpu())];
+    spinlock_acquire(&pcp->lock);
+    intr_set_level(INTR_ON);
+    return pcp;
+}
+
+static err_t
+pcp_alloc(paddr_t *paddr)
+{
+    struct pcp *pcp;
+    struct page *page;
+    Node *n;
+
+    pcp = pcp_acquire();
+    if (list_empty(&pcp->pages)) {
+        spinlock_acquire(&pmem_lock);
+        while (pcp->count < PCP_BATCH && (page = find_freeblock(0, False)) != NULL) {
+            page->refcnt = 1;
+            list_append(&pcp->pages, &page->node);
+            pcp->count++;
+        }
+        spinlock_release(&pmem_lock);
+        if (list_empty(&pcp->pages)) {
+            spinlock_release(&pcp->lock);
+            return ERR_NOMEM;
+        }
+    }
+    n = list_prev(list_end(&pcp->pages));
+    list_remove(n);
+    pcp->count--;
+    spinlock_release(&pcp->lock);
+
+    page = list_entry(n, struct page, node);
+    page_init_alloc(page);
+    *paddr = page_to_paddr(page);
+    return ERR_OK;
+}
+
+static void
+pcp_free(paddr_t paddr)
+{
+    struct pcp *pcp;
+    struct page *page;
+
+    page = paddr_to_page(paddr);
+    kassert(page->order == 0);
+    page->refcnt = 1;
+
+    pcp = pcp_acquire();
+    list_append(&pcp->pages, &page->node);
+    if (++pcp->count > PCP_HIGH) {
+        pcp_drain(pcp, PCP_BATCH);
+    }
+    spinlock_release(&pcp->lock);
+}
+
+static void
+pcp_drain(struct pcp *pcp, int n)
+{
+    struct page *page;
+
+    spinlock_acquire(&pmem_lock);
+    for (; n > 0 && !list_empty(&pcp->pages); n--) {
+        page = list_entry(list_remove(list_begin(&pcp->pages)), struct page, node);
+        pcp->count--;
+        page->refcnt = 0;
+        page = merge_block(page);
+        freeblocks_insert(page);
+    }
+    spinlock_release(&pmem_lock);
+}
+
+static void
+pcp_drain_all(void)
+{
+    for (int i = 0; i < ncpu; i++) {
+        spinlock_acquire(&pcps[i].lock);
+        pcp_drain(&pcps[i], pcps[i].count);
+        spinlock_release(&pcps[i].lock);
+    }
+}
+
+static void
+zero_pool_drain(void)
+{
+    List pages;
+    Node *n;
+
+    list_init(&pages);
+    spinlock_acquire(&zero_lock);
+    while (!list_empty(&zero_pool)) {
+        list_append(&pages, list_remove(list_begin(&zero_pool)));
+    }
+    zero_count = 0;
+    spinlock_release(&zero_lock);
+
+    while (!list_empty(&pages)) {
+        n = list_remove(list_begin(&pages));
+        pmem_free(page_to_paddr(list_entry(n, struct page, node)));
+    }
+}
+
+static size_t
+pmem_shrink(void)
+{
+    size_t freed = 0;
+
+    // a shrinker freeing memory never allocates, but don't let cpus pile up
+    // shrinking the same caches
+    if (__sync_lock_test_and_set(&shrinking, 1) != 0) {
+        return 0;
+    }
+    spinlock_acquire(&shrinker_lock);
+    for (Node *n = list_begin(&shrinkers); n != list_end(&shrinkers); n = list_next(n)) {
+        struct shrinker *shrinker = list_entry(n, struct shrinker, node);
+        freed += shrinker->shrink(shrinker);
+    }
+    spinlock_release(&shrinker_lock);
+    __sync_lock_release(&shrinking);
+    return freed;
+}
+
 struct page*
 paddr_to_page(paddr_t paddr)
 {
@@ -634,6 +864,11 @@ pmem_boot_init(void)
     pmem_arch_init();
     bitmap_init();
     spinlock_init(&pmem_lock);
+    spinlock_init(&zero_lock);
+    list_init(&zero_pool);
+    zero_count = 0;
+    spinlock_init(&shrinker_lock);
+    list_init(&shrinkers);
     pagemap_initialized = False;
 }
 
@@ -647,6 +882,17 @@ pmem_init(void)
     spinlock_release(&pmem_lock);
 }
 
+void
+pmem_pcp_init(void)
+{
+    for (int i = 0; i < MAX_NCPU; i++) {
+        spinlock_init(&pcps[i].lock);
+        list_init(&pcps[i].pages);
+        pcps[i].count = 0;
+    }
+    pcp_enabled = True;
+}
+
 err_t
 pmem_alloc(paddr_t *paddr)
 {
@@ -656,9 +902,75 @@ pmem_alloc(paddr_t *paddr)
 err_t
 pmem_nalloc(paddr_t *paddr, size_t n)
 {
+    if (!pcp_enabled) {
+        return pmem_nalloc_internal(paddr, n, True);
+    }
+    if ((n == 1 ? pcp_alloc(paddr) : pmem_nalloc_internal(paddr, n, True)) == ERR_OK) {
+        // racy peek, shrinking a bit late or early is harmless
+        if (nfree_pages < LOW_WATERMARK) {
+            pmem_shrink();
+        }
+        return ERR_OK;
+    }
+    // free pages might be sitting in other cpus' caches, the zeroed page
+    // pool or other allocators, return them and retry
+    zero_pool_drain();
+    pmem_shrink();
+    pcp_drain_all();
     return pmem_nalloc_internal(paddr, n, True);
 }
 
+void
+pmem_register_shrinker(struct shrinker *shrinker)
+{
+    kassert(shrinker && shrinker->shrink);
+    spinlock_acquire(&shrinker_lock);
+    list_append(&shrinkers, &shrinker->node);
+    spinlock_release(&shrinker_lock);
+}
+
+err_t
+pmem_alloc_zeroed(paddr_t *paddr)
+{
+    Node *n = NULL;
+    err_t err;
+
+    spinlock_acquire(&zero_lock);
+    if (!list_empty(&zero_pool)) {
+        n = list_remove(list_begin(&zero_pool));
+        zero_count--;
+    }
+    spinlock_release(&zero_lock);
+
+    if (n != NULL) {
+        *paddr = page_to_paddr(list_entry(n, struct page, node));
+        return ERR_OK;
+    }
+    if ((err = pmem_alloc(paddr)) != ERR_OK) {
+        return err;
+    }
+    memset((void*) kmap_p2v(*paddr), 0, pg_size);
+    return ERR_OK;
+}
+
+void
+pmem_zero_idle(void)
+{
+    paddr_t paddr;
+
+    // racy peeks, the pool size is only a target. Pre-zeroing must not take
+    // the last free pages, allocating below the low watermark would run the
+    // shrinkers (and start swapping) just to fill the pool.
+    if (zero_count >= ZERO_POOL_HIGH || nfree_pages <= LOW_WATERMARK || pmem_alloc(&paddr) != ERR_OK) {
+        return;
+    }
+    memset((void*) kmap_p2v(paddr), 0, pg_size);
+    spinlock_acquire(&zero_lock);
+    list_append(&zero_pool, &paddr_to_page(paddr)->node);
+    zero_count++;
+    spinlock_release(&zero_lock);
+}
+
 void
 pmem_free(paddr_t paddr)
 {
@@ -668,7 +980,11 @@ pmem_free(paddr_t paddr)
 void
 pmem_nfree(paddr_t paddr, size_t n)
 {
-    pmem_nfree_internal(paddr, n, True);
+    if (pcp_enabled && n == 1 && paddr_to_page(paddr)->order == 0) {
+        pcp_free(paddr);
+    } else {
+        pmem_nfree_internal(paddr, n, True);
+    }
 }
 
 int
@@ -700,30 +1016,32 @@ pmem_inc_refcnt(paddr_t paddr, int n)
 
     page = paddr_to_page(paddr);
     kassert(page);
-
-    spinlock_acquire(&pmem_lock);
     kassert(page->refcnt > 0);
     kassert(page->order == 0);
 
-    page->refcnt += n;
-    spinlock_release(&pmem_lock);
+    __sync_add_and_fetch(&page->refcnt, n);
 }
 
 void
 pmem_dec_refcnt(paddr_t paddr)
 {
     struct page *page;
+    int refcnt;
 
     page = paddr_to_page(paddr);
     kassert(page);
-
-    spinlock_acquire(&pmem_lock);
-    kassert(page->refcnt > 0);
     kassert(page->order == 0);
 
-    page->refcnt--;
-    if (page->refcnt == 0) {
-        pmem_nfree_internal(paddr, 1, False);
-    }
-    spinlock_release(&pmem_lock);
+    // The last reference frees the page without ever dropping refcnt to 0,
+    // so the buddy allocator can't see a free page that isn't in a free list.
+    // Nobody else can take a reference concurrently since it takes one to
+    // make one.
+    do {
+        refcnt = page->refcnt;
+        kassert(refcnt > 0);
+        if (refcnt == 1) {
+            pmem_free(paddr);
+            return;
+        }
+    } while (!__sync_bool_compare_and_swap(&page->refcnt, refcnt, refcnt - 1));
 }
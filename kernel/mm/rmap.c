@@ -1,5 +1,8 @@
 #include <kernel/rmap.h>
 #include <kernel/kmalloc.h>
+#include <kernel/vm.h>
+#include <kernel/vpmap.h>
+#include <kernel/pmem.h>
 #include <kernel/console.h>
 #include <lib/errcode.h>
 #include <lib/stddef.h>
@@ -33,6 +36,7 @@ void
 rmap_construct(struct rmap *rmap)
 {
     kassert(rmap);
+    sleeplock_init(&rmap->lock);
     list_init(&rmap->regions);
 }
 
@@ -44,9 +48,58 @@ rmap_destroy(struct rmap *rmap)
     // nothing to do
 }
 
+void
+rmap_add_region(struct rmap *rmap, struct memregion *region)
+{
+    kassert(rmap && region);
+    sleeplock_acquire(&rmap->lock);
+    list_append(&rmap->regions, &region->rmap_node);
+    sleeplock_release(&rmap->lock);
+}
+
+void
+rmap_remove_region(struct rmap *rmap, struct memregion *region)
+{
+    kassert(rmap && region);
+    sleeplock_acquire(&rmap->lock);
+    list_remove(&region->rmap_node);
+    sleeplock_release(&rmap->lock);
+}
+
 err_t
 rmap_unmap(struct rmap *rmap, paddr_t paddr)
 {
-    // TODO
-    return ERR_OK;
+    struct memregion *r;
+    struct page *page;
+    paddr_t mapped;
+    vaddr_t vaddr;
+    err_t err = ERR_OK;
+
+    kassert(rmap);
+    paddr = pg_round_down(paddr);
+    page = paddr_to_page(paddr);
+
+    sleeplock_acquire(&rmap->lock);
+    for (Node *n = list_begin(&rmap->regions); n != list_end(&rmap->regions); n = list_next(n)) {
+        r = list_entry(n, struct memregion, rmap_node);
+        // page is only mapped at the address corresponding to its store offset
+        if (page->ofs < r->ofs || page->ofs - r->ofs >= pg_round_up(r->end - r->start)) {
+            continue;
+        }
+        vaddr = r->start + (page->ofs - r->ofs);
+        // lock order is as_lock before rmap lock, so only try the as_lock here
+        if (sleeplock_try_acquire(&r->as->as_lock) != ERR_OK) {
+            err = ERR_LOCK_BUSY;
+            continue;
+        }
+        if (r->as->vpmap && vpmap_lookup_vaddr(r->as->vpmap, vaddr, &mapped, NULL) == ERR_OK &&
+            pg_round_down(mapped) == paddr) {
+            vpmap_unmap(r->as->vpmap, vaddr, 1, 0);
+        }
+        sleeplock_release(&r->as->as_lock);
+    }
+    sleeplock_release(&rmap->lock);
+    // other address spaces reload their page table on their next context switch
+    vpmap_flush_tlb();
+    return err;
 }
@@ -0,0 +1,336 @@
+#include <kernel/swap.h>
+#include <kernel/vm.h>
+#include <kernel/pmem.h>
+#include <kernel/vpmap.h>
+#include <kernel/memstore.h>
+#include <kernel/bdev.h>
+#include <kernel/ide.h>
+#include <kernel/kmalloc.h>
+#include <kernel/thread.h>
+#include <kernel/console.h>
+#include <kernel/list.h>
+#include <lib/errcode.h>
+#include <lib/stddef.h>
+#include <lib/string.h>
+
+// Swap block device: master disk of the secondary IDE channel
+#define SWAP_DEV_NUM 1
+#define SWAP_IDE_INDEX 2
+
+// Number of pages the swap daemon reclaims each time it is woken up
+#define SWAP_CLUSTER 32
+
+// Memstore of the swap device, NULL if swap is disabled
+static struct memstore *swap_store = NULL;
+
+/*
+ * Reference count of each swap slot, 0 if the slot is free. Swap ID n refers
+ * to slot n - 1, so SWAPID_NONE never names a slot.
+ */
+static uint16_t *slot_ref;
+static size_t nslots;
+static size_t slot_hand; // where the next free slot search starts
+static struct spinlock slot_lock;
+
+// Address spaces swap can reclaim pages from, in clock order
+static List swap_as_list;
+static size_t swap_nas;
+static struct spinlock swap_as_lock;
+
+// Swap daemon, woken by the pmem shrinker when free memory runs low
+static struct spinlock swapd_lock;
+static struct condvar swapd_cv;
+
+/*
+ * Allocate a swap slot with one reference. Return SWAPID_NONE if swap is full.
+ */
+static swapid_t slot_alloc(void);
+
+/*
+ * Try to swap out the page mapped at vaddr of region r. A page accessed since
+ * the last sweep only has its accessed bit cleared.
+ *
+ * Precondition:
+ * Caller must hold r->as->as_lock.
+ *
+ * Return:
+ * ERR_OK - Page swapped out and freed.
+ * ERR_NOMEM - Swap is full.
+ * Other errors - Page was not swapped out.
+ */
+static err_t swap_out_page(struct memregion *r, vaddr_t vaddr);
+
+/*
+ * Advance an address space's clock hand over its private memory,
+ * swapping out cold pages, until npages are freed or the hand wraps around.
+ * Return the number of pages freed.
+ *
+ * Precondition:
+ * Caller must hold as->as_lock.
+ */
+static size_t swap_out_as(struct addrspace *as, size_t npages);
+
+/*
+ * Pmem shrinker: wake up the swap daemon. Swapping blocks on I/O, which
+ * shrinkers must not do.
+ */
+static size_t swap_shrink(struct shrinker *shrinker);
+static struct shrinker swap_shrinker = { .shrink = swap_shrink };
+
+/*
+ * Swap daemon thread function.
+ */
+static int swap_daemon(void *aux);
+
+static swapid_t
+slot_alloc(void)
+{
+    swapid_t swapid = SWAPID_NONE;
+    size_t i, slot;
+
+    spinlock_acquire(&slot_lock);
+    for (i = 0; i < nslots; i++) {
+        slot = (slot_hand + i) % nslots;
+        if (slot_ref[slot] == 0) {
+            slot_ref[slot] = 1;
+            slot_hand = slot + 1;
+            swapid = slot + 1;
+            break;
+        }
+    }
+    spinlock_release(&slot_lock);
+    return swapid;
+}
+
+static err_t
+swap_out_page(struct memregion *r, vaddr_t vaddr)
+{
+    struct addrspace *as = r->as;
+    swapid_t swapid;
+    paddr_t paddr;
+    int accessed;
+    err_t err;
+
+    if (vpmap_lookup_vaddr(as->vpmap, vaddr, &paddr, NULL) != ERR_OK) {
+        return ERR_VPMAP_NOTPRESENT;
+    }
+    paddr = pg_round_down(paddr);
+    if (vpmap_get_accessed(as->vpmap, vaddr, &accessed) == ERR_OK && accessed) {
+        vpmap_clear_accessed(as->vpmap, vaddr);
+        return ERR_INVAL;
+    }
+    // copy-on-write pages shared with another address space stay in memory
+    if (pmem_get_refcnt(paddr) != 1) {
+        return ERR_INVAL;
+    }
+    if ((swapid = slot_alloc()) == SWAPID_NONE) {
+        return ERR_NOMEM;
+    }
+    kassert(vpmap_put_swapid(as->vpmap, vaddr, swapid) == ERR_OK);
+    // another cpu running the address space may write the page through its
+    // tlb, and we can't shoot its entry down
+    if (vpmap_in_use(as->vpmap)) {
+        err = ERR_LOCK_BUSY;
+        goto restore;
+    }
+    vpmap_flush_tlb();
+    if ((err = swap_store->write(swap_store, paddr, (offset_t) (swapid - 1) * pg_size)) != ERR_OK) {
+        goto restore;
+    }
+    pmem_dec_refcnt(paddr);
+    return ERR_OK;
+
+restore:
+    // the page table page exists, remapping can't fail
+    kassert(vpmap_map(as->vpmap, vaddr, paddr, 1, r->perm) == ERR_OK);
+    swap_free(swapid);
+    return err;
+}
+
+static size_t
+swap_out_as(struct addrspace *as, size_t npages)
+{
+    struct memregion *r;
+    vaddr_t vaddr, end;
+    size_t freed = 0;
+    err_t err = ERR_OK;
+
+    if (as->vpmap == NULL) {
+        return 0;
+    }
+    for (Node *n = list_begin(&as->regions); n != list_end(&as->regions) && freed < npages; n = list_next(n)) {
+        r = list_entry(n, struct memregion, as_node);
+        end = pg_round_up(r->end);
+        // shared pages and cached file pages belong to their store, swap only
+        // takes private memory (including private copies of file pages)
+        if (r->shared || is_kern_memperm(r->perm) || (r->store && !is_write_memperm(r->perm)) ||
+            end <= as->swap_hand) {
+            continue;
+        }
+        for (vaddr = r->start > as->swap_hand ? r->start : as->swap_hand; vaddr < end; vaddr += pg_size) {
+            if ((err = swap_out_page(r, vaddr)) == ERR_OK) {
+                freed++;
+            }
+            if (freed == npages || err == ERR_NOMEM) {
+                as->swap_hand = vaddr + pg_size;
+                return freed;
+            }
+        }
+        as->swap_hand = end;
+    }
+    // swept to the end of the address space, start over on the next visit
+    as->swap_hand = 0;
+    return freed;
+}
+
+static size_t
+swap_shrink(struct shrinker *shrinker)
+{
+    spinlock_acquire(&swapd_lock);
+    condvar_signal(&swapd_cv);
+    spinlock_release(&swapd_lock);
+    return 0;
+}
+
+static int
+swap_daemon(void *aux)
+{
+    while (True) {
+        spinlock_acquire(&swapd_lock);
+        condvar_wait(&swapd_cv, &swapd_lock);
+        spinlock_release(&swapd_lock);
+        swap_reclaim(SWAP_CLUSTER);
+    }
+    return 0;
+}
+
+void
+swap_init(void)
+{
+    struct bdev *bdev;
+    struct thread *t;
+
+    list_init(&swap_as_list);
+    spinlock_init(&swap_as_lock);
+    spinlock_init(&slot_lock);
+    spinlock_init(&swapd_lock);
+    condvar_init(&swapd_cv);
+    swap_nas = 0;
+
+    if ((bdev = ide_alloc(SWAP_DEV_NUM, SWAP_IDE_INDEX)) == NULL) {
+        panic("Failed to allocate swap block device");
+    }
+    if (ide_init(bdev) != ERR_OK) {
+        kprintf("No swap device, swap disabled\n");
+        ide_free(bdev);
+        return;
+    }
+    nslots = bdev->nblks / (pg_size / BDEV_BLK_SIZE);
+    if (nslots == 0 || (slot_ref = kmalloc(nslots * sizeof(*slot_ref))) == NULL) {
+        kprintf("Failed to set up %d swap slots, swap disabled\n", nslots);
+        return;
+    }
+    memset(slot_ref, 0, nslots * sizeof(*slot_ref));
+    slot_hand = 0;
+
+    if ((t = thread_create("swap daemon", NULL, DEFAULT_PRI)) == NULL) {
+        panic("Failed to create swap daemon");
+    }
+    swap_store = bdev->store;
+    thread_start_context(t, swap_daemon, NULL);
+    pmem_register_shrinker(&swap_shrinker);
+    kprintf("Swap enabled with %d pages\n", nslots);
+}
+
+void
+swap_add_as(struct addrspace *as)
+{
+    kassert(as && !as->swappable);
+    as->swap_hand = 0;
+    spinlock_acquire(&swap_as_lock);
+    list_append(&swap_as_list, &as->swap_node);
+    as->swappable = True;
+    swap_nas++;
+    spinlock_release(&swap_as_lock);
+}
+
+void
+swap_remove_as(struct addrspace *as)
+{
+    kassert(as);
+    kassert(as->as_lock.holder == thread_current());
+    spinlock_acquire(&swap_as_lock);
+    if (as->swappable) {
+        list_remove(&as->swap_node);
+        as->swappable = False;
+        swap_nas--;
+    }
+    spinlock_release(&swap_as_lock);
+}
+
+size_t
+swap_reclaim(size_t npages)
+{
+    struct addrspace *as;
+    size_t freed = 0, nvisit, i;
+    Node *n;
+
+    if (swap_store == NULL) {
+        return 0;
+    }
+    // two visits per address space: a page accessed before the first visit
+    // can be swapped out on the second if it stayed cold in between
+    spinlock_acquire(&swap_as_lock);
+    nvisit = 2 * swap_nas;
+    spinlock_release(&swap_as_lock);
+    for (i = 0; i < nvisit && freed < npages; i++) {
+        spinlock_acquire(&swap_as_lock);
+        if (list_empty(&swap_as_list)) {
+            spinlock_release(&swap_as_lock);
+            break;
+        }
+        // move the address space to the back of the list, the clock moves on
+        n = list_begin(&swap_as_list);
+        list_remove(n);
+        list_append(&swap_as_list, n);
+        as = list_entry(n, struct addrspace, swap_node);
+        // as_destroy removes the address space from the list with its lock
+        // held, so it stays alive while we hold the lock
+        if (sleeplock_try_acquire(&as->as_lock) != ERR_OK) {
+            spinlock_release(&swap_as_lock);
+            continue;
+        }
+        spinlock_release(&swap_as_lock);
+        freed += swap_out_as(as, npages - freed);
+        sleeplock_release(&as->as_lock);
+    }
+    return freed;
+}
+
+err_t
+swap_in(swapid_t swapid, paddr_t paddr)
+{
+    kassert(swap_store && swapid != SWAPID_NONE && swapid <= nslots);
+    return swap_store->fillpage(swap_store, (offset_t) (swapid - 1) * pg_size,
+        paddr_to_page(pg_round_down(paddr)));
+}
+
+void
+swap_dup(swapid_t swapid)
+{
+    kassert(swapid != SWAPID_NONE && swapid <= nslots);
+    spinlock_acquire(&slot_lock);
+    kassert(slot_ref[swapid - 1] > 0 && slot_ref[swapid - 1] < (uint16_t) ~0);
+    slot_ref[swapid - 1]++;
+    spinlock_release(&slot_lock);
+}
+
+void
+swap_free(swapid_t swapid)
+{
+    kassert(swapid != SWAPID_NONE && swapid <= nslots);
+    spinlock_acquire(&slot_lock);
+    kassert(slot_ref[swapid - 1] > 0);
+    slot_ref[swapid - 1]--;
+    spinlock_release(&slot_lock);
+}
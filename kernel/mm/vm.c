@@ -6,6 +6,7 @@
 #include <kernel/thread.h>
 #include <kernel/proc.h>
 #include <kernel/memstore.h>
+#include <kernel/swap.h>
 #include <kernel/list.h>
 #include <lib/errcode.h>
 #include <arch/mmu.h>
@@ -27,8 +28,43 @@ struct vpmap *kvpmap = &_kvpmap;
 /* Initialize the kernel address space, only called once */
 static void kas_init(void);
 
-/* memregion comparator used to keep memregion in order by their addresses */
-static int memregion_comparator(const Node *a, const Node *b, void *aux);
+/*
+ * Memregions of an address space are kept both in an address ordered list and
+ * in an AVL tree keyed on start address. Each region records the gap of free
+ * address space between the end of the previous region and its start, and
+ * each subtree records the largest gap within it, so both the region
+ * containing an address and the lowest free range of a given size are found
+ * in O(log n).
+ */
+
+/* Recompute height and max_gap of a region from its children */
+static void rt_update(struct memregion *r);
+
+/* Rebalance the subtree rooted at r, return the new subtree root */
+static struct memregion* rt_rebalance(struct addrspace *as, struct memregion *r);
+
+/* Rebalance and update all regions from r up to the root */
+static void rt_fixup(struct addrspace *as, struct memregion *r);
+
+/* Insert/remove a region into/from the address space's list and tree */
+static void rt_insert(struct addrspace *as, struct memregion *r);
+static void rt_remove(struct addrspace *as, struct memregion *r);
+
+/* Recompute the gap in front of r after its previous region changed */
+static void rt_update_gap(struct addrspace *as, struct memregion *r);
+
+/* Return the region after/before r in address order, or NULL */
+static struct memregion* rt_next(struct addrspace *as, struct memregion *r);
+static struct memregion* rt_prev(struct addrspace *as, struct memregion *r);
+
+/* Return the region with the largest start address <= addr, or NULL */
+static struct memregion* rt_lookup(struct addrspace *as, vaddr_t addr);
+
+/*
+ * Return the first address after region r where new regions may be placed.
+ * Address space right after the heap is kept free for the heap to grow into.
+ */
+static vaddr_t rt_free_start(struct addrspace *as, struct memregion *r);
 
 static void memregion_unmap_internal(struct memregion *region);
 
@@ -55,6 +91,7 @@ kas_init(void)
 {
     sleeplock_init(&kas->as_lock);
     list_init(&kas->regions);
+    kas->region_tree = NULL;
     kas->vpmap = kvpmap;
 }
 
@@ -80,10 +117,13 @@ as_init(struct addrspace* as)
     kassert(as);
     sleeplock_init(&as->as_lock);
     list_init(&as->regions);
+    as->region_tree = NULL;
     if ((as->vpmap = vpmap_create()) == NULL) {
         return ERR_VM_RESOURCE_UNAVAIL;
     }
     as->heap = NULL;
+    as->swappable = False;
+    as->swap_hand = 0;
     // maybe we should copy in kvm here, every as starts implictly with kas
     // NOTE: temp hack, go through kas and copy all region
     return vpmap_copy_kernel_mapping(as->vpmap);
@@ -95,6 +135,7 @@ as_destroy(struct addrspace *as)
     kassert(as);
     kassert(as != kas); // Cannot destroy kernel address space
     sleeplock_acquire(&as->as_lock);
+    swap_remove_as(as);
     vpmap_destroy(as->vpmap);
     as->vpmap = NULL; // make sure memregion_unmap won't walk page tables
 
@@ -262,24 +303,28 @@ found:
 err_t
 memregion_extend(struct memregion *region, int size, vaddr_t *old_bound)
 {
-    Node *n;
-    List *list = &region->as->regions;
-    struct memregion *r;
+    struct addrspace *as = region->as;
+    struct memregion *next;
+    err_t err = ERR_OK;
 
     if (region->end + size < region->start) {
         return ERR_VM_INVALID;
     }
 
-    for (n = list_begin(list); n != list_end(list); n = list_next(n)) {
-        r = (struct memregion *) list_entry(n, struct memregion, as_node);
-        if ((region->end < r->start) && (r->start < region->end + size)) {
-            return ERR_VM_BOUND;
+    sleeplock_acquire(&as->as_lock);
+    // only the next region can be in the way
+    next = rt_next(as, region);
+    if (next && next->start < region->end + size) {
+        err = ERR_VM_BOUND;
+    } else {
+        *old_bound = region->end;
+        region->end += size;
+        if (next) {
+            rt_update_gap(as, next);
         }
     }
-
-    *old_bound = region->end;
-    region->end += size;
-    return ERR_OK;
+    sleeplock_release(&as->as_lock);
+    return err;
 }
 
 err_t
@@ -310,12 +355,228 @@ memregion_unmap(struct memregion *region)
 }
 
 static int
-memregion_comparator(const Node *a, const Node *b, void *aux)
+rt_height(struct memregion *r)
+{
+    return r ? r->rt_height : 0;
+}
+
+static size_t
+rt_max_gap(struct memregion *r)
+{
+    return r ? r->max_gap : 0;
+}
+
+static void
+rt_update(struct memregion *r)
+{
+    int lh = rt_height(r->rt_left), rh = rt_height(r->rt_right);
+    size_t lg = rt_max_gap(r->rt_left), rg = rt_max_gap(r->rt_right);
+
+    r->rt_height = 1 + (lh > rh ? lh : rh);
+    r->max_gap = r->gap;
+    if (lg > r->max_gap) {
+        r->max_gap = lg;
+    }
+    if (rg > r->max_gap) {
+        r->max_gap = rg;
+    }
+}
+
+/* Make child take old's place under parent */
+static void
+rt_replace_child(struct addrspace *as, struct memregion *parent,
+                 struct memregion *old, struct memregion *child)
+{
+    if (parent == NULL) {
+        as->region_tree = child;
+    } else if (parent->rt_left == old) {
+        parent->rt_left = child;
+    } else {
+        parent->rt_right = child;
+    }
+    if (child) {
+        child->rt_parent = parent;
+    }
+}
+
+static struct memregion*
+rt_rotate_left(struct addrspace *as, struct memregion *x)
+{
+    struct memregion *y = x->rt_right;
+
+    x->rt_right = y->rt_left;
+    if (y->rt_left) {
+        y->rt_left->rt_parent = x;
+    }
+    rt_replace_child(as, x->rt_parent, x, y);
+    y->rt_left = x;
+    x->rt_parent = y;
+    rt_update(x);
+    rt_update(y);
+    return y;
+}
+
+static struct memregion*
+rt_rotate_right(struct addrspace *as, struct memregion *x)
+{
+    struct memregion *y = x->rt_left;
+
+    x->rt_left = y->rt_right;
+    if (y->rt_right) {
+        y->rt_right->rt_parent = x;
+    }
+    rt_replace_child(as, x->rt_parent, x, y);
+    y->rt_right = x;
+    x->rt_parent = y;
+    rt_update(x);
+    rt_update(y);
+    return y;
+}
+
+static struct memregion*
+rt_rebalance(struct addrspace *as, struct memregion *r)
+{
+    int balance;
+
+    rt_update(r);
+    balance = rt_height(r->rt_left) - rt_height(r->rt_right);
+    if (balance > 1) {
+        if (rt_height(r->rt_left->rt_left) < rt_height(r->rt_left->rt_right)) {
+            rt_rotate_left(as, r->rt_left);
+        }
+        return rt_rotate_right(as, r);
+    }
+    if (balance < -1) {
+        if (rt_height(r->rt_right->rt_right) < rt_height(r->rt_right->rt_left)) {
+            rt_rotate_right(as, r->rt_right);
+        }
+        return rt_rotate_left(as, r);
+    }
+    return r;
+}
+
+static void
+rt_fixup(struct addrspace *as, struct memregion *r)
+{
+    while (r) {
+        r = rt_rebalance(as, r)->rt_parent;
+    }
+}
+
+static struct memregion*
+rt_next(struct addrspace *as, struct memregion *r)
+{
+    Node *n = list_next(&r->as_node);
+    return n == list_end(&as->regions) ? NULL : list_entry(n, struct memregion, as_node);
+}
+
+static struct memregion*
+rt_prev(struct addrspace *as, struct memregion *r)
+{
+    Node *n = list_prev(&r->as_node);
+    return n == list_end(&as->regions) ? NULL : list_entry(n, struct memregion, as_node);
+}
+
+static vaddr_t
+rt_free_start(struct addrspace *as, struct memregion *r)
+{
+    vaddr_t end = pg_round_up(r->end);
+
+    if (r == as->heap) {
+        end += UHEAP_INIT_PAGES * pg_size;
+    }
+    return end;
+}
+
+static void
+rt_update_gap(struct addrspace *as, struct memregion *r)
+{
+    struct memregion *prev = rt_prev(as, r);
+    vaddr_t prev_end = prev ? rt_free_start(as, prev) : r->start;
+
+    // no gap in front of the first region, free space search starts after it
+    r->gap = prev_end < r->start ? r->start - prev_end : 0;
+    rt_fixup(as, r);
+}
+
+static struct memregion*
+rt_lookup(struct addrspace *as, vaddr_t addr)
 {
-    struct memregion *mr_a = list_entry(a, struct memregion, as_node);
-    struct memregion *mr_b = list_entry(b, struct memregion, as_node);
-    // if a and b's memregion is consecutive, we want a after b in the list, +1 bumps 0 to postivie
-    return mr_a->start >= mr_b->end;
+    struct memregion *r = as->region_tree, *found = NULL;
+
+    while (r) {
+        if (r->start <= addr) {
+            found = r;
+            r = r->rt_right;
+        } else {
+            r = r->rt_left;
+        }
+    }
+    return found;
+}
+
+static void
+rt_insert(struct addrspace *as, struct memregion *r)
+{
+    struct memregion *parent = NULL, *prev = NULL, *next, **link = &as->region_tree;
+
+    // regions with the same start (empty regions) go after existing ones
+    while (*link) {
+        parent = *link;
+        link = r->start < parent->start ? &parent->rt_left : &parent->rt_right;
+    }
+    r->rt_left = r->rt_right = NULL;
+    r->rt_parent = parent;
+    *link = r;
+
+    // r is a leaf, the region before it is the closest ancestor that has r in
+    // its right subtree
+    for (struct memregion *c = r, *p = parent; p; c = p, p = p->rt_parent) {
+        if (p->rt_right == c) {
+            prev = p;
+            break;
+        }
+    }
+    list_insert(prev ? list_next(&prev->as_node) : list_begin(&as->regions), &r->as_node);
+
+    rt_update_gap(as, r);
+    if ((next = rt_next(as, r)) != NULL) {
+        rt_update_gap(as, next);
+    }
+}
+
+static void
+rt_remove(struct addrspace *as, struct memregion *r)
+{
+    struct memregion *s, *fix, *child;
+    struct memregion *next = rt_next(as, r);
+
+    if (r->rt_left && r->rt_right) {
+        // replace r with its successor, the leftmost region of its right subtree
+        for (s = r->rt_right; s->rt_left; s = s->rt_left) {
+            ;
+        }
+        fix = s;
+        if (s->rt_parent != r) {
+            fix = s->rt_parent;
+            rt_replace_child(as, s->rt_parent, s, s->rt_right);
+            s->rt_right = r->rt_right;
+            s->rt_right->rt_parent = s;
+        }
+        s->rt_left = r->rt_left;
+        s->rt_left->rt_parent = s;
+        rt_replace_child(as, r->rt_parent, r, s);
+    } else {
+        child = r->rt_left ? r->rt_left : r->rt_right;
+        fix = r->rt_parent;
+        rt_replace_child(as, r->rt_parent, r, child);
+    }
+    rt_fixup(as, fix);
+
+    list_remove(&r->as_node);
+    if (next) {
+        rt_update_gap(as, next);
+    }
 }
 
 static err_t
@@ -325,23 +586,27 @@ find_free_vaddr(struct addrspace *as, size_t size, vaddr_t *ret_addr)
     kassert(ret_addr);
     kassert(as->as_lock.holder == thread_current());
 
-    List *list = &as->regions;
-    // start looking at first memregion address if exists
+    struct memregion *r = as->region_tree, *prev;
+    size_t need = pg_round_up(size);
     vaddr_t addr = 0;
-    if (!list_empty(list)) {
-        addr = ((struct memregion*)list_entry(list_begin(list), struct memregion, as_node))->end;
-    }
 
-    // memregion address goes up, only need to check if end is smaller than the start
-    for (Node *n = list_begin(list); n != list_end(list); n = list_next(n)) {
-        struct memregion *r = list_entry(n, struct memregion, as_node);
-        if (pg_round_up(addr + size) < r->start) {
-            *ret_addr = addr;
+    // find the lowest region with a gap big enough in front of it
+    while (r && r->max_gap > need) {
+        if (rt_max_gap(r->rt_left) > need) {
+            r = r->rt_left;
+        } else if (r->gap > need) {
+            prev = rt_prev(as, r);
+            kassert(prev);
+            *ret_addr = rt_free_start(as, prev);
             return ERR_OK;
+        } else {
+            r = r->rt_right;
         }
-        addr = pg_round_up(r->end);
     }
     // check address space after the last memregion allocated
+    if (!list_empty(&as->regions)) {
+        addr = rt_free_start(as, list_entry(list_prev(list_end(&as->regions)), struct memregion, as_node));
+    }
     if (pg_round_up(addr + size) < USTACK_LOWERBOUND - size) {
         *ret_addr = addr;
         return ERR_OK;
@@ -360,8 +625,14 @@ memregion_unmap_internal(struct memregion *region)
     vpmap_unmap(region->as->vpmap, region->start,
             pg_round_up(region->end - region->start) / pg_size, 1);
     // Detach from address space
-    list_remove(&region->as_node);
+    rt_remove(region->as, region);
     vpmap_flush_tlb();
+    if (region->store) {
+        rmap_remove_region(&region->store->rmap, region);
+        if (region->store->unref) {
+            region->store->unref(region->store);
+        }
+    }
     kmem_cache_free(memregion_allocator, region);
 }
 
@@ -384,7 +655,7 @@ memregion_map_internal(struct addrspace *as, vaddr_t addr, size_t size, memperm_
         return NULL;
     }
     // Fail if any address in the range overlaps with an existing region
-    if (memregion_find_internal(as, addr, addr+size)) {
+    if (size > 0 && (r = rt_lookup(as, addr + size - 1)) != NULL && pg_round_up(r->end) > addr) {
         return NULL;
     }
 
@@ -392,16 +663,23 @@ memregion_map_internal(struct addrspace *as, vaddr_t addr, size_t size, memperm_
         return NULL;
     }
 
-    // Link into address space's region list and memstore's reverse mapping
-    list_append_ordered(&as->regions, &r->as_node, memregion_comparator, NULL);
-
     r->as = as;
     r->start = addr;
     r->end = addr + size;
     r->perm = perm;
     r->shared = shared;
+    r->mmapped = False;
     r->store = store;
     r->ofs = ofs;
+
+    // Link into address space's region list/tree and memstore's reverse mapping
+    rt_insert(as, r);
+    if (store) {
+        rmap_add_region(&store->rmap, r);
+        if (store->ref) {
+            store->ref(store);
+        }
+    }
     return r;
 }
 
@@ -410,15 +688,24 @@ static struct memregion*
 memregion_copy_internal(struct addrspace *as, struct memregion *src, vaddr_t addr)
 {
     struct memregion *dst;
+    memperm_t perm = src->perm;
+
+    // Private writable pages are shared copy-on-write: both regions map them
+    // read-only until a write fault gives the writer its own copy.
+    if (!src->shared && is_write_memperm(perm)) {
+        perm = perm == MEMPERM_URW ? MEMPERM_UR : MEMPERM_R;
+    }
     // Try mapping a region with the same attributes as the source
     if ((dst = memregion_map_internal(as, addr, src->end - src->start,
             src->perm, src->store, src->ofs, src->shared)) != NULL) {
-        // hard copy over everything
         if (vpmap_copy(src->as->vpmap, as->vpmap, src->start, addr,
-             pg_round_up(src->end - src->start)/pg_size, src->perm) != ERR_OK) {
+             pg_round_up(src->end - src->start)/pg_size, perm) != ERR_OK) {
             memregion_unmap_internal(dst);
             return NULL;
         }
+        // source mappings may have lost write permission
+        vpmap_flush_tlb();
+        dst->mmapped = src->mmapped;
     }
     return dst;
 }
@@ -426,12 +713,10 @@ memregion_copy_internal(struct addrspace *as, struct memregion *src, vaddr_t add
 static struct memregion*
 memregion_find_internal(struct addrspace *as, vaddr_t addr, size_t size)
 {
-    List *list = &as->regions;
-    for (Node *n = list_begin(list); n != list_end(list); n = list_next(n)) {
-        struct memregion *r = (struct memregion*) list_entry(n, struct memregion, as_node);
-        if (addr >= r->start && addr+size <= pg_round_up(r->end)) {
-            return r;
-        }
+    struct memregion *r = rt_lookup(as, addr);
+
+    if (r && addr+size <= pg_round_up(r->end)) {
+        return r;
     }
     return NULL;
 }
@@ -3,26 +3,195 @@
 #include <kernel/proc.h>
 #include <kernel/console.h>
 #include <kernel/trap.h>
+#include <kernel/pmem.h>
 #include <kernel/vpmap.h>
+#include <kernel/memstore.h>
+#include <kernel/pgcache.h>
+#include <kernel/swap.h>
 
 
 size_t user_pgfault = 0;
 
 #define error(user) (user ? proc_exit(-1) : panic("Kernel error in page fault handler\n"))
 
+// Number of pages to swap out when a fault runs out of memory
+#define FAULT_RECLAIM_PAGES 32
+
+/*
+ * Resolve a write fault on a copy-on-write page. If the faulting address space
+ * is the last one referencing the page it simply regains write permission,
+ * otherwise the page is copied into a newly allocated page.
+ */
+static err_t cow_fault(struct addrspace *as, struct memregion *region, vaddr_t fault_addr);
+
+/*
+ * Fault in a page of a memregion backed by a memstore. The page is read
+ * through the store's page cache. Read-only and shared regions map the cached
+ * page itself; writable private regions get a private copy of it.
+ */
+static err_t store_fault(struct addrspace *as, struct memregion *region, vaddr_t fault_addr);
+
+/*
+ * Fault in a page that was swapped out to swap slot swapid.
+ */
+static err_t swap_fault(struct addrspace *as, struct memregion *region, vaddr_t fault_addr, swapid_t swapid);
+
+/*
+ * Resolve a fault at fault_addr in region according to the current state of
+ * its page table entry.
+ *
+ * Precondition:
+ * Caller must hold as->as_lock for user address spaces.
+ *
+ * Return:
+ * ERR_NOMEM - Ran out of memory, the fault can be retried once memory is freed.
+ * Other errors - The access is invalid.
+ */
+static err_t resolve_fault(struct addrspace *as, struct memregion *region, vaddr_t fault_addr, int present, int write);
+
+static err_t
+cow_fault(struct addrspace *as, struct memregion *region, vaddr_t fault_addr)
+{
+    paddr_t paddr, new_paddr;
+    err_t err;
+
+    fault_addr = pg_round_down(fault_addr);
+    if ((err = vpmap_lookup_vaddr(as->vpmap, fault_addr, &paddr, NULL)) != ERR_OK) {
+        return err;
+    }
+    paddr = pg_round_down(paddr);
+    if (pmem_get_refcnt(paddr) == 1) {
+        vpmap_set_perm(as->vpmap, fault_addr, 1, region->perm);
+    } else {
+        if ((err = pmem_alloc(&new_paddr)) != ERR_OK) {
+            return err;
+        }
+        memcpy((void*) kmap_p2v(new_paddr), (void*) kmap_p2v(paddr), pg_size);
+        // map_pages overwrites the entry, drop our reference on the shared page
+        if (vpmap_map(as->vpmap, fault_addr, new_paddr, 1, region->perm) != ERR_OK) {
+            pmem_free(new_paddr);
+            return ERR_NOMEM;
+        }
+        pmem_dec_refcnt(paddr);
+    }
+    vpmap_flush_tlb();
+    return ERR_OK;
+}
+
+static err_t
+store_fault(struct addrspace *as, struct memregion *region, vaddr_t fault_addr)
+{
+    struct memstore *store = region->store;
+    struct page *page;
+    paddr_t paddr;
+    offset_t ofs;
+    int direct;
+    err_t err;
+
+    fault_addr = pg_round_down(fault_addr);
+    ofs = region->ofs + (fault_addr - region->start);
+    // pages that are never written privately (text, shared mappings) map the
+    // cached page itself, so every process running a binary shares its text
+    direct = !is_write_memperm(region->perm) || region->shared;
+    if (!direct && (err = pmem_alloc(&paddr)) != ERR_OK) {
+        return err;
+    }
+    sleeplock_acquire(&store->pgcache_lock);
+    if ((page = pgcache_get_page(store, ofs)) == NULL) {
+        sleeplock_release(&store->pgcache_lock);
+        if (!direct) {
+            pmem_free(paddr);
+        }
+        return ERR_NOMEM;
+    }
+    if (direct) {
+        // take the mapping's reference before the cache lock is dropped
+        paddr = page_to_paddr(page);
+        pmem_inc_refcnt(paddr, 1);
+    } else {
+        memcpy((void*) kmap_p2v(paddr), (void*) kmap_p2v(page_to_paddr(page)), pg_size);
+    }
+    sleeplock_release(&store->pgcache_lock);
+    if (vpmap_map(as->vpmap, fault_addr, paddr, 1, region->perm) != ERR_OK) {
+        if (direct) {
+            pmem_dec_refcnt(paddr);
+        } else {
+            pmem_free(paddr);
+        }
+        return ERR_NOMEM;
+    }
+    return ERR_OK;
+}
+
+static err_t
+swap_fault(struct addrspace *as, struct memregion *region, vaddr_t fault_addr, swapid_t swapid)
+{
+    paddr_t paddr;
+    err_t err;
+
+    fault_addr = pg_round_down(fault_addr);
+    if ((err = pmem_alloc(&paddr)) != ERR_OK) {
+        return err;
+    }
+    if ((err = swap_in(swapid, paddr)) != ERR_OK) {
+        pmem_free(paddr);
+        return err == ERR_MEMSTORE_NOMEM ? ERR_NOMEM : err;
+    }
+    // the new mapping replaces the swap entry, drop its reference on the slot
+    if (vpmap_map(as->vpmap, fault_addr, paddr, 1, region->perm) != ERR_OK) {
+        pmem_free(paddr);
+        return ERR_NOMEM;
+    }
+    swap_free(swapid);
+    return ERR_OK;
+}
+
+static err_t
+resolve_fault(struct addrspace *as, struct memregion *region, vaddr_t fault_addr, int present, int write)
+{
+    paddr_t paddr;
+    swapid_t swapid;
+
+    // swap may have swapped the page out, or put it back, before we got as_lock
+    if (vpmap_lookup_vaddr(as->vpmap, fault_addr, &paddr, &swapid) == ERR_OK) {
+        if (!present) {
+            return ERR_OK;
+        }
+        if (write && is_write_memperm(region->perm) && !region->shared) {
+            return cow_fault(as, region, fault_addr);
+        }
+        return ERR_INVAL;
+    }
+    if (swapid != SWAPID_NONE) {
+        return swap_fault(as, region, fault_addr, swapid);
+    }
+    if (region->store) {
+        return store_fault(as, region, fault_addr);
+    }
+    if (pmem_alloc_zeroed(&paddr) != ERR_OK) {
+        return ERR_NOMEM;
+    }
+    if (vpmap_map(as->vpmap, fault_addr, paddr, 1, region->perm) != ERR_OK) {
+        pmem_free(paddr);
+        return ERR_NOMEM;
+    }
+    return ERR_OK;
+}
+
 void
 handle_page_fault(vaddr_t fault_addr, int present, int write, int user) {
     struct addrspace *as;
     struct memregion *region;
-    paddr_t paddr;
+    err_t err;
     if (user) {
         __sync_add_and_fetch(&user_pgfault, 1);
     }
     // turn on interrupt now that we have the fault address
     intr_set_level(INTR_ON);
 
-    // kernel vs user addrspace
-    if (user) {
+    // kernel vs user addrspace, the kernel may fault on user memory when
+    // copying syscall results into a copy-on-write or not yet mapped page
+    if (user || (is_user_addr(fault_addr) && proc_current() != NULL)) {
         as = &(proc_current()->as);
     } else {
         as = kas;
@@ -30,21 +199,22 @@ handle_page_fault(vaddr_t fault_addr, int present, int write, int user) {
     if (((region = as_find_memregion(as, fault_addr, 1)) == NULL) || (region->end == fault_addr)) {
         error(user);
     }
-    if (present) {
-        if (write) {
-            // Do copy-on-write things
-            error(user);
-        } else {
-            error(user);
+    while (True) {
+        // swap changes user page tables with as_lock held
+        if (as != kas) {
+            sleeplock_acquire(&as->as_lock);
         }
-    } else {
-        if (pmem_alloc(&paddr) != ERR_OK) {
-            error(user);
+        err = resolve_fault(as, region, fault_addr, present, write);
+        if (as != kas) {
+            sleeplock_release(&as->as_lock);
         }
-        if (vpmap_map(as->vpmap, fault_addr, paddr, 1, region->perm) == ERR_VPMAP_MAP) {
-            pmem_free(paddr);
-            error(user);
+        // out of memory, retry as long as the page cache or swap frees some
+        if (err != ERR_NOMEM ||
+            (pgcache_reclaim(NULL, FAULT_RECLAIM_PAGES) == 0 && swap_reclaim(FAULT_RECLAIM_PAGES) == 0)) {
+            break;
         }
-        memset((void*) kmap_p2v(paddr), 0, pg_size);
+    }
+    if (err != ERR_OK) {
+        error(user);
     }
 }
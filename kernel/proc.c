@@ -5,6 +5,8 @@
 #include <kernel/list.h>
 #include <kernel/fs.h>
 #include <kernel/vpmap.h>
+#include <kernel/memstore.h>
+#include <kernel/swap.h>
 #include <arch/elf.h>
 #include <arch/trap.h>
 #include <arch/mmu.h>
@@ -261,6 +263,8 @@ proc_spawn(char* name, char** argv, struct proc **p)
 
     // set up trapframe for a new process
     tf_proc(t->tf, t->proc, entry_point, stackptr);
+    // the kernel is done writing to the process's memory, let swap reclaim it
+    swap_add_as(&proc->as);
     thread_start_context(t, NULL, NULL);
 
     // fill in allocated proc
@@ -302,6 +306,7 @@ proc_fork()
         proc_free(child_proc);
         return NULL;
     }
+    swap_add_as(&child_proc->as);
 
     thread = thread_current();
     if ((child_thread = thread_create(child_proc->name, child_proc, DEFAULT_PRI)) == NULL) {
@@ -492,29 +497,36 @@ proc_load(struct proc *p, char *path, vaddr_t *entry_point)
     struct elfhdr elf;
     struct proghdr ph;
     struct file *f;
+    struct memstore *store;
     paddr_t paddr;
-    vaddr_t vaddr;
+    vaddr_t start, file_end, mem_end;
     vaddr_t end = 0;
 
     if ((err = fs_open_file(path, FS_RDONLY, 0, &f)) != ERR_OK) {
         return err;
     }
+    store = f->f_inode->store;
 
     // check if the file is actually an executable file
     if (fs_read_file(f, (void*) &elf, sizeof(elf), &ofs) != sizeof(elf) || elf.magic != ELF_MAGIC) {
-        return ERR_INVAL;
+        err = ERR_INVAL;
+        goto done;
     }
 
-    // read elf and load binary
+    // read elf and map binary, pages are faulted in from the file on first access
     for (i = 0, ofs = elf.phoff; i < elf.phnum; i++) {
         if (fs_read_file(f, (void*) &ph, sizeof(ph), &ofs) != sizeof(ph)) {
-            return ERR_INVAL;
+            err = ERR_INVAL;
+            goto done;
         }
         if(ph.type != PT_LOAD)
             continue;
 
-        if(ph.memsz < ph.filesz || ph.vaddr + ph.memsz < ph.vaddr) {
-            return ERR_INVAL;
+        // file offset and vaddr of a loadable segment must agree modulo page size
+        if(ph.memsz < ph.filesz || ph.vaddr + ph.memsz < ph.vaddr ||
+            pg_ofs(ph.vaddr) != pg_ofs(ph.off)) {
+            err = ERR_INVAL;
+            goto done;
         }
 
         memperm_t perm = MEMPERM_UR;
@@ -522,50 +534,59 @@ proc_load(struct proc *p, char *path, vaddr_t *entry_point)
             perm = MEMPERM_URW;
         }
 
-        // found loadable section, add as a memregion
-        struct memregion *r = as_map_memregion(&p->as, pg_round_down(ph.vaddr), 
-            pg_round_up(ph.memsz + pg_ofs(ph.vaddr)), perm, NULL, ph.off, False);
-        if (r == NULL) {
-            return ERR_NOMEM;
-        }
-        end = r->end;
-
-        // pre-page in code and data, may span over multiple pages
-        int count = 0;
-        size_t avail_bytes;
-        size_t read_bytes = ph.filesz;
-        size_t pages = pg_round_up(ph.memsz + pg_ofs(ph.vaddr)) / pg_size;
-        // vaddr may start at a nonaligned address
-        vaddr = pg_ofs(ph.vaddr);
-        while (count < pages) {
-            // allocate a physical page and zero it first
-            if ((err = pmem_alloc(&paddr)) != ERR_OK) {
-                return err;
-            }
-            vaddr += kmap_p2v(paddr);
-            memset((void*)pg_round_down(vaddr), 0, pg_size);
-            // calculate how many bytes to read from file
-            avail_bytes = read_bytes < (pg_size - pg_ofs(vaddr)) ? read_bytes : (pg_size - pg_ofs(vaddr));
-            if (avail_bytes && fs_read_file(f, (void*)vaddr, avail_bytes, &ph.off) != avail_bytes) {
-                return ERR_INVAL;
+        start = pg_round_down(ph.vaddr);
+        file_end = pg_round_up(ph.vaddr + ph.filesz);
+        mem_end = pg_round_up(ph.vaddr + ph.memsz);
+
+        // file backed part of the segment
+        if (ph.filesz > 0) {
+            if (as_map_memregion(&p->as, start, file_end - start, perm, store,
+                ph.off - pg_ofs(ph.vaddr), False) == NULL) {
+                err = ERR_NOMEM;
+                goto done;
             }
-            // map physical page with code/data content to expected virtual address in the page table
-            if ((err = vpmap_map(p->as.vpmap, ph.vaddr+count*pg_size, paddr, 1, perm)) != ERR_OK) {
-                return err;
+            // The last file page is shared with the start of bss, which has to
+            // read as zeros. Load that page now instead of faulting it in.
+            if (ph.memsz > ph.filesz && pg_ofs(ph.vaddr + ph.filesz) != 0) {
+                size_t tail = pg_ofs(ph.vaddr + ph.filesz);
+                offset_t tail_ofs = ph.off + ph.filesz - tail;
+                if ((err = pmem_alloc_zeroed(&paddr)) != ERR_OK) {
+                    goto done;
+                }
+                if (fs_read_file(f, (void*) kmap_p2v(paddr), tail, &tail_ofs) != tail) {
+                    pmem_free(paddr);
+                    err = ERR_INVAL;
+                    goto done;
+                }
+                if ((err = vpmap_map(p->as.vpmap, file_end - pg_size, paddr, 1, perm)) != ERR_OK) {
+                    pmem_free(paddr);
+                    goto done;
+                }
             }
-            read_bytes -= avail_bytes;
-            count++;
-            vaddr = 0;
+        } else {
+            file_end = start;
         }
+        // zero-filled part of the segment (bss)
+        if (mem_end > file_end &&
+            as_map_memregion(&p->as, file_end, mem_end - file_end, perm, NULL, 0, False) == NULL) {
+            err = ERR_NOMEM;
+            goto done;
+        }
+        end = mem_end;
     }
     *entry_point = elf.entry;
 
     // create memregion for heap after data segment
     if ((p->as.heap = as_map_memregion(&p->as, end, 0, MEMPERM_URW, NULL, 0, 0)) == NULL) {
-        return ERR_NOMEM;
+        err = ERR_NOMEM;
+        goto done;
     }
+    err = ERR_OK;
 
-    return ERR_OK;
+done:
+    // mapped memregions hold their own reference to the file's inode
+    fs_close_file(f);
+    return err;
 }
 
 err_t
@@ -577,10 +598,9 @@ stack_setup(struct proc *p, char **argv, vaddr_t* ret_stackptr)
     vaddr_t stacktop = USTACK_UPPERBOUND - pg_size;
 
     // allocate a page of physical memory for stack
-    if ((err = pmem_alloc(&paddr)) != ERR_OK) {
+    if ((err = pmem_alloc_zeroed(&paddr)) != ERR_OK) {
         return err;
     }
-    memset((void*) kmap_p2v(paddr), 0, pg_size);
     // create memregion for stack
     if (as_map_memregion(&p->as, USTACK_UPPERBOUND - 10*pg_size, 10*pg_size, MEMPERM_URW, NULL, 0, False) == NULL) {
         err = ERR_NOMEM;
@@ -50,6 +50,13 @@ static err_t radix_tree_add_level(struct radix_tree_root *root);
  */
 static err_t radix_tree_add_child(struct radix_tree_node *node, int index, void *child, int is_node);
 
+/*
+ * Search the subtree of node at level for the leaf with the smallest index that
+ * is at least start. Store its index in *index and return the leaf, or return
+ * NULL if there is no such leaf.
+ */
+static void *radix_tree_next_leaf(struct radix_tree_node *node, int level, int start, int *index);
+
 static struct radix_tree_node*
 radix_tree_node_create(void)
 {
@@ -139,6 +146,33 @@ radix_tree_add_child(struct radix_tree_node *node, int index, void *child, int i
     return ERR_OK;
 }
 
+static void*
+radix_tree_next_leaf(struct radix_tree_node *node, int level, int start, int *index)
+{
+    int i, first, shift, child_start;
+    void *leaf;
+
+    shift = level * RADIX_TREE_WIDTH_POWER;
+    first = radix_tree_level_index(start, level);
+    for (i = first; i < RADIX_TREE_WIDTH; i++) {
+        if (node->slots[i] == NULL) {
+            continue;
+        }
+        // smallest index under slot i, only the slot containing start can
+        // have smaller leaves to skip
+        child_start = i == first ? start :
+            ((start >> (shift + RADIX_TREE_WIDTH_POWER)) << (shift + RADIX_TREE_WIDTH_POWER)) | (i << shift);
+        if (level == 0) {
+            *index = child_start;
+            return node->slots[i];
+        }
+        if ((leaf = radix_tree_next_leaf(node->slots[i], level - 1, child_start, index)) != NULL) {
+            return leaf;
+        }
+    }
+    return NULL;
+}
+
 void
 radix_tree_construct(struct radix_tree_root *root)
 {
@@ -236,3 +270,13 @@ radix_tree_remove(struct radix_tree_root *root, int index)
     root->height = 0;
     return leaf;
 }
+
+void*
+radix_tree_next(struct radix_tree_root *root, int *index)
+{
+    kassert(root && index);
+    if (*index < 0 || *index > radix_tree_max_index(root)) {
+        return NULL;
+    }
+    return radix_tree_next_leaf(root->root_node, root->height - 1, *index, index);
+}
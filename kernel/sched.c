@@ -6,20 +6,48 @@
 #include <lib/errcode.h>
 #include <lib/stddef.h>
 
-List _ready_queue;
-List* ready_queue = &_ready_queue;
-/* 
+/*
+ * Each cpu schedules from its own run queue. A thread is always queued on the
+ * run queue of the cpu it last ran on, so a thread that is still switching out
+ * on its cpu (whose run queue lock is held until the switch finishes) can't be
+ * picked up by another cpu. Cpus with nothing to run steal from other queues.
+ */
+struct runqueue {
+    struct spinlock lock;
+    List ready_queue;
+    int nready;
+};
+static struct runqueue runqueues[MAX_NCPU];
+
+/*
  * Schedules a new thread, if no thread on the ready queue
  * current cpu's idle thread is scheduled. Returns a thread
  * if the descheduled thread needs to be reclaimed.
  * */
-static struct thread* sched(void);
+static struct thread* sched(struct runqueue *rq);
+
+/*
+ * Try to take a ready thread from another cpu's run queue. Victim locks are
+ * only try-acquired so two cpus stealing from each other can't deadlock.
+ * Return NULL if no thread could be stolen.
+ */
+static struct thread* sched_steal(struct runqueue *rq);
+
+/* Return run queue of the current cpu, interrupt must be off */
+static struct runqueue*
+this_rq(void)
+{
+    return &runqueues[cpu_id(mycpu())];
+}
 
 void
 sched_sys_init(void)
 {
-    list_init(ready_queue);
-    spinlock_init(&sched_lock);
+    for (int i = 0; i < MAX_NCPU; i++) {
+        list_init(&runqueues[i].ready_queue);
+        spinlock_init(&runqueues[i].lock);
+        runqueues[i].nready = 0;
+    }
 }
 
 err_t
@@ -53,51 +81,100 @@ void
 sched_ready(struct thread *t)
 {
     kassert(t);
-    spinlock_acquire(&sched_lock);
+    struct runqueue *rq;
+
+    // new threads go to the current cpu, others back to the cpu they last ran on
+    intr_set_level(INTR_OFF);
+    if (t->cpu < 0) {
+        t->cpu = cpu_id(mycpu());
+    }
+    rq = &runqueues[t->cpu];
+    spinlock_acquire(&rq->lock);
     t->state = READY;
-    list_append(ready_queue, &t->node);
-    spinlock_release(&sched_lock);
+    list_append(&rq->ready_queue, &t->node);
+    rq->nready++;
+    spinlock_release(&rq->lock);
+    intr_set_level(INTR_ON);
 }
 
 void
 sched_sched(threadstate_t next_state, void* lock)
 {
     struct thread *curr = thread_current();
-    spinlock_acquire(&sched_lock);
+    intr_set_level(INTR_OFF);
+    struct runqueue *rq = this_rq();
+    spinlock_acquire(&rq->lock);
+    intr_set_level(INTR_ON);
     if (next_state == READY && curr != cpu_idle_thread(mycpu())) {
-        list_append(ready_queue, &curr->node);
+        list_append(&rq->ready_queue, &curr->node);
+        rq->nready++;
     }
     curr->state = next_state;
     if (lock) {
         lock_release(lock);
     }
 
-    /* 
+    /*
      * schedule a new thread and see if any thread needs to be cleaned up
-     * newly scheduled thread will release the scheduler lock acquired by the previous thread
+     * newly scheduled thread will release the run queue lock acquired by the previous thread
      */
-    struct thread *dying = sched();
-    spinlock_release(&sched_lock);
+    struct thread *dying = sched(rq);
+    // we might have been resumed on a different cpu
+    spinlock_release(&this_rq()->lock);
     if (dying) {
         thread_cleanup(dying);
     }
 }
 
-// function to schedule thread, sched_lock must be held before calling this function
+void
+sched_release_lock(void)
+{
+    kassert(intr_get_level() == INTR_OFF);
+    spinlock_release(&this_rq()->lock);
+}
+
+static struct thread*
+sched_steal(struct runqueue *rq)
+{
+    int self = rq - runqueues;
+    struct thread *t = NULL;
+
+    for (int i = 1; i < ncpu && t == NULL; i++) {
+        int victim = (self + i) % ncpu;
+        struct runqueue *vrq = &runqueues[victim];
+        // racy peek, avoids touching locks of cpus that have nothing to give
+        if (vrq->nready == 0 || spinlock_try_acquire(&vrq->lock) != ERR_OK) {
+            continue;
+        }
+        if (!list_empty(&vrq->ready_queue)) {
+            // take the thread that has waited the least, it's the coldest in victim's cache
+            Node *n = list_prev(list_end(&vrq->ready_queue));
+            list_remove(n);
+            vrq->nready--;
+            t = list_entry(n, struct thread, node);
+            t->cpu = self;
+        }
+        spinlock_release(&vrq->lock);
+    }
+    return t;
+}
+
+// function to schedule thread, rq's lock must be held before calling this function
 static struct thread*
-sched(void)
+sched(struct runqueue *rq)
 {
     void *cpu = mycpu();
     struct thread *curr = thread_current();
     struct thread *prev = NULL;
     struct thread *next = NULL;
 
-    if (!list_empty(ready_queue)) {
-        Node *n = list_begin(ready_queue);
+    if (!list_empty(&rq->ready_queue)) {
+        Node *n = list_begin(&rq->ready_queue);
         next = (struct thread*) list_entry(n, struct thread, node);
         kassert(next->state == READY);
         list_remove(n);
-    } else {
+        rq->nready--;
+    } else if ((next = sched_steal(rq)) == NULL) {
         // if current thread is not the idle thread, schedules to idle thread of the cpu
         struct thread *idle = cpu_idle_thread(cpu);
         next = idle;
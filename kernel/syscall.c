@@ -3,6 +3,7 @@
 #include <kernel/console.h>
 #include <kernel/kmalloc.h>
 #include <kernel/fs.h>
+#include <kernel/shmms.h>
 #include <lib/syscall-num.h>
 #include <lib/errcode.h>
 #include <lib/stddef.h>
@@ -33,6 +34,11 @@ static sysret_t sys_dup(void* arg);
 static sysret_t sys_pipe(void* arg);
 static sysret_t sys_info(void* arg);
 static sysret_t sys_halt(void* arg);
+static sysret_t sys_mmap(void* arg);
+static sysret_t sys_munmap(void* arg);
+static sysret_t sys_shmcreate(void* arg);
+static sysret_t sys_shmattach(void* arg);
+static sysret_t sys_shmdetach(void* arg);
 
 extern size_t user_pgfault;
 struct sys_info {
@@ -52,6 +58,15 @@ static bool validate_str(char *s);
  * Validate buffer passed by user.
  */
 static bool validate_bufptr(void* buf, size_t size);
+/*
+ * Validate shared memory segment name passed by user.
+ */
+static err_t validate_shm_name(char *name);
+/*
+ * Map the whole shared memory segment store into the current address space
+ * and drop the caller's reference on it.
+ */
+static sysret_t shm_map(struct memstore *store);
 
 
 static sysret_t (*syscalls[])(void*) = {
@@ -78,6 +93,11 @@ static sysret_t (*syscalls[])(void*) = {
     [SYS_pipe] = sys_pipe,
     [SYS_info] = sys_info,
     [SYS_halt] = sys_halt,
+    [SYS_mmap] = sys_mmap,
+    [SYS_munmap] = sys_munmap,
+    [SYS_shmcreate] = sys_shmcreate,
+    [SYS_shmattach] = sys_shmattach,
+    [SYS_shmdetach] = sys_shmdetach,
 };
 
 static bool
@@ -111,6 +131,18 @@ validate_bufptr(void* buf, size_t size)
     return True;
 }
 
+static err_t
+validate_shm_name(char *name)
+{
+    if (!validate_str(name)) {
+        return ERR_FAULT;
+    }
+    if (name[0] == 0 || strlen(name) >= SHM_NAME_LEN) {
+        return ERR_INVAL;
+    }
+    return ERR_OK;
+}
+
 /*
  * Verifies that the given file descriptor is within the bounds of possible
  * file descriptor values, and that the given file descriptor is currently
@@ -755,6 +787,228 @@ sys_halt(void* arg)
     panic("shutdown failed");
 }
 
+/*
+ * Check that a mapping of size bytes fits below the user stack, at addr if addr
+ * is not 0. Rounding size up to pages must not wrap around either.
+ */
+static bool validate_map_range(vaddr_t addr, size_t size);
+
+static bool
+validate_map_range(vaddr_t addr, size_t size)
+{
+    size_t len = pg_round_up(size);
+
+    if (size == 0 || len < size || len > USTACK_LOWERBOUND) {
+        return False;
+    }
+    return addr == 0 || addr <= USTACK_LOWERBOUND - len;
+}
+
+/*
+ * Corresponds to void *mmap(void *addr, size_t length, int prot, int flags, int fd, size_t offset);
+ *
+ * Map anonymous memory (MAP_ANON) or the file at fd into the address space,
+ * shared (MAP_SHARED) or private (MAP_PRIVATE). Pages are faulted in on first
+ * access, file pages from the inode's page cache.
+ *
+ * Return:
+ * On success, address of the mapped memory.
+ * ERR_INVAL - length is 0, flags are invalid, or addr/offset is not page aligned.
+ * ERR_INVAL - The mapping does not fit below the user stack.
+ * ERR_INVAL - fd isn't a valid open file descriptor, or was not opened for
+ *             reading.
+ * ERR_INVAL - A file is mapped shared and writable.
+ * ERR_FTYPE - fd does not point to a regular file.
+ * ERR_NOMEM - Failed to allocate memory, or the address range is in use.
+ */
+static sysret_t
+sys_mmap(void *arg)
+{
+    sysarg_t addr, length, prot, flags, fd, offset;
+    struct memstore *store = NULL;
+    struct memregion *r;
+    struct file *file;
+    memperm_t perm;
+    int shared;
+
+    kassert(fetch_arg(arg, 1, &addr));
+    kassert(fetch_arg(arg, 2, &length));
+    kassert(fetch_arg(arg, 3, &prot));
+    kassert(fetch_arg(arg, 4, &flags));
+    kassert(fetch_arg(arg, 5, &fd));
+    kassert(fetch_arg(arg, 6, &offset));
+
+    shared = (flags & MAP_SHARED) != 0;
+    if (!validate_map_range(addr, length) || shared == ((flags & MAP_PRIVATE) != 0) ||
+        !pg_aligned(addr) || !pg_aligned(offset)) {
+        return ERR_INVAL;
+    }
+    perm = (prot & PROT_WRITE) ? MEMPERM_URW : MEMPERM_UR;
+
+    if (flags & MAP_ANON) {
+        // private anonymous memory is plain zero-filled memory, shared
+        // anonymous memory needs a store so forked children see the same pages
+        if (shared && (store = shmms_alloc(length)) == NULL) {
+            return ERR_NOMEM;
+        }
+        offset = 0;
+    } else {
+        if (!validate_fd((int) fd)) {
+            return ERR_INVAL;
+        }
+        file = get_fd((int) fd);
+        if (file->f_inode == NULL || file->f_inode->i_ftype != FTYPE_FILE || file->f_inode->store == NULL) {
+            return ERR_FTYPE;
+        }
+        // Pages are always read. Shared file mappings map the page cache
+        // directly, and writes through them would never reach the file, so
+        // they must be read-only.
+        if (file->oflag == FS_WRONLY || (shared && perm == MEMPERM_URW)) {
+            return ERR_INVAL;
+        }
+        store = file->f_inode->store;
+    }
+
+    if ((r = as_map_memregion(&proc_current()->as, addr ? addr : ADDR_ANYWHERE,
+        length, perm, store, offset, shared)) == NULL) {
+        if (store && (flags & MAP_ANON)) {
+            shmms_free(store);
+        }
+        return ERR_NOMEM;
+    }
+    r->mmapped = True;
+    return r->start;
+}
+
+/*
+ * Corresponds to int munmap(void *addr, size_t length);
+ *
+ * Unmap a whole mapping created by mmap.
+ *
+ * Return:
+ * ERR_OK - Memory successfully unmapped.
+ * ERR_INVAL - addr and length do not match a mapping created by mmap.
+ */
+static sysret_t
+sys_munmap(void *arg)
+{
+    sysarg_t addr, length;
+    struct addrspace *as = &proc_current()->as;
+    struct memregion *r;
+
+    kassert(fetch_arg(arg, 1, &addr));
+    kassert(fetch_arg(arg, 2, &length));
+
+    // partial unmaps would need to split regions, only whole mappings are supported
+    if ((r = as_find_memregion(as, addr, 1)) == NULL || r->start != addr ||
+        pg_round_up(r->end - r->start) != pg_round_up(length) || !r->mmapped) {
+        return ERR_INVAL;
+    }
+    memregion_unmap(r);
+    return ERR_OK;
+}
+
+static sysret_t
+shm_map(struct memstore *store)
+{
+    struct memregion *r;
+
+    r = as_map_memregion(&proc_current()->as, ADDR_ANYWHERE, shmms_size(store),
+        MEMPERM_URW, store, 0, 1);
+    // the mapping holds its own reference if it succeeded
+    store->unref(store);
+    return r ? (sysret_t) r->start : ERR_NOMEM;
+}
+
+/*
+ * Corresponds to void *shmcreate(const char *name, size_t size);
+ *
+ * Create a named shared memory segment and map it into the address space.
+ *
+ * Return:
+ * On success, address of the mapped segment.
+ * ERR_FAULT - Address of name is invalid.
+ * ERR_INVAL - name is empty or too long, or size is 0 or does not fit below the
+ *             user stack.
+ * ERR_EXIST - A segment called name already exists.
+ * ERR_NOMEM - Failed to allocate memory.
+ */
+static sysret_t
+sys_shmcreate(void *arg)
+{
+    sysarg_t name, size;
+    struct memstore *store;
+    err_t err;
+
+    kassert(fetch_arg(arg, 1, &name));
+    kassert(fetch_arg(arg, 2, &size));
+
+    if ((err = validate_shm_name((char*) name)) != ERR_OK) {
+        return err;
+    }
+    if (!validate_map_range(0, size)) {
+        return ERR_INVAL;
+    }
+    if ((err = shmms_create((char*) name, pg_round_up(size), &store)) != ERR_OK) {
+        return err;
+    }
+    return shm_map(store);
+}
+
+/*
+ * Corresponds to void *shmattach(const char *name);
+ *
+ * Map the named shared memory segment into the address space.
+ *
+ * Return:
+ * On success, address of the mapped segment.
+ * ERR_FAULT - Address of name is invalid.
+ * ERR_INVAL - name is empty or too long.
+ * ERR_NOTEXIST - No segment called name exists.
+ * ERR_NOMEM - Failed to allocate memory.
+ */
+static sysret_t
+sys_shmattach(void *arg)
+{
+    sysarg_t name;
+    struct memstore *store;
+    err_t err;
+
+    kassert(fetch_arg(arg, 1, &name));
+
+    if ((err = validate_shm_name((char*) name)) != ERR_OK) {
+        return err;
+    }
+    if ((store = shmms_lookup((char*) name)) == NULL) {
+        return ERR_NOTEXIST;
+    }
+    return shm_map(store);
+}
+
+/*
+ * Corresponds to int shmdetach(void *addr);
+ *
+ * Unmap the shared memory segment mapped at addr.
+ *
+ * Return:
+ * ERR_OK - Segment successfully unmapped.
+ * ERR_INVAL - addr is not the address of a mapped segment.
+ */
+static sysret_t
+sys_shmdetach(void *arg)
+{
+    sysarg_t addr;
+    struct memregion *r;
+
+    kassert(fetch_arg(arg, 1, &addr));
+
+    if ((r = as_find_memregion(&proc_current()->as, addr, 1)) == NULL ||
+        r->start != addr || !shmms_is_segment(r->store)) {
+        return ERR_INVAL;
+    }
+    memregion_unmap(r);
+    return ERR_OK;
+}
 
 sysret_t
 syscall(int num, void *arg)
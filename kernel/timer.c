@@ -9,6 +9,8 @@
 
 static uint32_t ticks;
 static struct spinlock timer_lock;
+// threads in timer_sleep, woken on every tick
+static struct condvar timer_cv;
 
 /*
  * timer trap handler
@@ -21,6 +23,7 @@ timer_trap_handler(irq_t irq, void *dev, void *regs)
     // Increment timer ticks
     spinlock_acquire(&timer_lock);
     ticks++;
+    condvar_broadcast(&timer_cv);
     spinlock_release(&timer_lock);
     trap_notify_irq_completion();
     sched_sched(READY, NULL);
@@ -30,5 +33,25 @@ err_t timer_register_trap_handler(void)
 {
     ticks = 0;
     spinlock_init(&timer_lock);
+    condvar_init(&timer_cv);
     return trap_register_handler(T_IRQ_TIMER, NULL, timer_trap_handler);
 }
+
+uint32_t
+timer_get_ticks(void)
+{
+    return ticks;
+}
+
+void
+timer_sleep(uint32_t nticks)
+{
+    uint32_t start;
+
+    spinlock_acquire(&timer_lock);
+    start = ticks;
+    while (ticks - start < nticks) {
+        condvar_wait(&timer_cv, &timer_lock);
+    }
+    spinlock_release(&timer_lock);
+}
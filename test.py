@@ -22,6 +22,8 @@ test_weights = {
     "2-dup-read": 2,
     "2-fd-limit": 3,
     "2-fstat-test": 2,
+    "2-large-file": 0,
+    "2-many-names": 0,
     "2-open-bad-args": 12,
     "2-open-twice": 12,
     "2-read-bad-args": 12,
@@ -40,9 +42,12 @@ test_weights = {
     "4-grow-stack": 25,
     "4-grow-stack-edgecase": 10,
     "4-malloc-test": 10,
+    "4-mmap-test": 0,
     "4-sbrk-decrement": 15,
     "4-sbrk-large": 15,
-    "4-sbrk-small": 15
+    "4-sbrk-small": 15,
+    "4-shm-test": 0,
+    "4-swap-test": 0
 }
 
 # ANSI color
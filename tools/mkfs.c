@@ -29,7 +29,6 @@
 #define JOURNAL_START_BLK (BMAP_START_BLK + BMAP_BLKS)
 #define JOURNAL_BLKS 256
 #define DATA_START_BLK (JOURNAL_START_BLK + JOURNAL_BLKS)
-#define MAX_FILE_SIZE ((SFS_NDIRECT + SFS_NINDIRECT * (BDEV_BLK_SIZE / sizeof(uint32_t))) * BDEV_BLK_SIZE)
 
 // File system image file descriptor
 static int fsfd;
@@ -40,6 +39,9 @@ static inum_t root_inum;
 // Inode bitmap
 static uint8_t inode_bmap[BDEV_BLK_SIZE];
 
+// Next free data block, data blocks are handed out in order
+static blk_t next_data_blk = DATA_START_BLK;
+
 // Write buffer content to a disk block
 static void write_blk(int blk, void *buf);
 // Read a disk block into buffer
@@ -50,12 +52,16 @@ static inum_t alloc_inode(ftype_t i_ftype);
 static void read_inode(inum_t inum, struct sfs_inode *inode);
 // Write an inode to disk
 static void write_inode(inum_t inum, struct sfs_inode *inode);
-// Append data to an inode. Caller responsible for updating inode on disk.
+// Give an inode a single extent large enough for size bytes. Caller
+// responsible for updating inode on disk.
+static void inode_reserve(struct sfs_inode *inode, size_t size);
+// Append data to an inode within its extent. Caller responsible for updating
+// inode on disk.
 static void inode_append(struct sfs_inode *inode, char *data, size_t size);
-// Get the data block number. Caller responsible for updating inode on disk.
+// Get the data block number.
 static blk_t get_data_block(struct sfs_inode *inode, off_t ofs);
-// Allocate and return a new data block.
-static blk_t alloc_data_block(void);
+// Allocate nblks consecutive data blocks and return the first one.
+static blk_t alloc_data_blocks(size_t nblks);
 // Search a bitmap and return the index of the first free element. Caller
 // responsible for updating bitmap block on disk.
 static int bmap_alloc_element(uint8_t *bmap, size_t size);
@@ -112,6 +118,7 @@ alloc_inode(ftype_t ftype)
     memset(&inode, 0, sizeof(inode));
     inode.i_ftype = ftype;
     inode.i_nlink = 1;
+    inode.i_eh.eh_max = SFS_INODE_EXTENTS;
     write_inode(inum, &inode);
 
     return inum;
@@ -136,6 +143,21 @@ write_inode(inum_t inum, struct sfs_inode *inode)
     write_blk(inum_to_blk(inum), buf);
 }
 
+static void
+inode_reserve(struct sfs_inode *inode, size_t size)
+{
+    size_t nblks;
+
+    assert(inode->i_eh.eh_entries == 0);
+    if ((nblks = (size + BDEV_BLK_SIZE - 1) / BDEV_BLK_SIZE) == 0) {
+        return;
+    }
+    inode->i_extents[0].e_lblk = 0;
+    inode->i_extents[0].e_start = alloc_data_blocks(nblks);
+    inode->i_extents[0].e_len = nblks;
+    inode->i_eh.eh_entries = 1;
+}
+
 static void
 inode_append(struct sfs_inode *inode, char *data, size_t size)
 {
@@ -156,66 +178,37 @@ inode_append(struct sfs_inode *inode, char *data, size_t size)
 static blk_t
 get_data_block(struct sfs_inode *inode, off_t ofs)
 {
-    int blk_index, indir_blk_index, indir_blk_ofs;
-    blk_t blk;
-    char buf[BDEV_BLK_SIZE];
+    struct sfs_extent *ext = &inode->i_extents[0];
 
-    if (ofs >= MAX_FILE_SIZE) {
-        perror("File size exceeds limit");
+    if (inode->i_eh.eh_entries == 0 || ofs / BDEV_BLK_SIZE >= ext->e_len) {
+        fprintf(stderr, "Write past reserved file size\n");
         exit(1);
     }
-    blk_index = ofs / BDEV_BLK_SIZE;
-    if (blk_index < SFS_NDIRECT) {
-        // Direct block
-        blk = inode->i_addrs[blk_index];
-        if (blk == 0) {
-            blk = alloc_data_block();
-            inode->i_addrs[blk_index] = blk;
-        }
-    } else {
-        // Indirect block
-        indir_blk_index = SFS_NDIRECT + (blk_index - SFS_NDIRECT) / (BDEV_BLK_SIZE / sizeof(uint32_t));
-        if (inode->i_addrs[indir_blk_index] == 0) {
-            // Indirect block doesn't exist yet
-            inode->i_addrs[indir_blk_index] = alloc_data_block();
-        }
-        // Read indirect block
-        read_blk(inode->i_addrs[indir_blk_index], buf);
-        indir_blk_ofs = (blk_index - SFS_NDIRECT) % (BDEV_BLK_SIZE / sizeof(uint32_t));
-        blk = ((blk_t*)buf)[indir_blk_ofs];
-        if (blk == 0) {
-            blk = alloc_data_block();
-            ((blk_t*)buf)[indir_blk_ofs] = blk;
-            write_blk(inode->i_addrs[indir_blk_index], buf);
-        }
-    }
-
-    return blk;
+    return ext->e_start + ofs / BDEV_BLK_SIZE;
 }
 
 static blk_t
-alloc_data_block(void)
+alloc_data_blocks(size_t nblks)
 {
     uint8_t bmap[BDEV_BLK_SIZE];
-    char buf[BDEV_BLK_SIZE];
-    blk_t bmap_blk, blk;
-    size_t num_blks;
-    int index;
+    blk_t blk, bmap_blk, index;
 
-    for (bmap_blk = BMAP_START_BLK, num_blks = FS_SIZE; bmap_blk < JOURNAL_START_BLK; bmap_blk++, num_blks -= BDEV_BLK_SIZE * 8) {
+    if (next_data_blk + nblks > DATA_START_BLK + FS_SIZE) {
+        fprintf(stderr, "Failed to allocate %lu data blocks\n", (unsigned long) nblks);
+        exit(1);
+    }
+    // Mark the blocks in-use in the data bitmap. The image starts out zeroed,
+    // so the blocks are already filled with zero.
+    for (blk = next_data_blk; blk < next_data_blk + nblks; blk++) {
+        index = blk - DATA_START_BLK;
+        bmap_blk = BMAP_START_BLK + index / (BDEV_BLK_SIZE * 8);
         read_blk(bmap_blk, bmap);
-        if ((index = bmap_alloc_element(bmap, min(BDEV_BLK_SIZE, num_blks / 8))) >= 0) {
-            // Update on-disk bitmap
-            write_blk(bmap_blk, bmap);
-            blk = DATA_START_BLK + BDEV_BLK_SIZE * 8 * (bmap_blk - BMAP_START_BLK) + index;
-            // Fill newly allocated block with zero
-            memset(buf, 0, BDEV_BLK_SIZE);
-            write_blk(blk, buf);
-            return blk;
-        }
+        bmap[(index % (BDEV_BLK_SIZE * 8)) / 8] |= 1 << (index % 8);
+        write_blk(bmap_blk, bmap);
     }
-    perror("Failed to allocate data block");
-    exit(1);
+    blk = next_data_blk;
+    next_data_blk += nblks;
+    return blk;
 }
 
 static int
@@ -256,6 +249,7 @@ main(int argc, char *argv[])
     int blk, i, fd;
     inum_t inum;
     size_t sz;
+    off_t fsize;
     char buf[BDEV_BLK_SIZE];
     struct sfs_dirent dirent;
     struct sfs_inode root_inode, file_inode;
@@ -291,6 +285,8 @@ main(int argc, char *argv[])
     root_inum = alloc_inode(FTYPE_DIR);
     assert(root_inum == ROOT_INUM);
     read_inode(root_inum, &root_inode);
+    // Lay the root directory out as a single extent
+    inode_reserve(&root_inode, (argc - 2) * sizeof(struct sfs_dirent));
 
     // Add input binary files to the root directory
     for (i = 2; i < argc; i++) {
@@ -306,7 +302,12 @@ main(int argc, char *argv[])
         strncpy(dirent.name, basename(argv[i]), SFS_DIRENT_NAMELEN);
         dirent.name[SFS_DIRENT_NAMELEN-1] = 0;
         inode_append(&root_inode, (char*)&dirent, sizeof(dirent));
-        // Write file content to file system image
+        // Write file content to file system image, in one extent
+        if ((fsize = lseek(fd, 0, SEEK_END)) < 0 || lseek(fd, 0, SEEK_SET) != 0) {
+            perror("lseek failed");
+            exit(1);
+        }
+        inode_reserve(&file_inode, fsize);
         while ((sz = read(fd, buf, BDEV_BLK_SIZE)) > 0) {
             inode_append(&file_inode, buf, sz);
         }
@@ -0,0 +1,88 @@
+#include <lib/test.h>
+#include <lib/string.h>
+
+// Larger than the old limit of 12 direct and 1 indirect blocks
+#define NCHUNKS 128
+#define CHUNK_SIZE 4096
+
+static char buf[CHUNK_SIZE];
+
+static void
+fill(int chunk)
+{
+    int i;
+
+    for (i = 0; i < CHUNK_SIZE; i++) {
+        buf[i] = (char) (chunk * 7 + i);
+    }
+}
+
+static void
+check(int chunk)
+{
+    int i;
+
+    for (i = 0; i < CHUNK_SIZE; i++) {
+        if (buf[i] != (char) (chunk * 7 + i)) {
+            error("byte %d of chunk %d was %d", i, chunk, buf[i]);
+        }
+    }
+}
+
+int
+main()
+{
+    int fd, i, j;
+    struct stat st;
+
+    if ((fd = open("/largefile", FS_RDWR | FS_CREAT, EMPTY_MODE)) < 0) {
+        error("unable to create large file, return value was %d", fd);
+    }
+
+    for (i = 0; i < NCHUNKS; i++) {
+        fill(i);
+        if ((j = write(fd, buf, CHUNK_SIZE)) != CHUNK_SIZE) {
+            error("write of chunk %d returned %d", i, j);
+        }
+    }
+
+    if ((i = fstat(fd, &st)) != ERR_OK) {
+        error("fstat failed, return value was %d", i);
+    }
+
+    if (st.size != NCHUNKS * CHUNK_SIZE) {
+        error("file size was %d, expected %d", (int) st.size, NCHUNKS * CHUNK_SIZE);
+    }
+
+    if ((i = close(fd)) != ERR_OK) {
+        error("error closing fd, return value was %d", i);
+    }
+
+    // Read the file back from a fresh open
+    if ((fd = open("/largefile", FS_RDONLY, EMPTY_MODE)) < 0) {
+        error("unable to reopen large file, return value was %d", fd);
+    }
+
+    for (i = 0; i < NCHUNKS; i++) {
+        if ((j = read(fd, buf, CHUNK_SIZE)) != CHUNK_SIZE) {
+            error("read of chunk %d returned %d", i, j);
+        }
+        check(i);
+    }
+
+    if ((i = read(fd, buf, CHUNK_SIZE)) != 0) {
+        error("read past the end of file returned %d", i);
+    }
+
+    if ((i = close(fd)) != ERR_OK) {
+        error("error closing fd, return value was %d", i);
+    }
+
+    if ((i = unlink("/largefile")) != ERR_OK) {
+        error("unable to unlink large file, return value was %d", i);
+    }
+
+    pass("large-file");
+    exit(0);
+    return 0;
+}
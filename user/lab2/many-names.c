@@ -0,0 +1,113 @@
+#include <lib/test.h>
+#include <lib/string.h>
+
+// Enough names to index the directory and split its buckets
+#define NNAMES 400
+
+static char path[64];
+
+// Build the path of the i-th name, with prefix p
+static char*
+name(char p, int i)
+{
+    strcpy(path, "/manynames/");
+    path[11] = p;
+    path[12] = '0' + i / 100;
+    path[13] = '0' + i / 10 % 10;
+    path[14] = '0' + i % 10;
+    path[15] = 0;
+    return path;
+}
+
+static void
+lookup(char *pathname, int inum)
+{
+    int fd, i;
+    struct stat st;
+
+    if ((fd = open(pathname, FS_RDONLY, EMPTY_MODE)) < 0) {
+        error("unable to open %s, return value was %d", pathname, fd);
+    }
+    if ((i = fstat(fd, &st)) != ERR_OK) {
+        error("fstat of %s failed, return value was %d", pathname, i);
+    }
+    if (st.inode_num != inum) {
+        error("%s was inode %d, expected %d", pathname, st.inode_num, inum);
+    }
+    if ((i = close(fd)) != ERR_OK) {
+        error("error closing %s, return value was %d", pathname, i);
+    }
+}
+
+int
+main()
+{
+    int fd, i, inum;
+    struct stat st;
+
+    if ((i = mkdir("/manynames")) != ERR_OK) {
+        error("unable to create directory, return value was %d", i);
+    }
+
+    // Names are hard links to a single file so the test doesn't run out of inodes
+    if ((fd = open("/manynames/target", FS_RDWR | FS_CREAT, EMPTY_MODE)) < 0) {
+        error("unable to create target, return value was %d", fd);
+    }
+    if ((i = fstat(fd, &st)) != ERR_OK) {
+        error("fstat of target failed, return value was %d", i);
+    }
+    inum = st.inode_num;
+    if ((i = close(fd)) != ERR_OK) {
+        error("error closing target, return value was %d", i);
+    }
+
+    for (i = 0; i < NNAMES; i++) {
+        if ((fd = link("/manynames/target", name('a', i))) != ERR_OK) {
+            error("unable to link %s, return value was %d", path, fd);
+        }
+    }
+    for (i = 0; i < NNAMES; i++) {
+        lookup(name('a', i), inum);
+    }
+    if ((fd = open(name('b', 0), FS_RDONLY, EMPTY_MODE)) != ERR_NOTEXIST) {
+        error("opened %s which was never created, return value was %d", path, fd);
+    }
+    if ((i = link("/manynames/target", name('a', 7))) != ERR_EXIST) {
+        error("linked %s twice, return value was %d", path, i);
+    }
+
+    // Free every other slot, then fill the freed slots with new names
+    for (i = 0; i < NNAMES; i += 2) {
+        if ((fd = unlink(name('a', i))) != ERR_OK) {
+            error("unable to unlink %s, return value was %d", path, fd);
+        }
+    }
+    for (i = 0; i < NNAMES; i += 2) {
+        if ((fd = open(name('a', i), FS_RDONLY, EMPTY_MODE)) != ERR_NOTEXIST) {
+            error("opened %s after unlinking it, return value was %d", path, fd);
+        }
+        if ((fd = link("/manynames/target", name('b', i))) != ERR_OK) {
+            error("unable to link %s, return value was %d", path, fd);
+        }
+    }
+    for (i = 0; i < NNAMES; i++) {
+        lookup(i % 2 == 0 ? name('b', i) : name('a', i), inum);
+    }
+
+    // Clean up
+    for (i = 0; i < NNAMES; i++) {
+        if ((fd = unlink(i % 2 == 0 ? name('b', i) : name('a', i))) != ERR_OK) {
+            error("unable to unlink %s, return value was %d", path, fd);
+        }
+    }
+    if ((i = unlink("/manynames/target")) != ERR_OK) {
+        error("unable to unlink target, return value was %d", i);
+    }
+    if ((i = rmdir("/manynames")) != ERR_OK) {
+        error("unable to remove directory, return value was %d", i);
+    }
+
+    pass("many-names");
+    exit(0);
+    return 0;
+}
@@ -0,0 +1,83 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+#include <lib/string.h>
+
+#define PGSIZE 4096
+
+int
+main()
+{
+    int fd, i, status;
+    char *a, *f;
+    char buf[128];
+    volatile int *shared;
+
+    // private anonymous memory is zero-filled and writable
+    if ((long) (a = mmap(NULL, 3 * PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0)) < 0) {
+        error("mmap anonymous failed, return value was %d", a);
+    }
+    for (i = 0; i < 3 * PGSIZE; i++) {
+        assert(a[i] == 0);
+        a[i] = (char) i;
+    }
+    for (i = 0; i < 3 * PGSIZE; i++) {
+        assert(a[i] == (char) i);
+    }
+    assert(munmap(a, 3 * PGSIZE) == ERR_OK);
+    assert(munmap(a, 3 * PGSIZE) == ERR_INVAL);
+
+    // private file mapping has the file's content
+    assert((fd = open("/smallfile", FS_RDONLY, EMPTY_MODE)) >= 0);
+    assert(read(fd, buf, sizeof(buf)) == sizeof(buf));
+    if ((long) (f = mmap(NULL, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0)) < 0) {
+        error("mmap file failed, return value was %d", f);
+    }
+    assert(memcmp(f, buf, sizeof(buf)) == 0);
+    // a read-only file can't be mapped shared and writable
+    assert((long) mmap(NULL, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) == ERR_INVAL);
+    assert(munmap(f, PGSIZE) == ERR_OK);
+
+    // writes to a private writable file mapping don't reach the file
+    if ((long) (f = mmap(NULL, PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) < 0) {
+        error("mmap private writable file failed, return value was %d", f);
+    }
+    f[0] = ~buf[0];
+    assert(munmap(f, PGSIZE) == ERR_OK);
+    close(fd);
+    assert((fd = open("/smallfile", FS_RDONLY, EMPTY_MODE)) >= 0);
+    assert(read(fd, buf + 1, 1) == 1 && buf[1] == buf[0]);
+    close(fd);
+
+    // shared anonymous memory is shared with forked children
+    if ((long) (shared = mmap(NULL, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0)) < 0) {
+        error("mmap shared anonymous failed, return value was %d", shared);
+    }
+    *shared = 1;
+    if (fork() == 0) {
+        assert(*shared == 1);
+        *shared = 2;
+        exit(0);
+    }
+    assert(wait(-1, &status) >= 0);
+    if (*shared != 2) {
+        error("child's write to shared memory not seen, value was %d", *shared);
+    }
+    assert(munmap((void*) shared, PGSIZE) == ERR_OK);
+
+    // bad arguments
+    assert((long) mmap(NULL, 0, PROT_READ, MAP_PRIVATE | MAP_ANON, -1, 0) == ERR_INVAL);
+    assert((long) mmap(NULL, PGSIZE, PROT_READ, MAP_SHARED | MAP_PRIVATE | MAP_ANON, -1, 0) == ERR_INVAL);
+    assert((long) mmap(NULL, PGSIZE, PROT_READ, MAP_PRIVATE, 100, 0) == ERR_INVAL);
+    assert((long) mmap(NULL, (size_t) -PGSIZE, PROT_READ, MAP_PRIVATE | MAP_ANON, -1, 0) == ERR_INVAL);
+    assert((long) mmap((void*) 0x10000000, (size_t) -0x10000, PROT_READ, MAP_PRIVATE | MAP_ANON, -1, 0) == ERR_INVAL);
+    // shared writable file mappings are not supported
+    assert((fd = open("/smallfile", FS_RDWR, EMPTY_MODE)) >= 0);
+    assert((long) mmap(NULL, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) == ERR_INVAL);
+    close(fd);
+    // only mappings made by mmap can be unmapped
+    assert(munmap((void*) ((long) &status & ~(PGSIZE - 1)), PGSIZE) == ERR_INVAL);
+
+    pass("mmap-test");
+    exit(0);
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+#include <lib/string.h>
+
+#define PGSIZE 4096
+
+int
+main()
+{
+    int i, pid, status;
+    volatile int *seg, *seg2;
+    char *big;
+
+    // a new segment is zero-filled and mapped into the creator
+    if ((long) (seg = shmcreate("shm-test", PGSIZE)) < 0) {
+        error("shmcreate failed, return value was %d", seg);
+    }
+    assert(seg[0] == 0);
+    seg[0] = 1;
+    assert((long) shmcreate("shm-test", PGSIZE) == ERR_EXIST);
+
+    // a second attachment in the same process sees the same memory
+    if ((long) (seg2 = shmattach("shm-test")) < 0) {
+        error("shmattach failed, return value was %d", seg2);
+    }
+    assert(seg2 != seg && seg2[0] == 1);
+    seg2[0] = 2;
+    assert(seg[0] == 2);
+    assert(shmdetach((void*) seg2) == ERR_OK);
+    assert(shmdetach((void*) seg2) == ERR_INVAL);
+
+    // a child attaching by name writes to the parent's segment
+    if ((pid = fork()) == 0) {
+        assert(shmdetach((void*) seg) == ERR_OK);
+        if ((long) (seg = shmattach("shm-test")) < 0) {
+            error("child shmattach failed, return value was %d", seg);
+        }
+        assert(seg[0] == 2);
+        seg[0] = 3;
+        exit(0);
+    }
+    assert(wait(pid, &status) == pid);
+    if (seg[0] != 3) {
+        error("child's write to segment not seen, value was %d", seg[0]);
+    }
+
+    // the segment goes away once nobody has it attached
+    assert(shmdetach((void*) seg) == ERR_OK);
+    assert((long) shmattach("shm-test") == ERR_NOTEXIST);
+    if ((long) (seg = shmcreate("shm-test", PGSIZE)) < 0) {
+        error("shmcreate after last detach failed, return value was %d", seg);
+    }
+    assert(seg[0] == 0);
+    assert(shmdetach((void*) seg) == ERR_OK);
+
+    // multi-page segments
+    if ((long) (big = shmcreate("shm-test-big", 4 * PGSIZE)) < 0) {
+        error("shmcreate multi-page failed, return value was %d", big);
+    }
+    for (i = 0; i < 4 * PGSIZE; i++) {
+        big[i] = (char) i;
+    }
+    if ((pid = fork()) == 0) {
+        big = shmattach("shm-test-big");
+        for (i = 0; i < 4 * PGSIZE; i++) {
+            assert(big[i] == (char) i);
+        }
+        exit(0);
+    }
+    assert(wait(pid, &status) == pid);
+    assert(shmdetach(big) == ERR_OK);
+
+    // bad arguments
+    assert((long) shmcreate("", PGSIZE) == ERR_INVAL);
+    assert((long) shmcreate("shm-test", 0) == ERR_INVAL);
+    assert((long) shmcreate("shm-test", (size_t) -1) == ERR_INVAL);
+    assert((long) shmcreate("shm-test", (size_t) 1 << 62) == ERR_INVAL);
+    assert((long) shmcreate("a-name-that-is-too-long-to-be-a-segment", PGSIZE) == ERR_INVAL);
+    assert((long) shmcreate((char*) 0, PGSIZE) == ERR_FAULT);
+    assert((long) shmattach("no-such-segment") == ERR_NOTEXIST);
+    assert(shmdetach((void*) 0) == ERR_INVAL);
+
+    pass("shm-test");
+    exit(0);
+    return 0;
+}
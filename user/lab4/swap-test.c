@@ -0,0 +1,47 @@
+#include <lib/test.h>
+#include <lib/stddef.h>
+
+#define PGSIZE 4096
+// more memory than qemu gives the machine, so some of it has to be swapped out
+#define NPAGES (640 * 1024 * 1024 / PGSIZE)
+
+int
+main()
+{
+    int i, pid, status;
+    char *a;
+
+    if ((long) (a = sbrk(NPAGES * PGSIZE)) < 0) {
+        error("swap test failed to grow heap, return value was %d", a);
+    }
+    for (i = 0; i < NPAGES; i++) {
+        *(int*) (a + i * PGSIZE) = i;
+    }
+    for (i = 0; i < NPAGES; i++) {
+        if (*(int*) (a + i * PGSIZE) != i) {
+            error("page %d has value %d after swapping", i, *(int*) (a + i * PGSIZE));
+        }
+    }
+
+    // a child shares the parent's swapped out pages
+    if ((pid = fork()) < 0) {
+        error("swap test fork failed, return value was %d", pid);
+    }
+    if (pid == 0) {
+        for (i = 0; i < NPAGES; i += 64) {
+            assert(*(int*) (a + i * PGSIZE) == i);
+            *(int*) (a + i * PGSIZE) = -i;
+        }
+        exit(0);
+    }
+    assert(wait(pid, &status) == pid && status == 0);
+    for (i = 0; i < NPAGES; i += 64) {
+        if (*(int*) (a + i * PGSIZE) != i) {
+            error("child's write to page %d was seen by parent", i);
+        }
+    }
+
+    pass("swap-test");
+    exit(0);
+    return 0;
+}